@@ -0,0 +1,46 @@
+/*
+ * ioctl interface of the portfs kernel module, shared with the userspace
+ * utility.
+ */
+
+#ifndef PORTFS_IOCTL_H
+#define PORTFS_IOCTL_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <cstdint>
+#include <sys/ioctl.h>
+#endif // __KERNEL__
+
+#define PORTFS_IOC_MAGIC 'P'
+
+/*
+ * Moves the data of a regular file into one contiguous run of blocks and
+ * replaces its extent list. Files with fewer than 'min_extents' extents
+ * are left alone.
+ */
+struct portfs_defrag_args
+{
+    uint32_t min_extents;       // In
+    uint32_t extents_before;    // Out
+    uint32_t extents_after;     // Out
+    uint32_t moved_blocks;      // Out
+};
+
+#define PORTFS_IOC_DEFRAG _IOWR(PORTFS_IOC_MAGIC, 1, struct portfs_defrag_args)
+
+/*
+ * Grows the mounted image to 'new_size' bytes, rounded down to whole
+ * blocks. The image can only grow; the filetable keeps its size.
+ */
+struct portfs_grow_args
+{
+    uint64_t new_size;          // In
+    uint64_t total_blocks;      // Out
+};
+
+#define PORTFS_IOC_GROW _IOWR(PORTFS_IOC_MAGIC, 2, struct portfs_grow_args)
+
+#endif // PORTFS_IOCTL_H
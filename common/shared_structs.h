@@ -22,6 +22,52 @@ typedef uint64_t portfs_be64;
 
 #define DIRECT_EXTENTS 4
 
+// Superblock flags
+#define PORTFS_SB_FREE_INDEX 0x1    // The free extent list saved at unmount is valid
+#define PORTFS_SB_INO_BITMAP 0x2    // The inode bitmap matches the filetable, cleared while mounted
+
+/*
+ * Superblock features, a kernel refuses to mount images with features it
+ * does not know.
+ * PORTFS_FEATURE_64BIT: total_blocks_hi is used and data extents are
+ * stored as disk_extent64 with a 48-bit start. Metadata blocks (bitmap,
+ * filetable, extent tree nodes, directories, free space index) always
+ * stay below block 2^32, so their 32-bit block fields are unchanged.
+ */
+#define PORTFS_FEATURE_64BIT 0x1
+/*
+ * PORTFS_FEATURE_INO_SLOT: the inode number of every filetable entry is its
+ * slot + 1, an inode is read from its slot without scanning the filetable.
+ */
+#define PORTFS_FEATURE_INO_SLOT 0x2
+/*
+ * PORTFS_FEATURE_INO_BITMAP: a bitmap at ino_bitmap_start has bit N set
+ * while filetable slot N is in use, requires PORTFS_FEATURE_INO_SLOT.
+ * next_free_ino_hint is the inode number the next search starts from.
+ */
+#define PORTFS_FEATURE_INO_BITMAP 0x4
+/*
+ * PORTFS_FEATURE_DIR_EXTENTS: a directory entry is stored as disk_file_data
+ * like a regular file and the directory spans all blocks of its extents.
+ * Without it a directory has a single dir_block.
+ */
+#define PORTFS_FEATURE_DIR_EXTENTS 0x8
+/*
+ * PORTFS_FEATURE_DIR_FILETYPE: every directory entry stores the file type
+ * of its inode (FT_* of linux/fs_types.h) in the last byte of the name
+ * field, readdir reports it without reading the inode.
+ */
+#define PORTFS_FEATURE_DIR_FILETYPE 0x10
+/*
+ * PORTFS_FEATURE_DIR_VARLEN: directory blocks hold variable length records
+ * of inode number, name length, file type and a name of up to 255 bytes
+ * instead of fixed 68-byte entries.
+ */
+#define PORTFS_FEATURE_DIR_VARLEN 0x20
+#define PORTFS_SUPPORTED_FEATURES (PORTFS_FEATURE_64BIT | PORTFS_FEATURE_INO_SLOT \
+                                   | PORTFS_FEATURE_INO_BITMAP | PORTFS_FEATURE_DIR_EXTENTS \
+                                   | PORTFS_FEATURE_DIR_FILETYPE | PORTFS_FEATURE_DIR_VARLEN)
+
 struct portfs_disk_superblock {
     portfs_be32 magic_number;
     portfs_be32 block_size;
@@ -30,9 +76,6 @@ struct portfs_disk_superblock {
     portfs_be32 filetable_size;     // Size in blocks
     portfs_be32 block_bitmap_start; // Offset in blocks
     portfs_be32 block_bitmap_size;  // Size in blocks
-    //portfs_be32 ino_bitmap_start;   // Offset in blocks
-    //portfs_be32 ino_bitmap_size;    // Size in blocks
-    //portfs_be32 next_free_ino_hint; // last found free ino
     portfs_be32 data_start;         // Offset in blocks
     portfs_be32 max_file_count;
     portfs_be32 checksum;
@@ -40,6 +83,17 @@ struct portfs_disk_superblock {
     portfs_be64 last_mount_time;
     portfs_be64 last_write_time;
     portfs_be32 flags;
+
+    portfs_be32 free_index_start;   // Free extent list saved at unmount, offset in blocks
+    portfs_be32 free_index_extents; // Number of entries in the list
+    portfs_be32 free_index_crc;     // crc32 of the list
+
+    portfs_be32 features;
+    portfs_be32 total_blocks_hi;    // With PORTFS_FEATURE_64BIT
+
+    portfs_be32 ino_bitmap_start;   // With PORTFS_FEATURE_INO_BITMAP, offset in blocks
+    portfs_be32 ino_bitmap_size;    // Size in blocks
+    portfs_be32 next_free_ino_hint; // Inode number the search for a free one starts at
 } __attribute__((packed));
 
 struct disk_extent
@@ -48,11 +102,51 @@ struct disk_extent
     portfs_be32 length;
 }__attribute__((packed));
 
+// disk_extent of 64-bit images, the same size with a 16-bit length
+struct disk_extent64
+{
+    portfs_be32 start_lo;
+    portfs_be16 start_hi;
+    portfs_be16 length;
+} __attribute__((packed));
+
+// Free space index entry of 64-bit images, where free runs may exceed 2^16 blocks
+struct disk_free_extent64
+{
+    portfs_be64 start_block;
+    portfs_be32 length;
+} __attribute__((packed));
+
+/*
+ * Extents past DIRECT_EXTENTS live in a B+tree rooted at extents_block.
+ * Every node starts with this header; leaves (depth 0) hold disk_extent
+ * entries in file order, index nodes hold disk_extent_index entries.
+ * A root block without the magic is an older flat array of disk_extent.
+ */
+#define PORTFS_EXTENT_NODE_MAGIC 0x50455854 // "PEXT"
+
+struct disk_extent_node_header
+{
+    portfs_be32 magic;
+    portfs_be16 entries;
+    portfs_be16 depth;
+} __attribute__((packed));
+
+struct disk_extent_index
+{
+    portfs_be32 logical_block;  // First logical block covered by the child
+    portfs_be32 child_block;
+} __attribute__((packed));
+
 struct disk_file_data
 {
     portfs_be16 extent_count;
     portfs_be32 extents_block;
-    struct disk_extent direct_extents[DIRECT_EXTENTS];
+    union
+    {
+        struct disk_extent direct_extents[DIRECT_EXTENTS];
+        struct disk_extent64 direct_extents64[DIRECT_EXTENTS];
+    };
 } __attribute__((packed));
 
 struct disk_dir_data
@@ -80,7 +174,7 @@ extern "C"
 
 struct extent
 {
-    uint32_t start_block;
+    uint64_t start_block;
     uint32_t length;
 };
 
@@ -97,21 +191,28 @@ struct dir_data
     uint32_t parent_dir_ino;
 };
 
-struct dir_entry;
+struct portfs_dir_map;
+struct portfs_extent_map;
+struct portfs_bcache;
+struct portfs_qos;
+struct portfs_sysfs;
+struct portfs_alloc_groups;
+struct portfs_discard;
+struct portfs_filetable;
 struct filetable_entry
 {
     uint32_t ino;
     uint16_t mode;
     uint64_t size_in_bytes;
-    union
-    {
-        struct file_data file;
-        struct dir_data dir;
-    };
+    struct file_data file;      // Also used by directories with PORTFS_FEATURE_DIR_EXTENTS
+    struct dir_data dir;
 
 #ifdef __KERNEL__
-    struct extent *indirect_extents;
-    struct dir_entry *dir_entries;
+    struct portfs_extent_map *extent_map;
+    struct portfs_dir_map *dir_map;
+    uint32_t prealloc_blocks;   // Current preallocation window of a growing file
+    uint32_t slot;              // Index in the on-disk filetable
+    bool layout_dirty;          // Size or extents changed since portfs_sync_file_entry()
 #endif // __KERNEL__
 };
 
@@ -119,14 +220,11 @@ struct portfs_superblock
 {
     uint32_t magic_number;
     uint32_t block_size;
-    uint32_t total_blocks;
+    uint64_t total_blocks;
     uint32_t filetable_start;    // Offset in blocks
     uint32_t filetable_size;     // Size in blocks
     uint32_t block_bitmap_start; // Offset in blocks
     uint32_t block_bitmap_size;  // Size in blocks
-    //uint32_t ino_bitmap_start;   // Offset in blocks
-    //uint32_t ino_bitmap_size;    // Size in blocks
-    //uint32_t next_free_ino_hint; // last found free ino
     uint32_t data_start;         // Offset in blocks
     uint32_t max_file_count;
     uint32_t checksum;
@@ -135,10 +233,23 @@ struct portfs_superblock
     uint64_t last_write_time;
     uint32_t flags;
 
+    uint32_t free_index_start;   // Free extent list saved at unmount, offset in blocks
+    uint32_t free_index_extents; // Number of entries in the list
+    uint32_t free_index_crc;     // crc32 of the list
+
+    uint32_t features;
+
+    uint32_t ino_bitmap_start;   // With PORTFS_FEATURE_INO_BITMAP, offset in blocks
+    uint32_t ino_bitmap_size;    // Size in blocks
+    uint32_t next_free_ino_hint; // Inode number the search for a free one starts at
+
 #ifdef __KERNEL__
-    struct filetable_entry *filetable;
-    uint8_t *block_bitmap;
-    uint8_t *ino_bitmap;
+    struct portfs_filetable *filetable;
+    struct portfs_bcache *bcache;
+    struct portfs_qos *qos;
+    struct portfs_sysfs *sysfs;
+    struct portfs_alloc_groups *alloc_groups;
+    struct portfs_discard *discard;     // NULL unless mounted with -o discard
 
     struct super_block *super;
 #endif
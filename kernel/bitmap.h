@@ -1,48 +1,74 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
 #include <linux/types.h>
 
 #include "shared_structs.h"
 
+/*
+ * On-disk bitmaps keep bit N in byte N / 8 at position N % 8, which is the
+ * kernel's little-endian bitmap layout. The *_le helpers scan them a word
+ * at a time on any host; on little-endian hosts the layout also matches
+ * native bitmaps, so ranges are set and cleared with bitmap_set/clear.
+ */
+
 static inline int portfs_bitmap_is_set(uint8_t *bitmap, uint32_t bit)
 {
-    // TODO: probably need to lock bitmap
-    return bitmap[bit / 8] & (1 << (bit % 8));
+    return test_bit_le(bit, bitmap);
 }
 
 
 static inline void portfs_bitmap_set_bit(uint8_t *bitmap, uint32_t bit)
 {
-    // TODO: probably need to lock bitmap
-    bitmap[bit / 8] |= (1 << (bit % 8));
+    __set_bit_le(bit, bitmap);
 }
 
 
 static inline void portfs_bitmap_set_bits(uint8_t *bitmap, uint32_t start_bit, uint32_t length)
 {
-    // TODO: probably need to lock bitmap
+#ifdef __LITTLE_ENDIAN
+    bitmap_set((unsigned long *)bitmap, start_bit, length);
+#else
     for (uint32_t i = start_bit; i < start_bit + length; ++i)
     {
         portfs_bitmap_set_bit(bitmap, i);
     }
+#endif
 }
 
 
 static inline void portfs_bitmap_clear_bit(uint8_t *bitmap, uint32_t bit)
 {
-    // TODO: probably need to lock bitmap
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+    __clear_bit_le(bit, bitmap);
 }
 
 
 static inline void portfs_bitmap_clear_bits(uint8_t *bitmap, uint32_t start_bit, uint32_t length)
 {
-    // TODO: probably need to lock bitmap
+#ifdef __LITTLE_ENDIAN
+    bitmap_clear((unsigned long *)bitmap, start_bit, length);
+#else
     for (uint32_t i = start_bit; i < start_bit + length; ++i)
     {
         portfs_bitmap_clear_bit(bitmap, i);
     }
+#endif
+}
+
+
+// Returns the first clear bit in [offset, size) or size if there is none
+static inline uint32_t portfs_bitmap_next_zero(uint8_t *bitmap, uint32_t size, uint32_t offset)
+{
+    return find_next_zero_bit_le(bitmap, size, offset);
+}
+
+
+// Returns the first set bit in [offset, size) or size if there is none
+static inline uint32_t portfs_bitmap_next_set(uint8_t *bitmap, uint32_t size, uint32_t offset)
+{
+    return find_next_bit_le(bitmap, size, offset);
 }
 
 #endif // BITMAP_H
@@ -0,0 +1,200 @@
+/*
+ *
+ * Block bitmap access.
+ * The bitmap is never loaded as a whole: its blocks go through the buffer
+ * cache, read on first use and written back only when dirty, so memory
+ * use and mount time follow the blocks actually touched rather than the
+ * size of the image.
+ */
+#include "block_bitmap.h"
+
+#include "linux/err.h"
+#include "linux/fs.h"
+#include "linux/math64.h"
+#include "linux/pagemap.h"
+
+#include "portfs.h"
+#include "bitmap.h"
+#include "buffer_cache.h"
+#include "shared_structs.h"
+
+static inline uint32_t portfs_bits_per_bitmap_block(struct portfs_superblock *psb)
+{
+    return psb->block_size * BITS_PER_BYTE;
+}
+
+
+// Returns the bitmap block holding the bit of 'block' and the bit's offset in it
+static inline uint32_t portfs_bitmap_block_of(struct portfs_superblock *psb, uint64_t block,
+                                              uint32_t *bit)
+{
+    return psb->block_bitmap_start + div_u64_rem(block, portfs_bits_per_bitmap_block(psb), bit);
+}
+
+
+static int portfs_update_blocks(struct portfs_superblock *psb, uint64_t start_block,
+                                uint32_t length, bool allocated)
+{
+    const uint32_t bits = portfs_bits_per_bitmap_block(psb);
+
+    while (length > 0)
+    {
+        uint32_t bit;
+        uint32_t bitmap_block = portfs_bitmap_block_of(psb, start_block, &bit);
+        uint32_t count = min(length, bits - bit);
+
+        struct portfs_buf *buf = portfs_bread(psb, bitmap_block);
+        if (IS_ERR(buf))
+        {
+            pr_err("portfs_update_blocks: Failed to read bitmap of block %llu", start_block);
+            return PTR_ERR(buf);
+        }
+
+        if (allocated)
+            portfs_bitmap_set_bits(buf->data, bit, count);
+        else
+            portfs_bitmap_clear_bits(buf->data, bit, count);
+        portfs_bmark_dirty(buf);
+        portfs_brelse(buf);
+
+        start_block += count;
+        length -= count;
+    }
+
+    return 0;
+}
+
+
+/*
+ * A failure may leave part of the range updated; callers keep their free
+ * space accounting unchanged, so the worst case is a leaked block until
+ * the next bitmap scan.
+ */
+int set_blocks_allocated(struct portfs_superblock *psb, uint64_t start_block, uint32_t length)
+{
+    return portfs_update_blocks(psb, start_block, length, true);
+}
+
+
+int clear_blocks_allocated(struct portfs_superblock *psb, uint64_t start_block, uint32_t length)
+{
+    return portfs_update_blocks(psb, start_block, length, false);
+}
+
+
+// Stores the first block in [from, end) whose bit equals 'allocated', or end
+static int portfs_find_block(struct portfs_superblock *psb, uint64_t from, uint64_t end,
+                             bool allocated, uint64_t *found)
+{
+    const uint32_t bits = portfs_bits_per_bitmap_block(psb);
+    uint64_t block = from;
+
+    while (block < end)
+    {
+        uint32_t offset;
+        uint32_t bitmap_block = portfs_bitmap_block_of(psb, block, &offset);
+        uint64_t base = block - offset;
+        uint32_t limit = min_t(u64, bits, end - base);
+
+        struct portfs_buf *buf = portfs_bread(psb, bitmap_block);
+        if (IS_ERR(buf))
+        {
+            pr_err("portfs_find_block: Failed to read bitmap of block %llu", block);
+            return PTR_ERR(buf);
+        }
+
+        uint32_t bit = allocated ? portfs_bitmap_next_set(buf->data, limit, offset)
+                                 : portfs_bitmap_next_zero(buf->data, limit, offset);
+        portfs_brelse(buf);
+
+        if (bit < limit)
+        {
+            *found = base + bit;
+            return 0;
+        }
+        block = base + limit;
+    }
+
+    *found = end;
+    return 0;
+}
+
+
+int find_free_block(struct portfs_superblock *psb, uint64_t from, uint64_t end, uint64_t *found)
+{
+    return portfs_find_block(psb, max_t(u64, from, psb->data_start), end, false, found);
+}
+
+
+int find_allocated_block(struct portfs_superblock *psb, uint64_t from, uint64_t end,
+                         uint64_t *found)
+{
+    return portfs_find_block(psb, from, end, true, found);
+}
+
+
+/*
+ * Writes the bitmap blocks covering the range if they are dirty and
+ * starts their writeback. The caller waits for it and syncs.
+ */
+int portfs_write_block_bitmap_range(struct portfs_superblock *psb,
+                                    uint64_t start_block, uint32_t length)
+{
+    if (length == 0)
+        return 0;
+
+    uint32_t bit;
+    uint32_t first = portfs_bitmap_block_of(psb, start_block, &bit);
+    uint32_t last = portfs_bitmap_block_of(psb, start_block + length - 1, &bit);
+
+    for (uint32_t block = first; block <= last; ++block)
+    {
+        struct portfs_buf *buf = portfs_bread(psb, block);
+        if (IS_ERR(buf))
+            return PTR_ERR(buf);
+
+        int err = portfs_bsync(buf);
+        portfs_brelse(buf);
+        if (err)
+        {
+            pr_err("portfs_write_block_bitmap_range: Failed to write bitmap block %u", block);
+            return err;
+        }
+    }
+
+    loff_t range_start = (loff_t)first * psb->block_size;
+    loff_t range_end = (loff_t)(last + 1) * psb->block_size - 1;
+    return filemap_fdatawrite_range(storage_filp->f_mapping, range_start, range_end);
+}
+
+
+/*
+ * Writes the bitmap into 'new_size' blocks at 'new_start' through the
+ * buffer cache, zeroing the blocks past the current bitmap. Callers switch
+ * block_bitmap_start once the copy is flushed.
+ */
+int portfs_copy_block_bitmap(struct portfs_superblock *psb, uint32_t new_start, uint32_t new_size)
+{
+    for (uint32_t i = 0; i < new_size; ++i)
+    {
+        struct portfs_buf *dst = portfs_bnew(psb, new_start + i);
+        if (IS_ERR(dst))
+            return PTR_ERR(dst);
+
+        if (i < psb->block_bitmap_size)
+        {
+            struct portfs_buf *src = portfs_bread(psb, psb->block_bitmap_start + i);
+            if (IS_ERR(src))
+            {
+                portfs_brelse(dst);
+                pr_err("portfs_copy_block_bitmap: Failed to read bitmap block %u", i);
+                return PTR_ERR(src);
+            }
+            memcpy(dst->data, src->data, psb->block_size);
+            portfs_brelse(src);
+        }
+        portfs_brelse(dst);
+    }
+
+    return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ *
+ * Metadata buffer cache.
+ * Keeps recently used metadata blocks of the storage file in memory.
+ * Blocks are read on first use, modified in place by their users and
+ * written back only when dirty.
+ */
+#include "buffer_cache.h"
+
+#include "linux/err.h"
+#include "linux/fs.h"
+#include "linux/hashtable.h"
+#include "linux/mutex.h"
+#include "linux/slab.h"
+#include "linux/sort.h"
+
+#include "portfs.h"
+#include "shared_structs.h"
+
+#define PORTFS_BCACHE_HASH_BITS 10
+#define PORTFS_BCACHE_MAX_BUFS 1024
+
+struct portfs_bcache
+{
+    struct mutex lock;
+    DECLARE_HASHTABLE(buckets, PORTFS_BCACHE_HASH_BITS);
+    struct list_head lru;       // Most recently used first
+    size_t nr_bufs;
+    size_t max_bufs;
+    uint32_t block_size;
+};
+
+
+static struct portfs_buf *portfs_bcache_lookup(struct portfs_bcache *cache, uint32_t block)
+{
+    struct portfs_buf *buf;
+    hash_for_each_possible(cache->buckets, buf, hash, block)
+    {
+        if (buf->block == block)
+            return buf;
+    }
+    return NULL;
+}
+
+
+static int portfs_buf_write(struct portfs_bcache *cache, struct portfs_buf *buf)
+{
+    loff_t pos = (loff_t)buf->block * cache->block_size;
+    ssize_t bytes_written = kernel_write(storage_filp, buf->data, cache->block_size, &pos);
+    if (bytes_written < 0)
+    {
+        pr_err("portfs_buf_write: Failed to write block %u", buf->block);
+        return bytes_written;
+    }
+    if (bytes_written != cache->block_size)
+    {
+        pr_err("portfs_buf_write: Short write of block %u", buf->block);
+        return -EIO;
+    }
+
+    buf->dirty = false;
+    return 0;
+}
+
+
+static void portfs_buf_free(struct portfs_bcache *cache, struct portfs_buf *buf)
+{
+    hash_del(&buf->hash);
+    list_del(&buf->lru);
+    cache->nr_bufs--;
+    kfree(buf->data);
+    kfree(buf);
+}
+
+
+// Called with cache->lock held
+static void portfs_bcache_shrink(struct portfs_bcache *cache)
+{
+    struct portfs_buf *buf, *tmp;
+    list_for_each_entry_safe_reverse(buf, tmp, &cache->lru, lru)
+    {
+        if (cache->nr_bufs <= cache->max_bufs)
+            break;
+        if (buf->refcount > 0)
+            continue;
+        if (buf->dirty && portfs_buf_write(cache, buf) != 0)
+            continue;
+
+        portfs_buf_free(cache, buf);
+    }
+}
+
+
+static struct portfs_buf *portfs_bcache_get(struct portfs_superblock *psb,
+                                            uint32_t block, bool read)
+{
+    struct portfs_bcache *cache = psb->bcache;
+    struct portfs_buf *buf;
+
+    mutex_lock(&cache->lock);
+    buf = portfs_bcache_lookup(cache, block);
+    if (buf)
+    {
+        buf->refcount++;
+        list_move(&buf->lru, &cache->lru);
+        mutex_unlock(&cache->lock);
+        return buf;
+    }
+    mutex_unlock(&cache->lock);
+
+    struct portfs_buf *new_buf = kmalloc(sizeof(*new_buf), GFP_KERNEL);
+    if (!new_buf)
+        return ERR_PTR(-ENOMEM);
+
+    new_buf->data = kmalloc(cache->block_size, GFP_KERNEL);
+    if (!new_buf->data)
+    {
+        kfree(new_buf);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    if (read)
+    {
+        loff_t pos = (loff_t)block * cache->block_size;
+        ssize_t bytes_read = kernel_read(storage_filp, new_buf->data, cache->block_size, &pos);
+        if (bytes_read != cache->block_size)
+        {
+            pr_err("portfs_bcache_get: Failed to read block %u", block);
+            kfree(new_buf->data);
+            kfree(new_buf);
+            return ERR_PTR(bytes_read < 0 ? bytes_read : -EIO);
+        }
+    }
+    else
+    {
+        memset(new_buf->data, 0, cache->block_size);
+    }
+
+    new_buf->block = block;
+    new_buf->refcount = 1;
+    new_buf->dirty = false;
+    new_buf->cache = cache;
+
+    mutex_lock(&cache->lock);
+    buf = portfs_bcache_lookup(cache, block);
+    if (buf)
+    {
+        // Somebody else cached the block while we were reading it
+        buf->refcount++;
+        list_move(&buf->lru, &cache->lru);
+        mutex_unlock(&cache->lock);
+        kfree(new_buf->data);
+        kfree(new_buf);
+        return buf;
+    }
+
+    hash_add(cache->buckets, &new_buf->hash, block);
+    list_add(&new_buf->lru, &cache->lru);
+    cache->nr_bufs++;
+    portfs_bcache_shrink(cache);
+    mutex_unlock(&cache->lock);
+
+    return new_buf;
+}
+
+
+struct portfs_buf *portfs_bread(struct portfs_superblock *psb, uint32_t block)
+{
+    return portfs_bcache_get(psb, block, true);
+}
+
+
+/*
+ * Returns a zeroed buffer for a freshly allocated block without reading
+ * its old contents from the storage file.
+ */
+struct portfs_buf *portfs_bnew(struct portfs_superblock *psb, uint32_t block)
+{
+    struct portfs_buf *buf = portfs_bcache_get(psb, block, false);
+    if (IS_ERR(buf))
+        return buf;
+
+    memset(buf->data, 0, psb->block_size);
+    portfs_bmark_dirty(buf);
+    return buf;
+}
+
+
+void portfs_brelse(struct portfs_buf *buf)
+{
+    if (!buf)
+        return;
+
+    mutex_lock(&buf->cache->lock);
+    buf->refcount--;
+    mutex_unlock(&buf->cache->lock);
+}
+
+
+void portfs_bmark_dirty(struct portfs_buf *buf)
+{
+    mutex_lock(&buf->cache->lock);
+    buf->dirty = true;
+    mutex_unlock(&buf->cache->lock);
+}
+
+
+int portfs_bsync(struct portfs_buf *buf)
+{
+    int err = 0;
+    mutex_lock(&buf->cache->lock);
+    if (buf->dirty)
+        err = portfs_buf_write(buf->cache, buf);
+    mutex_unlock(&buf->cache->lock);
+    return err;
+}
+
+
+// Drops a cached block that was freed, its contents are no longer needed
+void portfs_bforget(struct portfs_superblock *psb, uint32_t block)
+{
+    struct portfs_bcache *cache = psb->bcache;
+    if (!cache)
+        return;
+
+    mutex_lock(&cache->lock);
+    struct portfs_buf *buf = portfs_bcache_lookup(cache, block);
+    if (buf)
+    {
+        buf->dirty = false;
+        if (buf->refcount == 0)
+            portfs_buf_free(cache, buf);
+    }
+    mutex_unlock(&cache->lock);
+}
+
+
+static int portfs_buf_cmp(const void *a, const void *b)
+{
+    const struct portfs_buf *buf_a = *(const struct portfs_buf **)a;
+    const struct portfs_buf *buf_b = *(const struct portfs_buf **)b;
+
+    if (buf_a->block < buf_b->block)
+        return -1;
+    return buf_a->block > buf_b->block;
+}
+
+
+// Writes back all dirty buffers in ascending block order
+int portfs_bcache_flush(struct portfs_superblock *psb)
+{
+    struct portfs_bcache *cache = psb->bcache;
+    if (!cache)
+        return 0;
+
+    mutex_lock(&cache->lock);
+
+    size_t nr_dirty = 0;
+    struct portfs_buf *buf;
+    list_for_each_entry(buf, &cache->lru, lru)
+    {
+        if (buf->dirty)
+            nr_dirty++;
+    }
+
+    if (nr_dirty == 0)
+    {
+        mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    struct portfs_buf **dirty_bufs = kmalloc_array(nr_dirty, sizeof(*dirty_bufs), GFP_KERNEL);
+    if (!dirty_bufs)
+    {
+        mutex_unlock(&cache->lock);
+        return -ENOMEM;
+    }
+
+    size_t i = 0;
+    list_for_each_entry(buf, &cache->lru, lru)
+    {
+        if (buf->dirty)
+            dirty_bufs[i++] = buf;
+    }
+
+    sort(dirty_bufs, nr_dirty, sizeof(*dirty_bufs), portfs_buf_cmp, NULL);
+
+    int ret = 0;
+    for (i = 0; i < nr_dirty; ++i)
+    {
+        int err = portfs_buf_write(cache, dirty_bufs[i]);
+        if (err && !ret)
+            ret = err;
+    }
+
+    mutex_unlock(&cache->lock);
+    kfree(dirty_bufs);
+
+    pr_debug("portfs_bcache_flush: Wrote %zu dirty blocks", nr_dirty);
+    return ret;
+}
+
+
+int portfs_bcache_init(struct portfs_superblock *psb)
+{
+    struct portfs_bcache *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+    if (!cache)
+    {
+        pr_err("portfs_bcache_init: Could not allocate memory");
+        return -ENOMEM;
+    }
+
+    mutex_init(&cache->lock);
+    hash_init(cache->buckets);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->nr_bufs = 0;
+    cache->max_bufs = PORTFS_BCACHE_MAX_BUFS;
+    cache->block_size = psb->block_size;
+
+    psb->bcache = cache;
+    return 0;
+}
+
+
+void portfs_bcache_destroy(struct portfs_superblock *psb)
+{
+    struct portfs_bcache *cache = psb->bcache;
+    if (!cache)
+        return;
+
+    portfs_bcache_flush(psb);
+
+    struct portfs_buf *buf, *tmp;
+    list_for_each_entry_safe(buf, tmp, &cache->lru, lru)
+    {
+        if (buf->refcount > 0)
+            pr_warn("portfs_bcache_destroy: Block %u is still referenced", buf->block);
+        portfs_buf_free(cache, buf);
+    }
+
+    kfree(cache);
+    psb->bcache = NULL;
+}
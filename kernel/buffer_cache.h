@@ -0,0 +1,37 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+struct portfs_superblock;
+struct portfs_bcache;
+
+/*
+ * A cached metadata block of the storage file.
+ * 'data' holds block_size bytes in on-disk format.
+ */
+struct portfs_buf
+{
+    uint32_t block;
+    void *data;
+    int refcount;
+    bool dirty;
+
+    struct portfs_bcache *cache;
+    struct hlist_node hash;
+    struct list_head lru;
+};
+
+int portfs_bcache_init(struct portfs_superblock *psb);
+void portfs_bcache_destroy(struct portfs_superblock *psb);
+int portfs_bcache_flush(struct portfs_superblock *psb);
+
+struct portfs_buf *portfs_bread(struct portfs_superblock *psb, uint32_t block);
+struct portfs_buf *portfs_bnew(struct portfs_superblock *psb, uint32_t block);
+void portfs_brelse(struct portfs_buf *buf);
+void portfs_bmark_dirty(struct portfs_buf *buf);
+int portfs_bsync(struct portfs_buf *buf);
+void portfs_bforget(struct portfs_superblock *psb, uint32_t block);
+
+#endif // BUFFER_CACHE_H
@@ -1,80 +1,555 @@
+/*
+ *
+ * Directory entries.
+ * With PORTFS_FEATURE_DIR_EXTENTS a directory keeps its blocks in extents
+ * like a regular file and grows by one block whenever no block has room
+ * for a new name. Older images have a single dir_block per directory.
+ * With PORTFS_FEATURE_DIR_VARLEN a block holds records sized by their
+ * name, otherwise fixed entries with names of up to 63 bytes.
+ * Names are found through a hash index of the loaded slots. It only lives
+ * in memory and is built when the directory is loaded.
+ */
 #include "directory.h"
 
 #include <linux/fs.h>
-#include <linux/string.h>
+#include "linux/atomic.h"
+#include "linux/bitmap.h"
+#include "linux/err.h"
+#include "linux/hash.h"
+#include "linux/log2.h"
+#include "linux/mm.h"
 #include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/stringhash.h"
 
 #include "portfs.h"
 #include "inode.h"
 #include "file.h"
-#include "block_bitmap.h"
+#include "buffer_cache.h"
+#include "extent_alloc.h"
+#include "extent_map.h"
 
-static int portfs_de_alloc_block(struct portfs_superblock *psb, struct filetable_entry *parent_dir)
+// Blocks of the directory on disk
+static uint32_t portfs_dir_blocks(struct filetable_entry *dir)
 {
-    uint32_t dir_block = find_free_block(psb);
-    if (dir_block == -1)
-        return -ENOSPC;
-    set_block_allocated(psb->block_bitmap, dir_block);
-    set_dir_block(parent_dir, dir_block);
-    return dir_block;
+    if (dir->file.extent_count == 0)
+        return dir->dir.dir_block ? 1 : 0;
+    return portfs_get_allocated_size(dir, 1);
+}
+
+
+// Storage block of directory block 'index', the extent map is loaded by the caller
+static int portfs_dir_block_nr(struct filetable_entry *dir, uint32_t index, uint32_t *block)
+{
+    if (dir->file.extent_count == 0)
+    {
+        if (index != 0 || dir->dir.dir_block == 0)
+            return -EIO;
+        *block = dir->dir.dir_block;
+        return 0;
+    }
+
+    u32 ext_logical;
+    ssize_t i = portfs_find_extent(dir, index, &ext_logical);
+    if (i < 0)
+        return -EIO;
+
+    *block = get_extent(dir, i)->start_block + (index - ext_logical);
+    return 0;
+}
+
+
+// Bytes an entry with a 'name_len' byte name takes in a directory block
+static inline uint32_t portfs_dir_rec_size(struct portfs_superblock *psb, uint32_t name_len)
+{
+    if (portfs_has_dir_varlen(psb))
+        return sizeof(struct disk_dir_rec) + name_len;
+    return sizeof(struct disk_dir_entry);
 }
 
 
+// Bytes of an empty directory block that entries can use
+static inline uint32_t portfs_dir_block_room(struct portfs_superblock *psb)
+{
+    if (portfs_has_dir_varlen(psb))
+        return psb->block_size;
+    return get_max_dir_entries(psb) * sizeof(struct disk_dir_entry);
+}
+
+
+static inline uint32_t portfs_dir_hash(const struct portfs_dir_map *map,
+                                       const char *name, uint32_t name_len)
+{
+    return hash_32(full_name_hash(NULL, name, name_len), map->hash_bits);
+}
+
+
+static void portfs_dir_hash_insert(struct portfs_dir_map *map, uint32_t slot)
+{
+    struct dir_entry *entry = &map->entries[slot];
+    uint32_t bucket = portfs_dir_hash(map, entry->name, entry->name_len);
+    map->hash_next[slot] = map->hash_heads[bucket];
+    map->hash_heads[bucket] = slot + 1;
+}
+
+
+// Unlinks 'slot' from its chain, called before its name is freed
+static void portfs_dir_hash_remove(struct portfs_dir_map *map, uint32_t slot)
+{
+    struct dir_entry *entry = &map->entries[slot];
+    uint32_t *link = &map->hash_heads[portfs_dir_hash(map, entry->name, entry->name_len)];
+    while (*link != 0 && *link != slot + 1)
+        link = &map->hash_next[*link - 1];
+
+    if (*link != 0)
+        *link = map->hash_next[slot];
+    map->hash_next[slot] = 0;
+}
+
+
+// Copies 'count' elements into a new zeroed array of 'new_count'
+static void *portfs_dir_grow_array(const void *old, size_t count, size_t new_count, size_t size)
+{
+    void *arr = kvcalloc(new_count, size, GFP_KERNEL);
+    if (arr && old)
+        memcpy(arr, old, count * size);
+    return arr;
+}
+
+
+/*
+ * Makes room for 'slots' entries. The capacity doubles and the name index
+ * is rebuilt with it, with at least one bucket per slot, so chains stay
+ * short and growing is amortized constant time.
+ */
+static int portfs_dir_reserve_slots(struct portfs_dir_map *map, uint32_t slots)
+{
+    if (slots <= map->capacity)
+        return 0;
+
+    uint32_t capacity = max3(slots, map->capacity * 2, 64u);
+    uint32_t hash_bits = ilog2(roundup_pow_of_two(capacity));
+
+    struct dir_entry *entries = portfs_dir_grow_array(map->entries, map->slots, capacity,
+                                                      sizeof(*entries));
+    uint32_t *hash_next = kvcalloc(capacity, sizeof(*hash_next), GFP_KERNEL);
+    uint32_t *hash_heads = kvcalloc(1UL << hash_bits, sizeof(*hash_heads), GFP_KERNEL);
+    if (!entries || !hash_next || !hash_heads)
+    {
+        kvfree(entries);
+        kvfree(hash_next);
+        kvfree(hash_heads);
+        return -ENOMEM;
+    }
+
+    // Free slots are chained through hash_next as well
+    if (map->hash_next)
+    {
+        for (uint32_t free = map->free_slots; free != 0; free = map->hash_next[free - 1])
+            hash_next[free - 1] = map->hash_next[free - 1];
+    }
+
+    kvfree(map->entries);
+    kvfree(map->hash_next);
+    kvfree(map->hash_heads);
+    map->entries = entries;
+    map->hash_next = hash_next;
+    map->hash_heads = hash_heads;
+    map->hash_bits = hash_bits;
+    map->capacity = capacity;
+
+    for (uint32_t i = 0; i < map->slots; ++i)
+    {
+        if (map->entries[i].inode_number != 0)
+            portfs_dir_hash_insert(map, i);
+    }
+    return 0;
+}
+
+
+// Makes room for 'blocks' directory blocks in the per-block arrays
+static int portfs_dir_reserve_blocks(struct portfs_dir_map *map, uint32_t blocks)
+{
+    if (blocks <= map->block_capacity)
+        return 0;
+
+    uint32_t capacity = max3(blocks, map->block_capacity * 2, 1u);
+
+    uint32_t *block_heads = portfs_dir_grow_array(map->block_heads, map->blocks, capacity,
+                                                  sizeof(*block_heads));
+    uint32_t *block_free = portfs_dir_grow_array(map->block_free, map->blocks, capacity,
+                                                 sizeof(*block_free));
+    unsigned long *dirty = portfs_dir_grow_array(map->dirty, BITS_TO_LONGS(map->blocks),
+                                                 BITS_TO_LONGS(capacity), sizeof(*dirty));
+    if (!block_heads || !block_free || !dirty)
+    {
+        kvfree(block_heads);
+        kvfree(block_free);
+        kvfree(dirty);
+        return -ENOMEM;
+    }
+
+    kvfree(map->block_heads);
+    kvfree(map->block_free);
+    kvfree(map->dirty);
+    map->block_heads = block_heads;
+    map->block_free = block_free;
+    map->dirty = dirty;
+    map->block_capacity = capacity;
+    return 0;
+}
+
+
+// Stores a new entry in directory block 'block', which has room for it
+static int portfs_dir_insert(struct portfs_superblock *psb, struct portfs_dir_map *map,
+                             uint32_t block, const char *name, uint32_t name_len,
+                             uint32_t ino, uint8_t file_type)
+{
+    char *entry_name = kmemdup_nul(name, name_len, GFP_KERNEL);
+    if (!entry_name)
+        return -ENOMEM;
+
+    uint32_t slot;
+    if (map->free_slots != 0)
+    {
+        slot = map->free_slots - 1;
+        map->free_slots = map->hash_next[slot];
+    }
+    else
+    {
+        int err = portfs_dir_reserve_slots(map, map->slots + 1);
+        if (err)
+        {
+            kfree(entry_name);
+            return err;
+        }
+        slot = map->slots++;
+    }
+
+    struct dir_entry *entry = &map->entries[slot];
+    entry->name = entry_name;
+    entry->name_len = name_len;
+    entry->inode_number = ino;
+    entry->file_type = file_type;
+    entry->block = block;
+    entry->block_next = map->block_heads[block];
+    map->block_heads[block] = slot + 1;
+    map->block_free[block] -= portfs_dir_rec_size(psb, name_len);
+
+    portfs_dir_hash_insert(map, slot);
+    map->used++;
+    return 0;
+}
+
+
+// Decodes the entries of directory block 'block' into the map
+static int portfs_dir_decode_block(struct portfs_superblock *psb, struct portfs_dir_map *map,
+                                   uint32_t block, const void *data)
+{
+    int err = 0;
+
+    if (!portfs_has_dir_varlen(psb))
+    {
+        const struct disk_dir_entry *disk_entries = data;
+        for (uint32_t j = 0; !err && j < get_max_dir_entries(psb); ++j)
+        {
+            const struct disk_dir_entry *disk_entry = &disk_entries[j];
+            uint32_t ino = be32_to_cpu(disk_entry->inode_number);
+            if (ino == 0)
+                continue;
+
+            uint8_t file_type = portfs_has_dir_filetype(psb) ? disk_entry->file_type : FT_UNKNOWN;
+            err = portfs_dir_insert(psb, map, block, disk_entry->name,
+                                    strnlen(disk_entry->name, sizeof(disk_entry->name)),
+                                    ino, file_type);
+        }
+        return err;
+    }
+
+    uint32_t offset = 0;
+    while (!err && offset + sizeof(struct disk_dir_rec) <= psb->block_size)
+    {
+        const struct disk_dir_rec *rec = data + offset;
+        if (rec->name_len == 0)
+            break;
+
+        uint32_t rec_size = portfs_dir_rec_size(psb, rec->name_len);
+        uint32_t ino = be32_to_cpu(rec->inode_number);
+        if (offset + rec_size > psb->block_size || ino == 0)
+        {
+            pr_err("portfs_dir_decode_block: Corrupted record at offset %u", offset);
+            return -EUCLEAN;
+        }
+
+        err = portfs_dir_insert(psb, map, block, rec->name, rec->name_len, ino, rec->file_type);
+        offset += rec_size;
+    }
+    return err;
+}
+
+
+// Lays out the entries of directory block 'block' in 'data', which is zeroed
+static void portfs_dir_encode_block(struct portfs_superblock *psb, struct portfs_dir_map *map,
+                                    uint32_t block, void *data)
+{
+    uint32_t offset = 0;
+    for (uint32_t next = map->block_heads[block]; next != 0;
+         next = map->entries[next - 1].block_next)
+    {
+        const struct dir_entry *entry = &map->entries[next - 1];
+
+        if (portfs_has_dir_varlen(psb))
+        {
+            struct disk_dir_rec *rec = data + offset;
+            rec->inode_number = cpu_to_be32(entry->inode_number);
+            rec->name_len = entry->name_len;
+            rec->file_type = entry->file_type;
+            memcpy(rec->name, entry->name, entry->name_len);
+        }
+        else
+        {
+            struct disk_dir_entry *disk_entry = data + offset;
+            disk_entry->inode_number = cpu_to_be32(entry->inode_number);
+            memcpy(disk_entry->name, entry->name, entry->name_len);
+            disk_entry->file_type = portfs_has_dir_filetype(psb) ? entry->file_type : 0;
+        }
+        offset += portfs_dir_rec_size(psb, entry->name_len);
+    }
+}
+
+
+static void portfs_dir_map_free(struct portfs_dir_map *map)
+{
+    for (uint32_t i = 0; i < map->slots; ++i)
+        kfree(map->entries[i].name);
+
+    kvfree(map->entries);
+    kvfree(map->hash_heads);
+    kvfree(map->hash_next);
+    kvfree(map->block_heads);
+    kvfree(map->block_free);
+    kvfree(map->dirty);
+    kfree(map);
+}
+
+
+void portfs_drop_dir_data(struct filetable_entry *dir)
+{
+    struct portfs_dir_map *map = dir->dir_map;
+    if (!map)
+        return;
+
+    portfs_dir_map_free(map);
+    dir->dir_map = NULL;
+}
+
+
+/*
+ * Readers such as lookup and readdir may load a directory concurrently,
+ * so the map is built privately and only published once complete. The
+ * loser of a race frees its copy.
+ */
 int portfs_load_dir_data(struct portfs_superblock *psb,
                          struct filetable_entry *parent_dir)
 {
-    uint16_t num_entries = get_max_dir_entries(psb);
-    uint32_t mem_size = num_entries * sizeof(*parent_dir->dir_entries);
+    if (smp_load_acquire(&parent_dir->dir_map))
+        return 0;
+
+    if (parent_dir->file.extent_count > DIRECT_EXTENTS)
+    {
+        int err = portfs_load_extents(psb, parent_dir);
+        if (err)
+            return err;
+    }
 
-    parent_dir->dir_entries = kzalloc(mem_size, GFP_KERNEL);
-    if (!parent_dir->dir_entries)
+    struct portfs_dir_map *map = kzalloc(sizeof(*map), GFP_KERNEL);
+    if (!map)
         return -ENOMEM;
 
-    uint32_t dir_block = get_dir_block(parent_dir);
-    if (dir_block == 0)
+    const uint32_t blocks = portfs_dir_blocks(parent_dir);
+    int err = portfs_dir_reserve_blocks(map, blocks);
+
+    // An empty directory gets its first block with the first entry, see portfs_de_add()
+    for (uint32_t i = 0; !err && i < blocks; ++i)
+    {
+        uint32_t block;
+        err = portfs_dir_block_nr(parent_dir, i, &block);
+        struct portfs_buf *buf = err ? ERR_PTR(err) : portfs_bread(psb, block);
+        if (IS_ERR(buf))
+        {
+            err = PTR_ERR(buf);
+            break;
+        }
+
+        map->block_free[i] = portfs_dir_block_room(psb);
+        map->blocks++;
+        err = portfs_dir_decode_block(psb, map, i, buf->data);
+        portfs_brelse(buf);
+    }
+
+    if (err)
+    {
+        pr_err("portfs_load_dir_data: Failed to load directory ino %u", parent_dir->ino);
+        portfs_dir_map_free(map);
+        return err;
+    }
+
+    if (cmpxchg_release(&parent_dir->dir_map, NULL, map))
+        portfs_dir_map_free(map);
+    return 0;
+}
+
+
+// Encodes the changed blocks of the directory into the buffer cache
+int portfs_write_dir_data(struct portfs_superblock *psb, struct filetable_entry *dir)
+{
+    struct portfs_dir_map *map = dir->dir_map;
+    if (!map)
+        return 0;
+
+    unsigned long i;
+    for_each_set_bit(i, map->dirty, map->blocks)
     {
-        dir_block = portfs_de_alloc_block(psb, parent_dir);
-        if (dir_block < 0)
+        // A changed block is laid out from scratch, so it is not read first
+        uint32_t block;
+        int err = portfs_dir_block_nr(dir, i, &block);
+        struct portfs_buf *buf = err ? ERR_PTR(err) : portfs_bnew(psb, block);
+        if (IS_ERR(buf))
         {
-            kfree(parent_dir->dir_entries);
-            parent_dir->dir_entries = NULL;
-            return dir_block;
+            pr_err("portfs_write_dir_data: Failed to get block %lu of ino %u", i, dir->ino);
+            return PTR_ERR(buf);
         }
+
+        portfs_dir_encode_block(psb, map, i, buf->data);
+        portfs_brelse(buf);
+        __clear_bit(i, map->dirty);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Appends one block to a directory with extents, right after its last
+ * block if that one is free. Directory blocks are metadata and go
+ * through the buffer cache, so they come from portfs_alloc_block().
+ */
+static int portfs_dir_append_block(struct portfs_superblock *psb, struct filetable_entry *dir,
+                                   uint32_t *block)
+{
+    const size_t count = dir->file.extent_count;
+    const struct extent *last = count ? get_extent(dir, count - 1) : NULL;
+    u64 goal = last ? last->start_block + last->length : 0;
+
+    int err = portfs_alloc_block(psb, goal, block);
+    if (err)
+        return err;
+
+    if (last && *block == goal && last->length < portfs_max_extent_length(psb))
+    {
+        get_extent_mut(dir, count - 1)->length++;
+        return 0;
+    }
+
+    if (count >= U16_MAX)
+        err = -ENOSPC;
+    else if (count >= DIRECT_EXTENTS)
+        err = portfs_reserve_extents(psb, dir, count + 1);
+    if (err)
+    {
+        portfs_release_blocks(psb, *block, 1);
+        return err;
+    }
+
+    struct extent *ext = get_extent_mut(dir, count);
+    ext->start_block = *block;
+    ext->length = 1;
+    dir->file.extent_count = count + 1;
+    return 0;
+}
+
+
+// Adds a zeroed block to the directory, callers mark the directory dirty
+static int portfs_dir_grow(struct portfs_superblock *psb, struct filetable_entry *dir)
+{
+    struct portfs_dir_map *map = dir->dir_map;
+
+    // Directories of older images cannot have more than their one block
+    const bool extents = portfs_has_dir_extents(psb);
+    if (!extents && map->blocks > 0)
+        return -ENOSPC;
+
+    int err = portfs_dir_reserve_blocks(map, map->blocks + 1);
+    if (err)
+        return err;
+
+    uint32_t block;
+    if (extents)
+    {
+        err = portfs_dir_append_block(psb, dir, &block);
     }
     else
     {
-        uint32_t disk_size = psb->block_size;
-        struct disk_dir_entry *buf = kmalloc(disk_size, GFP_KERNEL);
-        if (!buf)
-            return -ENOMEM;
+        err = portfs_alloc_block(psb, 0, &block);
+        if (!err)
+            dir->dir.dir_block = block;
+    }
+    if (err)
+        return err;
 
-        loff_t offset = dir_block * psb->block_size;
-        ssize_t bytes_read = kernel_read(storage_filp, buf, disk_size, &offset);
-        if (bytes_read < 0)
+    struct portfs_buf *buf = portfs_bnew(psb, block);
+    if (IS_ERR(buf))
+    {
+        if (extents)
         {
-            kfree(parent_dir->dir_entries);
-            kfree(buf);
-            return bytes_read;
+            portfs_free_tail_blocks(psb, dir, map->blocks);
         }
-        if (bytes_read != disk_size)
+        else
         {
-            kfree(parent_dir->dir_entries);
-            kfree(buf);
-            return -EIO;
+            dir->dir.dir_block = 0;
+            portfs_release_blocks(psb, block, 1);
         }
+        return PTR_ERR(buf);
+    }
+    portfs_brelse(buf);
+
+    map->block_heads[map->blocks] = 0;
+    map->block_free[map->blocks] = portfs_dir_block_room(psb);
+    map->blocks++;
+    dir->size_in_bytes = (u64)map->blocks * psb->block_size;
+    return 0;
+}
 
-        for (int i = 0; i < num_entries; ++i)
-        {
-            struct disk_dir_entry *disk_entry = &buf[i];
-            struct dir_entry *entry = &parent_dir->dir_entries[i];
 
-            entry->inode_number = be32_to_cpu(disk_entry->inode_number);
-            strncpy(entry->name, disk_entry->name, sizeof(entry->name));
-            entry->name[sizeof(entry->name) - 1] = '\0';
+// Releases every block of a directory that is being removed
+void portfs_free_dir_blocks(struct portfs_superblock *psb, struct filetable_entry *dir)
+{
+    if (dir->file.extent_count == 0)
+    {
+        if (dir->dir.dir_block != 0)
+        {
+            portfs_bforget(psb, dir->dir.dir_block);
+            portfs_release_blocks(psb, dir->dir.dir_block, 1);
+            dir->dir.dir_block = 0;
         }
-        kfree(buf);
+        return;
     }
-    return 0;
+
+    if (dir->file.extent_count > DIRECT_EXTENTS && portfs_load_extents(psb, dir))
+    {
+        pr_err("portfs_free_dir_blocks: Leaking the blocks of ino %u", dir->ino);
+        return;
+    }
+
+    // Cached copies must not be written over the blocks once they are reused
+    for (size_t i = 0; i < dir->file.extent_count; ++i)
+    {
+        const struct extent *ext = get_extent(dir, i);
+        for (u32 j = 0; j < ext->length; ++j)
+            portfs_bforget(psb, ext->start_block + j);
+    }
+    portfs_free_tail_blocks(psb, dir, 0);
+    dir->size_in_bytes = 0;
 }
 
 
@@ -83,47 +558,59 @@ bool portfs_is_dir_empty(struct portfs_superblock *psb, struct filetable_entry *
     if (get_dir_block(dir) == 0)
         return true;
 
-    if (!dir->dir_entries)
-        portfs_load_dir_data(psb, dir);
+    // A directory that cannot be read is not reported as empty
+    if (portfs_load_dir_data(psb, dir))
+        return false;
 
-    uint16_t num_entries = get_max_dir_entries(psb);
-    for (int i = 0; i < num_entries; ++i)
-    {
-        struct dir_entry *entry = &dir->dir_entries[i];
-        if (entry->inode_number != 0)
-            return false;
-    }
-
-    return true;
+    return dir->dir_map->used == 0;
 }
 
 
 int portfs_de_add(struct portfs_superblock *psb,
                   struct filetable_entry *parent_dir,
-                  struct dir_entry *dir_entry)
+                  const char *name, uint32_t ino, uint8_t file_type)
 {
-    if (!parent_dir || !dir_entry)
+    if (!parent_dir || !name)
         return -EINVAL;
     if (!is_directory(parent_dir))
         return -ENOTDIR;
 
-    if (!parent_dir->dir_entries)
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > portfs_max_name_len(psb))
+        return -ENAMETOOLONG;
+
+    int err = portfs_load_dir_data(psb, parent_dir);
+    if (err)
+        return err;
+
+    // The first block from the hint with room for the record
+    struct portfs_dir_map *map = parent_dir->dir_map;
+    const uint32_t rec_size = portfs_dir_rec_size(psb, name_len);
+    const uint32_t min_rec_size = portfs_dir_rec_size(psb, 1);
+    uint32_t block = map->free_hint;
+    while (block < map->blocks && map->block_free[block] < rec_size)
     {
-        portfs_load_dir_data(psb, parent_dir);
+        if (block == map->free_hint && map->block_free[block] < min_rec_size)
+            map->free_hint++;
+        ++block;
     }
 
-    uint16_t num_entries = get_max_dir_entries(psb);
-    for (int i = 0; i < num_entries; ++i)
+    if (block == map->blocks)
     {
-        struct dir_entry *entry = &parent_dir->dir_entries[i];
-        if (entry->inode_number == 0)
+        err = portfs_dir_grow(psb, parent_dir);
+        if (err)
         {
-            entry->inode_number = dir_entry->inode_number;
-            strncpy(entry->name, dir_entry->name, sizeof(entry->name));
-            break;
+            pr_err("portfs_de_add: Failed to grow directory ino %u, error: %d",
+                   parent_dir->ino, err);
+            return err;
         }
     }
 
+    err = portfs_dir_insert(psb, map, block, name, name_len, ino, file_type);
+    if (err)
+        return err;
+
+    __set_bit(block, map->dirty);
     return 0;
 }
 
@@ -136,17 +623,22 @@ struct dir_entry *portfs_de_find(struct portfs_superblock *psb,
     if (!is_directory(parent_dir))
         return ERR_PTR(-ENOTDIR);
 
-    if (!parent_dir->dir_entries)
-        portfs_load_dir_data(psb, parent_dir);
+    int err = portfs_load_dir_data(psb, parent_dir);
+    if (err)
+        return ERR_PTR(err);
+
+    // A name that does not fit an entry cannot be in the directory
+    struct portfs_dir_map *map = parent_dir->dir_map;
+    size_t name_len = strlen(name);
+    if (!map->hash_heads || name_len > portfs_max_name_len(psb))
+        return NULL;
 
-    uint16_t num_entries = get_max_dir_entries(psb);
-    for (int i = 0; i < num_entries; ++i)
+    for (uint32_t next = map->hash_heads[portfs_dir_hash(map, name, name_len)]; next != 0;
+         next = map->hash_next[next - 1])
     {
-        struct dir_entry *curr_entry = &parent_dir->dir_entries[i];
-        if (strcmp(curr_entry->name, name) == 0)
-        {
+        struct dir_entry *curr_entry = &map->entries[next - 1];
+        if (curr_entry->name_len == name_len && memcmp(curr_entry->name, name, name_len) == 0)
             return curr_entry;
-        }
     }
 
     return NULL;
@@ -164,19 +656,29 @@ struct dir_entry *portfs_de_remove(struct portfs_superblock *psb,
 
     pr_info("Removing directory entry '%s' from parent directory\n", name);
 
-    if (!parent_dir->dir_entries)
-        portfs_load_dir_data(psb, parent_dir);
+    struct dir_entry *curr_entry = portfs_de_find(psb, parent_dir, name);
+    if (IS_ERR_OR_NULL(curr_entry))
+        return curr_entry;
 
-    uint16_t num_entries = get_max_dir_entries(psb);
-    for (int i = 0; i < num_entries; ++i)
-    {
-        struct dir_entry *curr_entry = &parent_dir->dir_entries[i];
-        if (strcmp(curr_entry->name, name) == 0)
-        {
-            curr_entry->inode_number = 0;
-            memset(curr_entry->name, 0, MAX_NAME_LENGTH);
-        }
-    }
+    struct portfs_dir_map *map = parent_dir->dir_map;
+    uint32_t slot = curr_entry - map->entries;
+    uint32_t block = curr_entry->block;
+    portfs_dir_hash_remove(map, slot);
+
+    uint32_t *link = &map->block_heads[block];
+    while (*link != slot + 1)
+        link = &map->entries[*link - 1].block_next;
+    *link = curr_entry->block_next;
+
+    map->block_free[block] += portfs_dir_rec_size(psb, curr_entry->name_len);
+    map->free_hint = min(map->free_hint, block);
+    __set_bit(block, map->dirty);
+
+    kfree(curr_entry->name);
+    memset(curr_entry, 0, sizeof(*curr_entry));
+    map->hash_next[slot] = map->free_slots;
+    map->free_slots = slot + 1;
+    map->used--;
 
     return NULL;
 }
@@ -4,22 +4,72 @@
 #include <linux/types.h>
 #include <linux/stat.h>
 
+#include "portfs.h"
 #include "shared_structs.h"
 
-#define MAX_NAME_LENGTH 64
+#define MAX_NAME_LENGTH 64      // Name field of a fixed size entry, with its terminator
+#define PORTFS_NAME_LEN 255     // Longest name of a variable length entry
 
+/*
+ * A loaded directory entry, a free slot has inode number 0 and no name.
+ * Entries of one directory block are chained through block_next.
+ */
 struct dir_entry
 {
-    char name[MAX_NAME_LENGTH];
+    char *name;
     uint32_t inode_number;
+    uint32_t block;             // Directory block the entry is stored in
+    uint32_t block_next;        // Next slot + 1 in the same block, 0 at the end
+    uint8_t name_len;
+    uint8_t file_type;          // FT_* of the inode, FT_UNKNOWN on older images
 };
 
+// Fixed size entry of images without PORTFS_FEATURE_DIR_VARLEN
 struct disk_dir_entry
 {
-    char name[MAX_NAME_LENGTH];
+    char name[MAX_NAME_LENGTH - 1];
+    uint8_t file_type;          // With PORTFS_FEATURE_DIR_FILETYPE, otherwise always zero
     __be32 inode_number;
 } __attribute__((packed));
 
+/*
+ * Variable length entry of PORTFS_FEATURE_DIR_VARLEN images. Records are
+ * packed from the start of the block, a zero name_len or the end of the
+ * block ends the list.
+ */
+struct disk_dir_rec
+{
+    __be32 inode_number;
+    uint8_t name_len;
+    uint8_t file_type;
+    char name[];                // Not terminated
+} __attribute__((packed));
+
+/*
+ * In-memory copy of a directory's entries, loaded on first use and
+ * written back block by block. Slots keep their index while the map is
+ * loaded, so readdir continues from a slot index.
+ */
+struct portfs_dir_map
+{
+    struct dir_entry *entries;
+    uint32_t slots;             // Slots handed out so far, in use or free
+    uint32_t capacity;          // Slots 'entries' and 'hash_next' have room for
+    uint32_t used;              // Slots with an inode number
+    uint32_t free_slots;        // First free slot + 1, chained through hash_next
+
+    uint32_t blocks;            // Directory blocks
+    uint32_t block_capacity;    // Blocks the per-block arrays have room for
+    uint32_t *block_heads;      // First slot + 1 stored in each block
+    uint32_t *block_free;       // Bytes left in each block
+    uint32_t free_hint;         // Blocks below this one have no room for any name
+    unsigned long *dirty;       // Blocks changed since they were last written
+
+    uint32_t *hash_heads;       // First slot + 1 of every name hash chain, 0 if empty
+    uint32_t *hash_next;        // Next slot + 1 in the chain of each used slot
+    uint32_t hash_bits;         // log2 of the bucket count
+};
+
 
 static inline bool is_directory(const struct filetable_entry *fe)
 {
@@ -33,16 +83,12 @@ static inline struct extent *get_direct_extents(struct filetable_entry *fe)
 }
 
 
+// First block of the directory, a placement hint for its files
 static inline uint32_t get_dir_block(struct filetable_entry *fe)
 {
-    return is_directory(fe) ? fe->dir.dir_block : 0;
-}
-
-
-static inline void set_dir_block(struct filetable_entry *fe, uint32_t dir_block)
-{
-    if (is_directory(fe))
-        fe->dir.dir_block = dir_block;
+    if (!is_directory(fe))
+        return 0;
+    return fe->file.extent_count ? fe->file.direct_extents[0].start_block : fe->dir.dir_block;
 }
 
 
@@ -53,9 +99,15 @@ static inline int get_max_dir_entries(struct portfs_superblock *psb)
     return num_entries;
 }
 
+
+static inline uint32_t portfs_max_name_len(const struct portfs_superblock *psb)
+{
+    return portfs_has_dir_varlen(psb) ? PORTFS_NAME_LEN : MAX_NAME_LENGTH - 1;
+}
+
 int portfs_de_add(struct portfs_superblock *psb,
                   struct filetable_entry *parent_dir,
-                  struct dir_entry *dir_entry);
+                  const char *name, uint32_t ino, uint8_t file_type);
 
 struct dir_entry *portfs_de_remove(struct portfs_superblock *psb,
                                    struct filetable_entry *parent_dir,
@@ -73,5 +125,8 @@ bool portfs_is_dir_empty(struct portfs_superblock *psb, struct filetable_entry *
 
 int portfs_load_dir_data(struct portfs_superblock *psb,
                          struct filetable_entry *parent_dir);
+void portfs_drop_dir_data(struct filetable_entry *dir);
+int portfs_write_dir_data(struct portfs_superblock *psb, struct filetable_entry *dir);
+void portfs_free_dir_blocks(struct portfs_superblock *psb, struct filetable_entry *dir);
 
 #endif //DIRECTORY_H
@@ -0,0 +1,201 @@
+/*
+ *
+ * Online discard for mounts with -o discard.
+ * Released blocks are queued and handed back to the host filesystem in
+ * batches: the worker commits the filesystem, sorts the queued ranges,
+ * merges neighbours and punches one hole per merged run. Holes are
+ * punched only where the blocks are still free and their release is on
+ * disk, so blocks reallocated in the meantime keep their new data and a
+ * crash never leaves metadata pointing at a hole. Runs released again
+ * after the commit are queued for the next batch.
+ */
+#include "discard.h"
+
+#include "linux/jiffies.h"
+#include "linux/list.h"
+#include "linux/list_sort.h"
+#include "linux/fs.h"
+#include "linux/slab.h"
+#include "linux/spinlock.h"
+#include "linux/workqueue.h"
+
+#include "extent_alloc.h"
+#include "portfs.h"
+#include "shared_structs.h"
+
+#define PORTFS_DISCARD_DELAY_MS 5000     // Every batch costs a commit
+#define PORTFS_DISCARD_BATCH_BLOCKS 65536   // Flush right away once this much is queued
+
+struct portfs_discard_range
+{
+    u64 start_block;
+    u64 length;
+    struct list_head list;
+};
+
+struct portfs_discard
+{
+    struct portfs_superblock *psb;
+
+    spinlock_t lock;
+    struct list_head pending;
+    u64 pending_blocks;
+
+    struct delayed_work work;
+};
+
+
+static int portfs_discard_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+{
+    const struct portfs_discard_range *ra = list_entry(a, struct portfs_discard_range, list);
+    const struct portfs_discard_range *rb = list_entry(b, struct portfs_discard_range, list);
+
+    if (ra->start_block < rb->start_block)
+        return -1;
+    return ra->start_block > rb->start_block;
+}
+
+
+// Best effort: ranges that cannot be queued are left for FITRIM
+static void portfs_discard_add(struct portfs_discard *discard, u64 start_block, u64 length)
+{
+    struct portfs_discard_range *range = kmalloc(sizeof(*range), GFP_NOFS);
+    if (!range)
+        return;
+
+    range->start_block = start_block;
+    range->length = length;
+
+    spin_lock(&discard->lock);
+    // Files are usually freed extent after extent, so try the last range first
+    struct portfs_discard_range *last = list_last_entry_or_null(&discard->pending,
+                                                                struct portfs_discard_range, list);
+    if (last && last->start_block + last->length == start_block)
+    {
+        last->length += length;
+        kfree(range);
+    }
+    else
+    {
+        list_add_tail(&range->list, &discard->pending);
+    }
+    discard->pending_blocks += length;
+    bool flush_now = discard->pending_blocks >= PORTFS_DISCARD_BATCH_BLOCKS;
+    spin_unlock(&discard->lock);
+
+    if (flush_now)
+        mod_delayed_work(system_unbound_wq, &discard->work, 0);
+    else
+        queue_delayed_work(system_unbound_wq, &discard->work,
+                           msecs_to_jiffies(PORTFS_DISCARD_DELAY_MS));
+}
+
+
+// Runs released again since the last commit are queued once more unless this is the final flush
+static void portfs_discard_run(struct portfs_discard *discard, u64 start_block, u64 end_block,
+                               bool requeue)
+{
+    u64 trimmed = 0;
+    u64 deferred = 0;
+    int err = portfs_trim_free_space(discard->psb, start_block, end_block, 1,
+                                     &trimmed, &deferred);
+    if (err == -EOPNOTSUPP)
+        pr_warn_once("portfs_discard_run: Storage file does not support punching holes");
+    else if (err)
+        pr_err("portfs_discard_run: Failed to discard [%llu ... %llu), error: %d",
+               start_block, end_block, err);
+    else if (deferred && requeue)
+        portfs_discard_add(discard, start_block, end_block - start_block);
+}
+
+
+static void portfs_discard_flush_pending(struct portfs_discard *discard, bool requeue)
+{
+    LIST_HEAD(batch);
+
+    spin_lock(&discard->lock);
+    list_splice_init(&discard->pending, &batch);
+    discard->pending_blocks = 0;
+    spin_unlock(&discard->lock);
+
+    list_sort(NULL, &batch, portfs_discard_cmp);
+
+    struct portfs_discard_range *range, *tmp;
+    u64 run_start = 0;
+    u64 run_end = 0;
+    list_for_each_entry_safe(range, tmp, &batch, list)
+    {
+        u64 range_end = range->start_block + range->length;
+        if (run_end > run_start && range->start_block <= run_end)
+        {
+            run_end = max(run_end, range_end);
+        }
+        else
+        {
+            if (run_end > run_start)
+                portfs_discard_run(discard, run_start, run_end, requeue);
+            run_start = range->start_block;
+            run_end = range_end;
+        }
+
+        list_del(&range->list);
+        kfree(range);
+    }
+
+    if (run_end > run_start)
+        portfs_discard_run(discard, run_start, run_end, requeue);
+}
+
+
+static void portfs_discard_work(struct work_struct *work)
+{
+    struct portfs_discard *discard = container_of(to_delayed_work(work),
+                                                  struct portfs_discard, work);
+    struct super_block *sb = discard->psb->super;
+
+    // Commits the queued releases. Unmount holds s_umount and flushes the queue itself.
+    if (down_read_trylock(&sb->s_umount))
+    {
+        int err = sync_filesystem(sb);
+        up_read(&sb->s_umount);
+        if (err)
+            pr_err("portfs_discard_work: Failed to sync filesystem, error: %d", err);
+    }
+    portfs_discard_flush_pending(discard, true);
+}
+
+
+int portfs_discard_init(struct portfs_superblock *psb)
+{
+    struct portfs_discard *discard = kzalloc(sizeof(*discard), GFP_KERNEL);
+    if (!discard)
+        return -ENOMEM;
+
+    discard->psb = psb;
+    spin_lock_init(&discard->lock);
+    INIT_LIST_HEAD(&discard->pending);
+    INIT_DELAYED_WORK(&discard->work, portfs_discard_work);
+
+    psb->discard = discard;
+    return 0;
+}
+
+
+void portfs_discard_destroy(struct portfs_superblock *psb)
+{
+    struct portfs_discard *discard = psb->discard;
+    if (!discard)
+        return;
+
+    // Blocks released from now on are no longer queued
+    psb->discard = NULL;
+    cancel_delayed_work_sync(&discard->work);
+    portfs_discard_flush_pending(discard, false);
+    kfree(discard);
+}
+
+
+void portfs_discard_queue(struct portfs_superblock *psb, u64 start_block, u32 length)
+{
+    portfs_discard_add(psb->discard, start_block, length);
+}
@@ -0,0 +1,13 @@
+#ifndef DISCARD_H
+#define DISCARD_H
+
+#include <linux/types.h>
+
+struct portfs_superblock;
+
+int portfs_discard_init(struct portfs_superblock *psb);
+void portfs_discard_destroy(struct portfs_superblock *psb);
+
+void portfs_discard_queue(struct portfs_superblock *psb, u64 start_block, u32 length);
+
+#endif // DISCARD_H
@@ -1,24 +1,863 @@
 #include "extent_alloc.h"
 
+#include "linux/atomic.h"
+#include "linux/cpumask.h"
+#include "linux/dcache.h"
 #include "linux/fs.h"
+#include "linux/log2.h"
+#include "linux/rwsem.h"
+#include "linux/sched.h"
+#include "linux/sched/signal.h"
 #include "linux/slab.h"
+#include "linux/smp.h"
 
 #include "extent_tree.h"
 #include "portfs.h"
 #include "shared_structs.h"
 #include "block_bitmap.h"
+#include "buffer_cache.h"
+#include "directory.h"
+#include "discard.h"
+#include "extent_map.h"
+#include "free_index.h"
 
-#define BLOCK_ALLOC_SCALE 1000
-#define BLOCK_ALLOC_MULTIPLIER 1500
+/*
+ * Files that keep growing get a preallocation window past the requested
+ * size, doubled on every extension up to the maximum. The first
+ * allocation of a file is exact, so one-shot writes waste nothing, and
+ * unused blocks are given back when the last writer closes the file.
+ */
+#define PORTFS_PREALLOC_MIN_BLOCKS 16
+#define PORTFS_PREALLOC_MAX_BLOCKS 4096
 
+// Free runs taken out of a group per lock hold while trimming
+#define PORTFS_TRIM_BATCH 64
+
+/*
+ * The data area is split into allocation groups, each with its own free
+ * extent tree and lock, so writers on different CPUs allocate in parallel.
+ * Groups cover whole blocks of the block bitmap, so no bitmap block is
+ * shared between two groups.
+ * Growing the image replaces the group array and may move the bitmap, so
+ * every user of the groups holds resize_lock for reading; a resize holds
+ * it for writing, see portfs_free_space_freeze().
+ */
+#define PORTFS_MIN_GROUP_BLOCKS 32768
+
+/*
+ * Every release is stamped with free_seq. A commit snapshots it in
+ * commit_seq before dirty inodes are written back and publishes the
+ * snapshot in durable_seq once everything is synced, so free extents
+ * stamped up to durable_seq are free on disk as well.
+ */
+struct portfs_alloc_groups
+{
+    u32 count;
+    u32 group_blocks;
+    atomic64_t alloc_requests;
+    atomic64_t free_seq;
+    atomic64_t commit_seq;
+    atomic64_t durable_seq;
+    struct rw_semaphore resize_lock;
+    struct portfs_free_space *groups;
+};
+
+// Bounded only by the on-disk extent counter, the extent tree grows as needed
 inline size_t portfs_max_extents(struct portfs_superblock *psb)
 {
-    return DIRECT_EXTENTS + (psb->block_size / sizeof(struct extent));
+    return U16_MAX;
+}
+
+
+static struct portfs_free_space *portfs_block_group(struct portfs_superblock *psb, u64 block)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    if (block >= psb->total_blocks)
+        return NULL;
+    return &alloc_groups->groups[div_u64(block, alloc_groups->group_blocks)];
+}
+
+
+static u32 portfs_cpu_group(struct portfs_superblock *psb)
+{
+    return raw_smp_processor_id() % psb->alloc_groups->count;
+}
+
+
+static void portfs_init_group(struct portfs_superblock *psb, struct portfs_free_space *free_space,
+                              u32 index, u32 group_blocks)
+{
+    free_space->first_block = max_t(u64, (u64)index * group_blocks, psb->data_start);
+    free_space->end_block = min_t(u64, (u64)(index + 1) * group_blocks, psb->total_blocks);
+    free_space->by_length = RB_ROOT;
+    free_space->by_start = RB_ROOT;
+    mutex_init(&free_space->lock);
+}
+
+
+int portfs_free_space_init(struct portfs_superblock *psb)
+{
+    const u64 bitmap_block_bits = (u64)psb->block_size * BITS_PER_BYTE;
+    u64 group_size = DIV_ROUND_UP_ULL(psb->total_blocks, num_possible_cpus());
+    group_size = round_up(max_t(u64, group_size, PORTFS_MIN_GROUP_BLOCKS), bitmap_block_bits);
+    u32 group_blocks = min_t(u64, group_size, round_down(U32_MAX, bitmap_block_bits));
+    u32 count = DIV_ROUND_UP_ULL(psb->total_blocks, group_blocks);
+
+    struct portfs_alloc_groups *alloc_groups = kzalloc(sizeof(*alloc_groups), GFP_KERNEL);
+    if (!alloc_groups)
+        return -ENOMEM;
+
+    alloc_groups->groups = kvcalloc(count, sizeof(*alloc_groups->groups), GFP_KERNEL);
+    if (!alloc_groups->groups)
+    {
+        kfree(alloc_groups);
+        return -ENOMEM;
+    }
+
+    alloc_groups->count = count;
+    alloc_groups->group_blocks = group_blocks;
+    atomic64_set(&alloc_groups->alloc_requests, 0);
+    atomic64_set(&alloc_groups->free_seq, 1);
+    atomic64_set(&alloc_groups->commit_seq, 0);
+    atomic64_set(&alloc_groups->durable_seq, 0);
+    init_rwsem(&alloc_groups->resize_lock);
+
+    for (u32 i = 0; i < count; ++i)
+        portfs_init_group(psb, &alloc_groups->groups[i], i, group_blocks);
+    psb->alloc_groups = alloc_groups;
+
+    // A clean unmount leaves the free extents behind, anything else needs a bitmap scan
+    int err = -ENOENT;
+    if (psb->flags & PORTFS_SB_FREE_INDEX)
+    {
+        err = portfs_free_index_load(psb);
+        if (err)
+        {
+            pr_warn("portfs_free_space_init: Free space index unusable, error: %d", err);
+            for (u32 i = 0; i < count; ++i)
+                portfs_destroy_extent_tree(&alloc_groups->groups[i]);
+        }
+    }
+    if (err)
+    {
+        err = 0;
+        for (u32 i = 0; i < count && !err; ++i)
+            err = portfs_build_extent_tree(psb, &alloc_groups->groups[i]);
+    }
+
+    if (err)
+    {
+        portfs_free_space_destroy(psb);
+        return err;
+    }
+
+    pr_info("portfs_free_space_init: %u allocation groups of %u blocks", count, group_blocks);
+    return 0;
+}
+
+
+void portfs_free_space_destroy(struct portfs_superblock *psb)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    if (!alloc_groups)
+        return;
+
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+        portfs_destroy_extent_tree(&alloc_groups->groups[i]);
+    kvfree(alloc_groups->groups);
+    kfree(alloc_groups);
+    psb->alloc_groups = NULL;
+}
+
+
+/*
+ * Stops all allocations and frees until portfs_free_space_thaw(), so the
+ * image can be resized. Only the functions documented as safe to call
+ * with the free space frozen may be used in between.
+ */
+void portfs_free_space_freeze(struct portfs_superblock *psb)
+{
+    down_write(&psb->alloc_groups->resize_lock);
+}
+
+
+void portfs_free_space_thaw(struct portfs_superblock *psb)
+{
+    up_write(&psb->alloc_groups->resize_lock);
+}
+
+
+// Called before dirty inodes are written back, later releases belong to the next commit
+void portfs_free_space_commit_begin(struct portfs_superblock *psb)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    if (alloc_groups)
+        atomic64_set(&alloc_groups->commit_seq, atomic64_fetch_inc(&alloc_groups->free_seq));
+}
+
+
+// Called once the buffers and the storage file are synced
+void portfs_free_space_commit_end(struct portfs_superblock *psb)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    if (alloc_groups)
+        atomic64_set(&alloc_groups->durable_seq, atomic64_read(&alloc_groups->commit_seq));
+}
+
+
+/*
+ * Makes the groups cover the image up to 'total_blocks', which must not
+ * be less than the current size. The new blocks are not free yet, they
+ * are added with portfs_free_space_add() once the image is committed.
+ * A grow that fails before that calls this again with the old size, which
+ * drops the groups it added. Called with the free space frozen.
+ */
+int portfs_free_space_extend(struct portfs_superblock *psb, u64 total_blocks)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    const u32 group_blocks = alloc_groups->group_blocks;
+    u32 count = DIV_ROUND_UP_ULL(total_blocks, group_blocks);
+
+    if (count > alloc_groups->count)
+    {
+        struct portfs_free_space *groups = kvcalloc(count, sizeof(*groups), GFP_KERNEL);
+        if (!groups)
+            return -ENOMEM;
+
+        // Nobody holds or waits on the group locks while frozen, and the trees only move their roots
+        for (u32 i = 0; i < alloc_groups->count; ++i)
+        {
+            groups[i] = alloc_groups->groups[i];
+            mutex_init(&groups[i].lock);
+        }
+        for (u32 i = alloc_groups->count; i < count; ++i)
+            portfs_init_group(psb, &groups[i], i, group_blocks);
+
+        kvfree(alloc_groups->groups);
+        alloc_groups->groups = groups;
+    }
+    // Groups past the old size are empty until the grow is committed
+    alloc_groups->count = count;
+
+    for (u32 i = 0; i < count; ++i)
+        alloc_groups->groups[i].end_block = min_t(u64, (u64)(i + 1) * group_blocks, total_blocks);
+    return 0;
+}
+
+
+// Returns blocks to the free space, merging them with free neighbours
+void portfs_release_blocks(struct portfs_superblock *psb, u64 start_block, u32 length)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    down_read(&alloc_groups->resize_lock);
+
+    // Merged file extents may cross group boundaries
+    while (length > 0)
+    {
+        struct portfs_free_space *free_space = portfs_block_group(psb, start_block);
+        if (!free_space)
+        {
+            pr_err("portfs_release_blocks: Block %llu is out of range", start_block);
+            break;
+        }
+        u32 group_length = min_t(u64, length, free_space->end_block - start_block);
+
+        mutex_lock(&free_space->lock);
+        // Blocks that may still be marked in use must not be handed out again
+        int err = clear_blocks_allocated(psb, start_block, group_length);
+        if (!err)
+            err = portfs_extent_tree_insert(free_space, start_block, group_length,
+                                            atomic64_read(&alloc_groups->free_seq));
+        mutex_unlock(&free_space->lock);
+
+        // Blocks missing from the tree are still free in the bitmap, the next mount finds them
+        if (err)
+            pr_err("portfs_release_blocks: Leaking blocks [%llu ... %llu), error: %d",
+                   start_block, start_block + group_length, err);
+        else if (psb->discard)
+            portfs_discard_queue(psb, start_block, group_length);
+
+        start_block += group_length;
+        length -= group_length;
+    }
+
+    up_read(&alloc_groups->resize_lock);
+}
+
+
+/*
+ * Adds a range that is free in the block bitmap to the free extent trees.
+ * Called at mount or with the free space frozen.
+ */
+int portfs_free_space_add(struct portfs_superblock *psb, u64 start_block, u32 length)
+{
+    while (length > 0)
+    {
+        struct portfs_free_space *free_space = portfs_block_group(psb, start_block);
+        if (!free_space || start_block < free_space->first_block)
+            return -EINVAL;
+        u32 group_length = min_t(u64, length, free_space->end_block - start_block);
+
+        mutex_lock(&free_space->lock);
+        int err = portfs_extent_tree_insert(free_space, start_block, group_length, 0);
+        mutex_unlock(&free_space->lock);
+        if (err)
+            return err;
+
+        start_block += group_length;
+        length -= group_length;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns all free extents in block order, with runs that cross group
+ * boundaries merged, in a kvmalloc'ed array. Only meant for unmount,
+ * when nothing allocates or frees blocks anymore.
+ */
+struct extent *portfs_free_space_snapshot(struct portfs_superblock *psb, u32 *count)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+
+    size_t capacity = 0;
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+        capacity += alloc_groups->groups[i].extent_count;
+
+    struct extent *extents = kvmalloc_array(max_t(size_t, capacity, 1), sizeof(*extents),
+                                            GFP_KERNEL);
+    if (!extents)
+        return NULL;
+
+    down_read(&alloc_groups->resize_lock);
+    u32 n = 0;
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[i];
+        struct rb_node *node;
+
+        mutex_lock(&free_space->lock);
+        for (node = rb_first(&free_space->by_start); node && n < capacity; node = rb_next(node))
+        {
+            struct free_extent *ext = rb_entry(node, struct free_extent, start_node);
+            // Lengths stay below 2^32 as every group is shorter than that
+            if (n > 0 && extents[n - 1].start_block + extents[n - 1].length == ext->start_block
+                && extents[n - 1].length <= U32_MAX - ext->length)
+            {
+                extents[n - 1].length += ext->length;
+            }
+            else
+            {
+                extents[n].start_block = ext->start_block;
+                extents[n].length = ext->length;
+                ++n;
+            }
+        }
+        mutex_unlock(&free_space->lock);
+    }
+    up_read(&alloc_groups->resize_lock);
+
+    *count = n;
+    return extents;
+}
+
+
+/*
+ * Takes up to PORTFS_TRIM_BATCH committed free runs of at least
+ * 'min_blocks' blocks inside [block, limit) out of the group's tree, so
+ * they cannot be handed out while they are punched. Returns the block
+ * to continue from.
+ */
+static u64 portfs_trim_take_runs(struct portfs_free_space *free_space, u64 block, u64 limit,
+                                 u32 min_blocks, u64 durable_seq, struct free_extent *runs,
+                                 u32 *count, u64 *deferred_blocks, int *err)
+{
+    *count = 0;
+    while (block < limit && *count < PORTFS_TRIM_BATCH)
+    {
+        struct free_extent *ext = portfs_extent_tree_next(free_space, block);
+        if (!ext || ext->start_block >= limit)
+            return limit;
+
+        u64 run_start = max(ext->start_block, block);
+        u64 run_end = min(ext->start_block + ext->length, limit);
+        block = run_end;
+
+        // Punching a block the disk still sees in use would lose its data after a crash
+        if (ext->freed_seq > durable_seq)
+        {
+            *deferred_blocks += run_end - run_start;
+            continue;
+        }
+        if (run_end - run_start < min_blocks)
+            continue;
+
+        struct free_extent *run = &runs[*count];
+        run->start_block = run_start;
+        run->length = run_end - run_start;
+        run->freed_seq = ext->freed_seq;
+        *err = portfs_extent_tree_carve(free_space, ext, run_start, run->length);
+        if (*err)
+            return block;
+        ++*count;
+    }
+
+    return block;
+}
+
+
+/*
+ * Punches holes into the storage file for the free runs of at least
+ * 'min_blocks' blocks inside [start_block, end_block). Only blocks whose
+ * release has been committed are punched, the others are counted in
+ * '*deferred_blocks'. The runs are taken out of the free extent tree
+ * under the group lock and punched after dropping it.
+ */
+int portfs_trim_free_space(struct portfs_superblock *psb, u64 start_block, u64 end_block,
+                           u32 min_blocks, u64 *trimmed_blocks, u64 *deferred_blocks)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    struct free_extent *runs = kmalloc_array(PORTFS_TRIM_BATCH, sizeof(*runs), GFP_KERNEL);
+    if (!runs)
+        return -ENOMEM;
+
+    down_read(&alloc_groups->resize_lock);
+    const u64 durable_seq = atomic64_read(&alloc_groups->durable_seq);
+    end_block = min(end_block, psb->total_blocks);
+    u64 block = start_block;
+    int err = 0;
+
+    while (block < end_block && !err)
+    {
+        struct portfs_free_space *free_space = portfs_block_group(psb, block);
+        u64 limit = min(end_block, free_space->end_block);
+        u32 count;
+
+        mutex_lock(&free_space->lock);
+        block = portfs_trim_take_runs(free_space, block, limit, min_blocks, durable_seq,
+                                      runs, &count, deferred_blocks, &err);
+        mutex_unlock(&free_space->lock);
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            int punch_err = portfs_storage_punch(psb, runs[i].start_block, runs[i].length);
+            if (punch_err)
+                err = err ? err : punch_err;
+            else
+                *trimmed_blocks += runs[i].length;
+        }
+
+        mutex_lock(&free_space->lock);
+        for (u32 i = 0; i < count; ++i)
+        {
+            if (portfs_extent_tree_insert(free_space, runs[i].start_block, runs[i].length,
+                                          runs[i].freed_seq))
+                pr_err("portfs_trim_free_space: Leaking blocks [%llu ... %llu) until remount",
+                       runs[i].start_block, runs[i].start_block + runs[i].length);
+        }
+        mutex_unlock(&free_space->lock);
+
+        if (!err && fatal_signal_pending(current))
+            err = -EINTR;
+        cond_resched();
+    }
+
+    up_read(&alloc_groups->resize_lock);
+    kfree(runs);
+    return err;
+}
+
+
+void portfs_free_space_get_stats(struct portfs_superblock *psb,
+                                 struct portfs_free_space_stats *stats)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+
+    memset(stats, 0, sizeof(*stats));
+    down_read(&alloc_groups->resize_lock);
+    stats->alloc_requests = atomic64_read(&alloc_groups->alloc_requests);
+    stats->groups = alloc_groups->count;
+
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[i];
+
+        mutex_lock(&free_space->lock);
+        struct rb_node *longest = rb_first(&free_space->by_length);
+        if (longest)
+            stats->max_free_extent = max(stats->max_free_extent,
+                                         rb_entry(longest, struct free_extent, node)->length);
+        stats->free_blocks += free_space->free_blocks;
+        stats->free_extents += free_space->extent_count;
+        stats->alloc_extents += free_space->alloc_extents;
+        stats->goal_hits += free_space->goal_hits;
+        mutex_unlock(&free_space->lock);
+    }
+    up_read(&alloc_groups->resize_lock);
+}
+
+
+// Counts free extents by length, bucket i holds lengths in [2^i, 2^(i+1))
+void portfs_free_space_get_histogram(struct portfs_superblock *psb, u32 *histogram)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    memset(histogram, 0, sizeof(*histogram) * PORTFS_FREE_HISTOGRAM_BUCKETS);
+    down_read(&alloc_groups->resize_lock);
+
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[i];
+
+        mutex_lock(&free_space->lock);
+        struct rb_node *node;
+        for (node = rb_first(&free_space->by_start); node; node = rb_next(node))
+        {
+            struct free_extent *free_ext = rb_entry(node, struct free_extent, start_node);
+            int bucket = min(ilog2(free_ext->length), PORTFS_FREE_HISTOGRAM_BUCKETS - 1);
+            histogram[bucket]++;
+        }
+        mutex_unlock(&free_space->lock);
+    }
+    up_read(&alloc_groups->resize_lock);
+}
+
+
+// Marks a run of the free extent 'free_ext' as in use. Called with free_space->lock held.
+static int portfs_take_blocks_locked(struct portfs_superblock *psb,
+                                     struct portfs_free_space *free_space,
+                                     struct free_extent *free_ext,
+                                     u64 start_block, u32 length, struct extent *out)
+{
+    int err = portfs_extent_tree_carve(free_space, free_ext, start_block, length);
+    if (err)
+        return err;
+
+    err = set_blocks_allocated(psb, start_block, length);
+    if (err)
+    {
+        portfs_extent_tree_insert(free_space, start_block, length,
+                                  atomic64_read(&psb->alloc_groups->free_seq));
+        return err;
+    }
+    free_space->alloc_extents++;
+
+    out->start_block = start_block;
+    out->length = length;
+    return 0;
+}
+
+
+/*
+ * Takes up to 'want' blocks out of one group. The run starts exactly
+ * at 'goal' when that block is free and either the whole request fits
+ * there or 'partial_goal' allows a shorter run (the file is being extended
+ * contiguously). Otherwise the shortest free extent that fits the whole
+ * request is used, and only if none fits the longest one.
+ * Called with free_space->lock held.
+ */
+static int portfs_alloc_extent_locked(struct portfs_superblock *psb,
+                                      struct portfs_free_space *free_space,
+                                      u64 goal, u32 want, bool partial_goal,
+                                      struct extent *out)
+{
+    struct free_extent *free_ext = NULL;
+    u64 start_block = 0;
+
+    if (goal != 0)
+    {
+        free_ext = portfs_extent_tree_find(free_space, goal);
+        if (free_ext && !partial_goal
+            && free_ext->start_block + free_ext->length - goal < want)
+            free_ext = NULL;
+
+        if (free_ext)
+        {
+            start_block = goal;
+            free_space->goal_hits++;
+        }
+    }
+
+    if (!free_ext)
+    {
+        free_ext = portfs_extent_tree_best_fit(free_space, want);
+        if (!free_ext)
+        {
+            struct rb_node *node = rb_first(&free_space->by_length);
+            if (!node)
+                return -ENOSPC;
+            free_ext = rb_entry(node, struct free_extent, node);
+        }
+        start_block = free_ext->start_block;
+    }
+
+    u32 length = min_t(u64, want, free_ext->start_block + free_ext->length - start_block);
+    return portfs_take_blocks_locked(psb, free_space, free_ext, start_block, length, out);
 }
 
+
+/*
+ * Allocates up to 'want' blocks, starting with the group of 'goal' and
+ * moving on to the following groups when it is full. The goal is only a
+ * hint: unless the file is extended contiguously ('partial_goal'), a
+ * writer that finds the goal's group busy takes its CPU's group instead
+ * of waiting for it.
+ */
+static int portfs_alloc_extent(struct portfs_superblock *psb,
+                               u64 goal, u32 want, bool partial_goal,
+                               struct extent *out)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    struct portfs_free_space *goal_group = goal ? portfs_block_group(psb, goal) : NULL;
+    struct portfs_free_space *tried = NULL;
+    u32 first;
+
+    if (goal_group && (partial_goal || mutex_trylock(&goal_group->lock)))
+    {
+        if (partial_goal)
+            mutex_lock(&goal_group->lock);
+        int err = portfs_alloc_extent_locked(psb, goal_group, goal, want, partial_goal, out);
+        mutex_unlock(&goal_group->lock);
+        if (err != -ENOSPC)
+            return err;
+        tried = goal_group;
+        first = goal_group - alloc_groups->groups + 1;
+    }
+    else
+    {
+        first = portfs_cpu_group(psb);
+    }
+
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[(first + i) % alloc_groups->count];
+        if (free_space == tried)
+            continue;
+
+        mutex_lock(&free_space->lock);
+        int err = portfs_alloc_extent_locked(psb, free_space, 0, want, false, out);
+        mutex_unlock(&free_space->lock);
+        if (err != -ENOSPC)
+            return err;
+    }
+
+    return -ENOSPC;
+}
+
+
+/*
+ * Metadata blocks of 64-bit images have to stay addressable with 32 bits:
+ * takes 'goal' if it is free and low enough, otherwise the lowest free
+ * block of the groups below the limit.
+ */
+static int portfs_alloc_low_block(struct portfs_superblock *psb, u64 goal, struct extent *out)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    if (goal >= PORTFS_META_BLOCK_LIMIT)
+        goal = 0;
+
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[i];
+        if (free_space->first_block >= PORTFS_META_BLOCK_LIMIT)
+            break;
+
+        mutex_lock(&free_space->lock);
+        u64 start_block = goal;
+        struct free_extent *free_ext = goal ? portfs_extent_tree_find(free_space, goal) : NULL;
+        if (!free_ext)
+        {
+            struct rb_node *node = rb_first(&free_space->by_start);
+            free_ext = node ? rb_entry(node, struct free_extent, start_node) : NULL;
+            start_block = free_ext ? free_ext->start_block : 0;
+        }
+
+        int err = -ENOSPC;
+        if (free_ext && start_block < PORTFS_META_BLOCK_LIMIT)
+            err = portfs_take_blocks_locked(psb, free_space, free_ext, start_block, 1, out);
+        mutex_unlock(&free_space->lock);
+
+        if (err != -ENOSPC)
+            return err;
+    }
+
+    return -ENOSPC;
+}
+
+
+/*
+ * Allocates a single block for metadata (directory or extent blocks),
+ * at 'goal' if it is free, otherwise from the shortest free extent to
+ * keep long runs for file data.
+ */
+int portfs_alloc_block(struct portfs_superblock *psb, u64 goal, u32 *block)
+{
+    struct extent ext;
+
+    down_read(&psb->alloc_groups->resize_lock);
+    int err = portfs_has_64bit(psb) ? portfs_alloc_low_block(psb, goal, &ext)
+                                    : portfs_alloc_extent(psb, goal, 1, false, &ext);
+    up_read(&psb->alloc_groups->resize_lock);
+    if (err)
+    {
+        pr_err("portfs_alloc_block: No free blocks");
+        return err;
+    }
+    *block = ext.start_block;
+    return 0;
+}
+
+
+/*
+ * Allocates exactly 'length' contiguous blocks or fails with -ENOSPC,
+ * trying the group of 'goal' first and then all the others.
+ */
+int portfs_alloc_contiguous(struct portfs_superblock *psb, u64 goal, u32 length,
+                            struct extent *out)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+    down_read(&alloc_groups->resize_lock);
+
+    struct portfs_free_space *goal_group = goal ? portfs_block_group(psb, goal) : NULL;
+    u32 first = goal_group ? goal_group - alloc_groups->groups : portfs_cpu_group(psb);
+    int err = -ENOSPC;
+
+    for (u32 i = 0; i < alloc_groups->count && err == -ENOSPC; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[(first + i) % alloc_groups->count];
+
+        mutex_lock(&free_space->lock);
+        if (portfs_extent_tree_best_fit(free_space, length))
+            err = portfs_alloc_extent_locked(psb, free_space, 0, length, false, out);
+        mutex_unlock(&free_space->lock);
+    }
+
+    up_read(&alloc_groups->resize_lock);
+    return err;
+}
+
+
+/*
+ * Takes 'length' contiguous blocks that metadata can address, for a
+ * relocated block bitmap, without marking them in the bitmap. Called
+ * with the free space frozen.
+ */
+int portfs_free_space_take_low(struct portfs_superblock *psb, u32 length, struct extent *out)
+{
+    struct portfs_alloc_groups *alloc_groups = psb->alloc_groups;
+
+    for (u32 i = 0; i < alloc_groups->count; ++i)
+    {
+        struct portfs_free_space *free_space = &alloc_groups->groups[i];
+        if (free_space->first_block >= PORTFS_META_BLOCK_LIMIT)
+            break;
+
+        struct free_extent *free_ext = portfs_extent_tree_best_fit(free_space, length);
+        if (!free_ext || free_ext->start_block + length > PORTFS_META_BLOCK_LIMIT)
+            continue;
+
+        u64 start_block = free_ext->start_block;
+        int err = portfs_extent_tree_carve(free_space, free_ext, start_block, length);
+        if (err)
+            return err;
+
+        out->start_block = start_block;
+        out->length = length;
+        return 0;
+    }
+
+    return -ENOSPC;
+}
+
+
+/*
+ * Returns the block a new file's data should preferably start at: the
+ * block of its parent directory, so files of one directory stay close.
+ */
+u32 portfs_dentry_goal(struct dentry *dentry)
+{
+    struct dentry *parent = dget_parent(dentry);
+    struct inode *dir = d_inode(parent);
+    u32 goal = 0;
+
+    if (dir && dir->i_private)
+        goal = get_dir_block(dir->i_private);
+
+    dput(parent);
+    return goal;
+}
+
+
+/*
+ * Merges neighbouring extents of the file that are physically contiguous
+ * and frees the extent tree once everything fits into the filetable
+ * entry again.
+ */
+static void portfs_compact_extents(struct portfs_superblock *psb,
+                                   struct filetable_entry *file_entry)
+{
+    size_t count = file_entry->file.extent_count;
+    if (count < 2)
+        return;
+
+    const u32 max_length = portfs_max_extent_length(psb);
+    size_t last = 0;
+    for (size_t i = 1; i < count; ++i)
+    {
+        // Only extents that change are fetched for writing, so the tree is rewritten from there
+        const struct extent *prev = get_extent(file_entry, last);
+        const struct extent *curr = get_extent(file_entry, i);
+
+        if (prev->start_block + prev->length == curr->start_block
+            && prev->length <= max_length - curr->length)
+        {
+            get_extent_mut(file_entry, last)->length += curr->length;
+        }
+        else
+        {
+            ++last;
+            if (last != i)
+                *get_extent_mut(file_entry, last) = *curr;
+        }
+    }
+
+    if (last + 1 == count)
+        return;
+
+    pr_info("portfs_compact_extents: Merged %zu extents into %zu", count, last + 1);
+    for (size_t i = last + 1; i < count; ++i)
+    {
+        struct extent *ext = get_extent_mut(file_entry, i);
+        ext->start_block = 0;
+        ext->length = 0;
+    }
+    file_entry->file.extent_count = last + 1;
+
+    // Nothing lives in the extent tree anymore
+    if (last + 1 <= DIRECT_EXTENTS)
+        portfs_free_extent_nodes(psb, file_entry);
+}
+
+
+static size_t portfs_prealloc_window(struct filetable_entry *file_entry, size_t blocks_needed)
+{
+    if (file_entry->file.extent_count == 0)
+    {
+        file_entry->prealloc_blocks = 0;
+        return 0;
+    }
+
+    size_t window = max_t(size_t, (size_t)file_entry->prealloc_blocks * 2, blocks_needed);
+    file_entry->prealloc_blocks = clamp_t(size_t, window, PORTFS_PREALLOC_MIN_BLOCKS,
+                                          PORTFS_PREALLOC_MAX_BLOCKS);
+    return file_entry->prealloc_blocks;
+}
+
+
 int portfs_allocate_memory(struct portfs_superblock *psb,
                            struct filetable_entry *file_entry,
-                           size_t bytes_to_allocate)
+                           size_t bytes_to_allocate,
+                           u32 dir_goal)
 {
     pr_info("portfs_allocate_memory: Allocating %zu bytes for file",
             bytes_to_allocate);
@@ -26,21 +865,68 @@ int portfs_allocate_memory(struct portfs_superblock *psb,
         return -EINVAL;
 
     size_t blocks_to_allocate = (bytes_to_allocate + psb->block_size - 1) / psb->block_size;
-    blocks_to_allocate = (blocks_to_allocate * BLOCK_ALLOC_MULTIPLIER) / BLOCK_ALLOC_SCALE;
-
-    struct rb_root free_extent_tree = RB_ROOT;
-    portfs_build_extent_tree(psb, &free_extent_tree);
+    blocks_to_allocate += portfs_prealloc_window(file_entry, blocks_to_allocate);
+    file_entry->layout_dirty = true;
 
     size_t free_ext_idx = file_entry->file.extent_count;
-    if (free_ext_idx >= DIRECT_EXTENTS)
+    if (free_ext_idx > DIRECT_EXTENTS)
     {
-        portfs_alloc_indirect_extents(psb, file_entry);
+        int err = portfs_load_extents(psb, file_entry);
+        if (err)
+            return err;
     }
 
     size_t max_extents = portfs_max_extents(psb);
-    ssize_t remaining_blocks = blocks_to_allocate;
-    struct rb_node *node;
-    for (node = rb_first(&free_extent_tree); node; node = rb_next(node))
+    const u32 max_length = portfs_max_extent_length(psb);
+    size_t remaining_blocks = blocks_to_allocate;
+
+    // Continue right after the last extent, or near the parent directory for a new file
+    u64 goal = dir_goal;
+    struct extent *last = NULL;
+    if (free_ext_idx > 0)
+    {
+        last = get_extent_mut(file_entry, free_ext_idx - 1);
+        goal = last->start_block + last->length;
+    }
+
+    atomic64_inc(&psb->alloc_groups->alloc_requests);
+
+    // Grow the tail extent in place while the blocks right after it are free
+    down_read(&psb->alloc_groups->resize_lock);
+    struct portfs_free_space *free_space = last ? portfs_block_group(psb, goal) : NULL;
+    if (free_space && last->length < max_length)
+    {
+        mutex_lock(&free_space->lock);
+        struct free_extent *next_free = portfs_extent_tree_find(free_space, goal);
+        if (next_free)
+        {
+            u32 length = min3((u64)remaining_blocks, (u64)(max_length - last->length),
+                              next_free->start_block + next_free->length - goal);
+            int err = portfs_extent_tree_carve(free_space, next_free, goal, length);
+            if (!err)
+            {
+                err = set_blocks_allocated(psb, goal, length);
+                if (err)
+                    portfs_extent_tree_insert(free_space, goal, length,
+                                              atomic64_read(&psb->alloc_groups->free_seq));
+            }
+            if (!err)
+            {
+                pr_info("portfs_allocate_memory: extending last extent by [%llu ... %llu)\n",
+                        goal, goal + length);
+                free_space->goal_hits++;
+                free_space->alloc_extents++;
+
+                last->length += length;
+                remaining_blocks -= length;
+                goal += length;
+            }
+        }
+        mutex_unlock(&free_space->lock);
+    }
+    up_read(&psb->alloc_groups->resize_lock);
+
+    while (remaining_blocks > 0)
     {
         if (free_ext_idx >= max_extents)
         {
@@ -48,79 +934,108 @@ int portfs_allocate_memory(struct portfs_superblock *psb,
             break;
         }
 
-        struct free_extent *free_ext = rb_entry(node, struct free_extent, node);
-        remaining_blocks -= free_ext->length;
-
-        pr_info("portfs_allocate_memory: using free extent [%u ... %u)\n",
-                 free_ext->start_block,
-                 free_ext->start_block + free_ext->length);
+        if (free_ext_idx >= DIRECT_EXTENTS)
+        {
+            if (portfs_reserve_extents(psb, file_entry, free_ext_idx + 1))
+                break;
+            // The extent list may have been moved
+            if (last)
+                last = get_extent_mut(file_entry, free_ext_idx - 1);
+        }
 
+        struct extent new_ext;
+        u32 want = min_t(size_t, remaining_blocks, max_length);
+        down_read(&psb->alloc_groups->resize_lock);
+        int err = portfs_alloc_extent(psb, goal, want, last != NULL, &new_ext);
+        up_read(&psb->alloc_groups->resize_lock);
+        if (err)
+            break;
 
-        set_blocks_allocated(psb->block_bitmap,
-                             free_ext->start_block,
-                             free_ext->length);
+        pr_info("portfs_allocate_memory: using free extent [%llu ... %llu)\n",
+                 new_ext.start_block, new_ext.start_block + new_ext.length);
 
-        if (free_ext_idx < DIRECT_EXTENTS)
+        if (last && last->start_block + last->length == new_ext.start_block
+            && last->length <= max_length - new_ext.length)
         {
-            file_entry->file.direct_extents[free_ext_idx].start_block = free_ext->start_block;
-            file_entry->file.direct_extents[free_ext_idx].length = free_ext->length;
+            last->length += new_ext.length;
         }
         else
         {
-            if (!file_entry->indirect_extents)
-            {
-                portfs_alloc_indirect_extents(psb, file_entry);
-            }
-            file_entry->indirect_extents[free_ext_idx - DIRECT_EXTENTS].start_block = free_ext->start_block;
-            file_entry->indirect_extents[free_ext_idx - DIRECT_EXTENTS].length = free_ext->length;
+            last = get_extent_mut(file_entry, free_ext_idx);
+            *last = new_ext;
+            ++free_ext_idx;
         }
-        ++free_ext_idx;
 
-        if (remaining_blocks <= 0)
-            break;
+        remaining_blocks -= new_ext.length;
+        goal = new_ext.start_block + new_ext.length;
     }
 
     file_entry->file.extent_count = free_ext_idx;
-    portfs_destroy_extent_tree(&free_extent_tree);
+    portfs_compact_extents(psb, file_entry);
+
     if (remaining_blocks > 0)
         pr_err("portfs_allocate_memory: Not enough space. Remaining blocks: %zu", remaining_blocks);
 
-    return (remaining_blocks <= 0) ? 0 : -ENOSPC;
+    return (remaining_blocks == 0) ? 0 : -ENOSPC;
 }
 
 
-int portfs_alloc_indirect_extents(struct portfs_superblock *psb,
-                                  struct filetable_entry *file_entry)
+/*
+ * Frees every block of the file past the first 'keep_blocks', shortening
+ * or dropping extents from the end, and the extent tree once the
+ * remaining extents fit into the filetable entry.
+ */
+int portfs_free_tail_blocks(struct portfs_superblock *psb,
+                            struct filetable_entry *file_entry,
+                            size_t keep_blocks)
 {
-    if (!file_entry->indirect_extents)
+    if (file_entry->file.extent_count > DIRECT_EXTENTS)
     {
-        file_entry->indirect_extents = kzalloc(psb->block_size, GFP_KERNEL);
-        if (!file_entry->indirect_extents)
-            return -ENOMEM;
+        int err = portfs_load_extents(psb, file_entry);
+        if (err)
+            return err;
+    }
 
-        if (file_entry->file.extents_block == 0)
+    size_t total_blocks = portfs_get_allocated_size(file_entry, 1);
+    size_t blocks_to_remove = total_blocks > keep_blocks ? total_blocks - keep_blocks : 0;
+    if (blocks_to_remove > 0)
+        file_entry->layout_dirty = true;
+    while (blocks_to_remove > 0 && file_entry->file.extent_count > 0)
+    {
+        struct extent *ext = get_extent_mut(file_entry, file_entry->file.extent_count - 1);
+        if (ext->length <= blocks_to_remove)
         {
-            int free_block = find_free_block(psb);
-            if (free_block == -1)
-            {
-                pr_err("portfs_alloc_indirect_extents: Failed to find free block");
-                return -ENOSPC;
-            }
-            set_block_allocated(psb->block_bitmap, free_block);
-            file_entry->file.extents_block = free_block;
+            blocks_to_remove -= ext->length;
+            portfs_release_blocks(psb, ext->start_block, ext->length);
+            ext->start_block = 0;
+            ext->length = 0;
+            file_entry->file.extent_count--;
         }
         else
         {
-            loff_t offset = file_entry->file.extents_block * psb->block_size;
-            ssize_t bytes_read = kernel_read(storage_filp, file_entry->indirect_extents, psb->block_size, &offset);
-            if (bytes_read != psb->block_size)
-            return -EIO;
+            u32 new_length = ext->length - blocks_to_remove;
+            portfs_release_blocks(psb, ext->start_block + new_length, blocks_to_remove);
+            ext->length = new_length;
+            blocks_to_remove = 0;
         }
     }
+
+    if (file_entry->file.extent_count <= DIRECT_EXTENTS)
+        return portfs_free_extent_nodes(psb, file_entry);
+
     return 0;
 }
 
 
+// Gives back the preallocated blocks past the end of the file
+int portfs_reclaim_prealloc(struct portfs_superblock *psb,
+                            struct filetable_entry *file_entry)
+{
+    size_t used_blocks = DIV_ROUND_UP(file_entry->size_in_bytes, psb->block_size);
+    return portfs_free_tail_blocks(psb, file_entry, used_blocks);
+}
+
+
 size_t portfs_get_allocated_size(const struct filetable_entry *entry,
                                  size_t block_size)
 {
@@ -2,11 +2,50 @@
 
 struct portfs_superblock;
 struct filetable_entry;
+struct dentry;
+struct extent;
 
+#define PORTFS_FREE_HISTOGRAM_BUCKETS 16
+
+struct portfs_free_space_stats
+{
+    u32 groups;
+    u64 free_blocks;
+    u32 free_extents;
+    u32 max_free_extent;
+    u64 alloc_requests;     // Calls to portfs_allocate_memory
+    u64 alloc_extents;      // Extents handed out, including metadata blocks
+    u64 goal_hits;          // Extents placed exactly at the requested goal
+};
+
+int portfs_free_space_init(struct portfs_superblock *psb);
+void portfs_free_space_destroy(struct portfs_superblock *psb);
+void portfs_free_space_freeze(struct portfs_superblock *psb);
+void portfs_free_space_thaw(struct portfs_superblock *psb);
+void portfs_free_space_commit_begin(struct portfs_superblock *psb);
+void portfs_free_space_commit_end(struct portfs_superblock *psb);
+int portfs_free_space_extend(struct portfs_superblock *psb, u64 total_blocks);
+int portfs_free_space_take_low(struct portfs_superblock *psb, u32 length, struct extent *out);
+int portfs_alloc_block(struct portfs_superblock *psb, u64 goal, u32 *block);
+int portfs_alloc_contiguous(struct portfs_superblock *psb, u64 goal, u32 length,
+                            struct extent *out);
+void portfs_release_blocks(struct portfs_superblock *psb, u64 start_block, u32 length);
+int portfs_free_space_add(struct portfs_superblock *psb, u64 start_block, u32 length);
+struct extent *portfs_free_space_snapshot(struct portfs_superblock *psb, u32 *count);
+int portfs_trim_free_space(struct portfs_superblock *psb, u64 start_block, u64 end_block,
+                           u32 min_blocks, u64 *trimmed_blocks, u64 *deferred_blocks);
+void portfs_free_space_get_stats(struct portfs_superblock *psb,
+                                 struct portfs_free_space_stats *stats);
+void portfs_free_space_get_histogram(struct portfs_superblock *psb, u32 *histogram);
+u32 portfs_dentry_goal(struct dentry *dentry);
 int portfs_allocate_memory(struct portfs_superblock *psb,
                            struct filetable_entry *file_entry,
-                           size_t bytes_to_allocate);
-int portfs_alloc_indirect_extents(struct portfs_superblock *psb,
-                                  struct filetable_entry *file_entry);
+                           size_t bytes_to_allocate,
+                           u32 dir_goal);
+int portfs_free_tail_blocks(struct portfs_superblock *psb,
+                            struct filetable_entry *file_entry,
+                            size_t keep_blocks);
+int portfs_reclaim_prealloc(struct portfs_superblock *psb,
+                            struct filetable_entry *file_entry);
 size_t portfs_get_allocated_size(const struct filetable_entry *entry,
                                  size_t block_size);
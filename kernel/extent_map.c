@@ -0,0 +1,590 @@
+/*
+ *
+ * Per-file extent tree.
+ * Extents past DIRECT_EXTENTS are stored in a B+tree of metadata blocks
+ * keyed by logical block. The whole list is loaded into memory on first
+ * use and lookups binary search the logical start of every extent. The
+ * tree is laid out from the list when it is written back, rewriting only
+ * the nodes that cover changed extents while its shape stays the same.
+ */
+#include "extent_map.h"
+
+#include "linux/atomic.h"
+#include "linux/err.h"
+#include "linux/mm.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+
+#include "portfs.h"
+#include "buffer_cache.h"
+#include "extent_alloc.h"
+#include "shared_structs.h"
+
+#define PORTFS_EXTENT_TREE_MAX_DEPTH 8
+
+static size_t portfs_leaf_capacity(struct portfs_superblock *psb)
+{
+    return (psb->block_size - sizeof(struct disk_extent_node_header)) / sizeof(struct disk_extent);
+}
+
+
+static size_t portfs_index_capacity(struct portfs_superblock *psb)
+{
+    return (psb->block_size - sizeof(struct disk_extent_node_header)) / sizeof(struct disk_extent_index);
+}
+
+
+static int portfs_add_extent_node(struct portfs_extent_map *map, u32 block)
+{
+    u32 *nodes = krealloc(map->nodes, (map->node_count + 1) * sizeof(*nodes), GFP_KERNEL);
+    if (!nodes)
+        return -ENOMEM;
+
+    nodes[map->node_count++] = block;
+    map->nodes = nodes;
+    return 0;
+}
+
+
+/*
+ * Reads one node into the map. Leaves append their extents, index nodes
+ * append their children to nodes[], so walking nodes[] in order reads
+ * the tree level by level.
+ */
+static int portfs_read_extent_node(struct portfs_superblock *psb, struct filetable_entry *fe,
+                                   struct portfs_extent_map *map, u32 block, int expected_depth,
+                                   size_t *loaded, bool *packed)
+{
+    struct portfs_buf *buf = portfs_bread(psb, block);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    const struct disk_extent_node_header *header = buf->data;
+    size_t entries = be16_to_cpu(header->entries);
+    int depth = be16_to_cpu(header->depth);
+    int err = 0;
+
+    if (be32_to_cpu(header->magic) != PORTFS_EXTENT_NODE_MAGIC
+        || depth != expected_depth)
+    {
+        pr_err("portfs_read_extent_node: Corrupted extent node %u", block);
+        err = -EIO;
+    }
+    else if (depth == 0)
+    {
+        const struct disk_extent *disk_extents = (const void *)(header + 1);
+        size_t count = fe->file.extent_count - DIRECT_EXTENTS;
+        if (entries > portfs_leaf_capacity(psb) || *loaded + entries > count)
+        {
+            pr_err("portfs_read_extent_node: Too many extents in node %u", block);
+            err = -EIO;
+        }
+        // The writer fills every leaf but the last one
+        else if (entries != min(portfs_leaf_capacity(psb), count - *loaded))
+        {
+            *packed = false;
+        }
+        for (size_t i = 0; !err && i < entries; ++i)
+        {
+            portfs_extent_from_disk(psb, &map->extents[*loaded], &disk_extents[i]);
+            ++*loaded;
+        }
+    }
+    else
+    {
+        const struct disk_extent_index *index = (const void *)(header + 1);
+        if (entries > portfs_index_capacity(psb))
+        {
+            pr_err("portfs_read_extent_node: Too many entries in node %u", block);
+            err = -EIO;
+        }
+        for (size_t i = 0; !err && i < entries; ++i)
+            err = portfs_add_extent_node(map, be32_to_cpu(index[i].child_block));
+    }
+
+    portfs_brelse(buf);
+    return err;
+}
+
+
+// Counts the nodes per level of a tree holding 'count' extents, leaves first
+static int portfs_extent_tree_shape(struct portfs_superblock *psb, size_t count,
+                                    size_t *level_nodes, int *levels)
+{
+    size_t nodes = DIV_ROUND_UP(count, portfs_leaf_capacity(psb));
+    *levels = 0;
+    while (true)
+    {
+        if (*levels > PORTFS_EXTENT_TREE_MAX_DEPTH)
+            return -EFBIG;
+        level_nodes[(*levels)++] = nodes;
+        if (nodes == 1)
+            return 0;
+        nodes = DIV_ROUND_UP(nodes, portfs_index_capacity(psb));
+    }
+}
+
+
+/*
+ * Loads the tree into nodes[] in level order, the layout the writer
+ * uses. Trees laid out otherwise are read as well but left with
+ * tree_extents at 0, so the next write rebuilds them.
+ */
+static int portfs_read_extent_tree(struct portfs_superblock *psb, struct filetable_entry *fe,
+                                   struct portfs_extent_map *map)
+{
+    u32 root = fe->file.extents_block;
+    size_t count = fe->file.extent_count - DIRECT_EXTENTS;
+
+    struct portfs_buf *buf = portfs_bread(psb, root);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    const struct disk_extent_node_header *header = buf->data;
+    bool legacy = be32_to_cpu(header->magic) != PORTFS_EXTENT_NODE_MAGIC;
+    const int root_depth = be16_to_cpu(header->depth);
+
+    int err = 0;
+    if (legacy)
+    {
+        // Flat array written before the tree format, converted on next write
+        const struct disk_extent *disk_extents = buf->data;
+        if (count > psb->block_size / sizeof(struct disk_extent))
+            err = -EIO;
+        else
+            err = portfs_add_extent_node(map, root);
+
+        for (size_t i = 0; !err && i < count; ++i)
+        {
+            portfs_extent_from_disk(psb, &map->extents[i], &disk_extents[i]);
+        }
+    }
+    portfs_brelse(buf);
+
+    // A flat array has no tree shape, tree_extents stays 0 to rebuild it
+    if (legacy)
+        return err;
+
+    if (root_depth > PORTFS_EXTENT_TREE_MAX_DEPTH)
+    {
+        pr_err("portfs_read_extent_tree: Corrupted extent node %u", root);
+        return -EIO;
+    }
+
+    // Nodes seen per level, leaves first
+    size_t level_nodes[PORTFS_EXTENT_TREE_MAX_DEPTH + 1];
+    size_t loaded = 0;
+    bool packed = true;
+    err = portfs_add_extent_node(map, root);
+
+    int depth = root_depth;
+    size_t level_end = map->node_count;
+    level_nodes[depth] = 1;
+    for (u32 i = 0; !err && i < map->node_count; ++i)
+    {
+        if (i == level_end)
+        {
+            --depth;
+            level_nodes[depth] = map->node_count - level_end;
+            level_end = map->node_count;
+        }
+        err = portfs_read_extent_node(psb, fe, map, map->nodes[i], depth, &loaded, &packed);
+
+        // Every node of a level holds at least one extent
+        if (!err && map->node_count - level_end > count)
+        {
+            pr_err("portfs_read_extent_tree: Corrupted extent tree of ino %u", fe->ino);
+            err = -EIO;
+        }
+    }
+
+    if (!err && loaded != count)
+    {
+        pr_err("portfs_read_extent_tree: Expected %zu extents, found %zu", count, loaded);
+        err = -EIO;
+    }
+    if (err)
+        return err;
+
+    size_t shape[PORTFS_EXTENT_TREE_MAX_DEPTH + 1];
+    int levels;
+    if (!packed || portfs_extent_tree_shape(psb, count, shape, &levels)
+        || levels != root_depth + 1)
+    {
+        return 0;
+    }
+    for (int level = 0; level < levels; ++level)
+    {
+        if (shape[level] != level_nodes[level])
+            return 0;
+    }
+
+    map->tree_extents = count;
+    return 0;
+}
+
+
+static struct kmem_cache *portfs_extent_map_cachep;
+
+
+int portfs_extent_map_cache_init(void)
+{
+    portfs_extent_map_cachep = KMEM_CACHE(portfs_extent_map, SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT);
+    return portfs_extent_map_cachep ? 0 : -ENOMEM;
+}
+
+
+void portfs_extent_map_cache_exit(void)
+{
+    kmem_cache_destroy(portfs_extent_map_cachep);
+}
+
+
+static int portfs_extent_map_reserve(struct portfs_superblock *psb, struct portfs_extent_map *map,
+                                     size_t extent_count)
+{
+    if (map->logical && extent_count <= DIRECT_EXTENTS + map->capacity)
+        return 0;
+
+    size_t capacity = max(map->capacity * 2, psb->block_size / sizeof(struct extent));
+    capacity = max(capacity, extent_count - DIRECT_EXTENTS);
+
+    struct extent *extents = kvcalloc(capacity, sizeof(*extents), GFP_KERNEL);
+    u32 *logical = kvcalloc(DIRECT_EXTENTS + capacity, sizeof(*logical), GFP_KERNEL);
+    if (!extents || !logical)
+    {
+        kvfree(extents);
+        kvfree(logical);
+        return -ENOMEM;
+    }
+
+    if (map->extents)
+        memcpy(extents, map->extents, map->capacity * sizeof(*extents));
+    if (map->logical)
+        memcpy(logical, map->logical, map->logical_valid * sizeof(*logical));
+
+    kvfree(map->extents);
+    kvfree(map->logical);
+    map->extents = extents;
+    map->logical = logical;
+    map->capacity = capacity;
+    return 0;
+}
+
+
+static void portfs_extent_map_free(struct portfs_extent_map *map)
+{
+    kvfree(map->extents);
+    kvfree(map->logical);
+    kfree(map->nodes);
+    kmem_cache_free(portfs_extent_map_cachep, map);
+}
+
+
+/*
+ * Readers such as lookup and readdir of a directory may load its extents
+ * concurrently, so the map is built privately and only published once
+ * complete. The loser of a race frees its copy. The map stays loaded
+ * until the inode is evicted, see portfs_fe_release().
+ */
+int portfs_load_extents(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    if (smp_load_acquire(&fe->extent_map))
+        return 0;
+
+    struct portfs_extent_map *map = kmem_cache_zalloc(portfs_extent_map_cachep, GFP_KERNEL);
+    if (!map)
+        return -ENOMEM;
+    map->dirty_from = SIZE_MAX;
+
+    int err = portfs_extent_map_reserve(psb, map, fe->file.extent_count);
+    if (!err && fe->file.extents_block != 0 && fe->file.extent_count > DIRECT_EXTENTS)
+        err = portfs_read_extent_tree(psb, fe, map);
+
+    if (err)
+    {
+        pr_err("portfs_load_extents: Failed to load extents of ino %u", fe->ino);
+        portfs_extent_map_free(map);
+        return err;
+    }
+
+    if (cmpxchg_release(&fe->extent_map, NULL, map))
+        portfs_extent_map_free(map);
+    return 0;
+}
+
+
+void portfs_drop_extents(struct filetable_entry *fe)
+{
+    if (!fe->extent_map)
+        return;
+
+    portfs_extent_map_free(fe->extent_map);
+    fe->extent_map = NULL;
+}
+
+
+// Makes room for 'extent_count' extents in total, loading the map if needed
+int portfs_reserve_extents(struct portfs_superblock *psb, struct filetable_entry *fe,
+                           size_t extent_count)
+{
+    int err = portfs_load_extents(psb, fe);
+    if (err)
+        return err;
+
+    return portfs_extent_map_reserve(psb, fe->extent_map, extent_count);
+}
+
+
+static void portfs_update_logical(struct filetable_entry *fe)
+{
+    struct portfs_extent_map *map = fe->extent_map;
+    size_t count = fe->file.extent_count;
+    if (count == 0)
+        return;
+
+    size_t i = min(map->logical_valid, count);
+    if (i == 0)
+    {
+        map->logical[0] = 0;
+        i = 1;
+    }
+    for (; i < count; ++i)
+        map->logical[i] = map->logical[i - 1] + get_extent(fe, i - 1)->length;
+    map->logical_valid = count;
+}
+
+
+/*
+ * Returns the index of the extent holding 'logical_block' and its first
+ * logical block in 'ext_logical', or -ENOENT past the last extent.
+ */
+ssize_t portfs_find_extent(struct filetable_entry *fe, u32 logical_block, u32 *ext_logical)
+{
+    size_t count = fe->file.extent_count;
+    struct portfs_extent_map *map = fe->extent_map;
+
+    if (!map)
+    {
+        u32 first = 0;
+        for (size_t i = 0; i < min_t(size_t, count, DIRECT_EXTENTS); ++i)
+        {
+            const struct extent *ext = get_extent(fe, i);
+            if (logical_block < first + ext->length)
+            {
+                *ext_logical = first;
+                return i;
+            }
+            first += ext->length;
+        }
+        return -ENOENT;
+    }
+
+    portfs_update_logical(fe);
+
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->logical[mid] <= logical_block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return -ENOENT;
+
+    size_t i = lo - 1;
+    if (logical_block >= map->logical[i] + get_extent(fe, i)->length)
+        return -ENOENT;
+
+    *ext_logical = map->logical[i];
+    return i;
+}
+
+
+static int portfs_resize_extent_nodes(struct portfs_superblock *psb, struct filetable_entry *fe,
+                                      u32 node_count)
+{
+    struct portfs_extent_map *map = fe->extent_map;
+
+    while (map->node_count > node_count)
+    {
+        u32 block = map->nodes[--map->node_count];
+        portfs_bforget(psb, block);
+        portfs_release_blocks(psb, block, 1);
+    }
+
+    if (map->node_count < node_count)
+    {
+        u32 *nodes = krealloc(map->nodes, node_count * sizeof(*nodes), GFP_KERNEL);
+        if (!nodes)
+            return -ENOMEM;
+        map->nodes = nodes;
+
+        while (map->node_count < node_count)
+        {
+            // Keep the tree next to the file's data
+            u64 goal = 0;
+            if (map->node_count > 0)
+                goal = map->nodes[map->node_count - 1] + 1;
+            else if (fe->file.extent_count > 0)
+                goal = get_extent(fe, fe->file.extent_count - 1)->start_block;
+
+            u32 block;
+            int err = portfs_alloc_block(psb, goal, &block);
+            if (err)
+                return err;
+            map->nodes[map->node_count++] = block;
+        }
+    }
+
+    if (map->node_count == 0)
+    {
+        kfree(map->nodes);
+        map->nodes = NULL;
+        map->tree_extents = 0;
+    }
+    fe->file.extents_block = map->node_count ? map->nodes[0] : 0;
+    return 0;
+}
+
+
+/*
+ * Writes the on-disk tree from the in-memory list. Leaves are filled
+ * completely from the left, the root is nodes[0] followed by the other
+ * levels top-down, and nodes are added or released as the tree changes.
+ * Leaves are added and dropped at the end of nodes[], so as long as the
+ * index levels keep their size every node stays in place and only the
+ * nodes covering extents from dirty_from on are rewritten.
+ */
+static int portfs_write_extent_tree(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    struct portfs_extent_map *map = fe->extent_map;
+    if (fe->file.extent_count <= DIRECT_EXTENTS)
+        return portfs_free_extent_nodes(psb, fe);
+
+    size_t count = fe->file.extent_count - DIRECT_EXTENTS;
+    size_t leaf_capacity = portfs_leaf_capacity(psb);
+    size_t index_capacity = portfs_index_capacity(psb);
+
+    size_t level_nodes[PORTFS_EXTENT_TREE_MAX_DEPTH + 1];
+    int levels;
+    int err = portfs_extent_tree_shape(psb, count, level_nodes, &levels);
+    if (err)
+        return err;
+
+    size_t total_nodes = 0;
+    for (int level = 0; level < levels; ++level)
+        total_nodes += level_nodes[level];
+
+    size_t old_level_nodes[PORTFS_EXTENT_TREE_MAX_DEPTH + 1];
+    int old_levels = 0;
+    bool rewrite_all = map->tree_extents == 0
+        || portfs_extent_tree_shape(psb, map->tree_extents, old_level_nodes, &old_levels)
+        || old_levels != levels;
+    for (int level = 1; level < levels && !rewrite_all; ++level)
+        rewrite_all = old_level_nodes[level] != level_nodes[level];
+
+    // Direct extents only shift the logical blocks, which every index node holds
+    size_t first_dirty = 0;
+    if (!rewrite_all && map->dirty_from > DIRECT_EXTENTS)
+        first_dirty = map->dirty_from - DIRECT_EXTENTS;
+
+    err = portfs_resize_extent_nodes(psb, fe, total_nodes);
+    if (err)
+        return err;
+
+    size_t level_start[PORTFS_EXTENT_TREE_MAX_DEPTH + 1];
+    size_t pos = 0;
+    for (int level = levels - 1; level >= 0; --level)
+    {
+        level_start[level] = pos;
+        pos += level_nodes[level];
+    }
+
+    portfs_update_logical(fe);
+
+    size_t node_span = leaf_capacity;   // Extents below one node of the level
+    size_t child_span = leaf_capacity;  // Extents below one node of the level underneath
+    for (int level = 0; level < levels; ++level)
+    {
+        for (size_t j = 0; j < level_nodes[level]; ++j)
+        {
+            if ((j + 1) * node_span <= first_dirty)
+                continue;
+
+            struct portfs_buf *buf = portfs_bnew(psb, map->nodes[level_start[level] + j]);
+            if (IS_ERR(buf))
+                return PTR_ERR(buf);
+
+            struct disk_extent_node_header *header = buf->data;
+            size_t entries;
+            if (level == 0)
+            {
+                struct disk_extent *disk_extents = (void *)(header + 1);
+                size_t first = j * leaf_capacity;
+                entries = min(leaf_capacity, count - first);
+                for (size_t k = 0; k < entries; ++k)
+                    portfs_extent_to_disk(psb, &disk_extents[k], &map->extents[first + k]);
+            }
+            else
+            {
+                struct disk_extent_index *index = (void *)(header + 1);
+                size_t first = j * index_capacity;
+                entries = min(index_capacity, level_nodes[level - 1] - first);
+                for (size_t k = 0; k < entries; ++k)
+                {
+                    size_t child = first + k;
+                    index[k].logical_block = cpu_to_be32(map->logical[DIRECT_EXTENTS + child * child_span]);
+                    index[k].child_block = cpu_to_be32(map->nodes[level_start[level - 1] + child]);
+                }
+            }
+
+            header->magic = cpu_to_be32(PORTFS_EXTENT_NODE_MAGIC);
+            header->entries = cpu_to_be16(entries);
+            header->depth = cpu_to_be16(level);
+            portfs_brelse(buf);
+        }
+
+        if (level > 0)
+            child_span *= index_capacity;
+        node_span *= index_capacity;
+    }
+
+    map->tree_extents = count;
+    return 0;
+}
+
+
+// Writes the changed part of the tree unless the list is unchanged since the last write
+int portfs_write_extents(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    struct portfs_extent_map *map = fe->extent_map;
+    if (!map || map->dirty_from == SIZE_MAX)
+        return 0;
+
+    int err = portfs_write_extent_tree(psb, fe);
+    if (!err)
+        map->dirty_from = SIZE_MAX;
+    return err;
+}
+
+
+// Releases every block of the on-disk tree
+int portfs_free_extent_nodes(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    // Older images may keep an unused flat extents block around
+    if (!fe->extent_map || fe->extent_map->node_count == 0)
+    {
+        if (fe->file.extents_block != 0)
+        {
+            portfs_bforget(psb, fe->file.extents_block);
+            portfs_release_blocks(psb, fe->file.extents_block, 1);
+            fe->file.extents_block = 0;
+        }
+        return 0;
+    }
+
+    return portfs_resize_extent_nodes(psb, fe, 0);
+}
@@ -0,0 +1,41 @@
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <linux/types.h>
+
+struct portfs_superblock;
+struct filetable_entry;
+struct extent;
+
+/*
+ * In-memory copy of a file's extents past DIRECT_EXTENTS, loaded from the
+ * on-disk extent tree on first use. Only the tree nodes covering changed
+ * extents are written back.
+ */
+struct portfs_extent_map
+{
+    struct extent *extents;     // Extents past DIRECT_EXTENTS, in file order
+    size_t capacity;
+
+    u32 *logical;               // Logical start block of every extent of the file
+    size_t logical_valid;       // Leading entries of 'logical' that are up to date
+
+    u32 *nodes;                 // Blocks of the on-disk tree, nodes[0] is the root
+    u32 node_count;
+
+    size_t dirty_from;          // First extent changed since the tree was written, SIZE_MAX if none
+    size_t tree_extents;        // Extents the on-disk tree is laid out for, 0 if it has to be rebuilt
+};
+
+int portfs_extent_map_cache_init(void);
+void portfs_extent_map_cache_exit(void);
+
+int portfs_load_extents(struct portfs_superblock *psb, struct filetable_entry *fe);
+void portfs_drop_extents(struct filetable_entry *fe);
+int portfs_reserve_extents(struct portfs_superblock *psb, struct filetable_entry *fe,
+                           size_t extent_count);
+ssize_t portfs_find_extent(struct filetable_entry *fe, u32 logical_block, u32 *ext_logical);
+int portfs_write_extents(struct portfs_superblock *psb, struct filetable_entry *fe);
+int portfs_free_extent_nodes(struct portfs_superblock *psb, struct filetable_entry *fe);
+
+#endif // EXTENT_MAP_H
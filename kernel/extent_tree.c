@@ -1,6 +1,9 @@
 /*
  *
  * Implementation of a free extent red-black tree allocator.
+ * Every free extent is linked into two trees: one ordered by length for
+ * allocation and one ordered by start block for lookups and merging of
+ * neighbours when blocks are freed.
  */
 #include "extent_tree.h"
 
@@ -10,93 +13,300 @@
 #include "shared_structs.h"
 #include "block_bitmap.h"
 
-int portfs_build_extent_tree(struct portfs_superblock *psb,
-                             struct rb_root *free_extent_tree)
+static void portfs_extent_tree_link(struct portfs_free_space *free_space, struct free_extent *new)
+{
+    struct rb_node **link = &(free_space->by_length.rb_node);
+    struct rb_node *parent = NULL;
+
+    while (*link)
+    {
+        struct free_extent *this = rb_entry(*link, struct free_extent, node);
+        parent = *link;
+
+        if (new->length > this->length)
+            link = &(*link)->rb_left;
+        else if (new->length < this->length)
+            link = &(*link)->rb_right;
+        else if (new->start_block < this->start_block)
+            link = &(*link)->rb_left;
+        else
+            link = &(*link)->rb_right;
+    }
+
+    rb_link_node(&new->node, parent, link);
+    rb_insert_color(&new->node, &free_space->by_length);
+
+    link = &(free_space->by_start.rb_node);
+    parent = NULL;
+    while (*link)
+    {
+        struct free_extent *this = rb_entry(*link, struct free_extent, start_node);
+        parent = *link;
+
+        if (new->start_block < this->start_block)
+            link = &(*link)->rb_left;
+        else
+            link = &(*link)->rb_right;
+    }
+
+    rb_link_node(&new->start_node, parent, link);
+    rb_insert_color(&new->start_node, &free_space->by_start);
+
+    free_space->free_blocks += new->length;
+    free_space->extent_count++;
+}
+
+
+static void portfs_extent_tree_unlink(struct portfs_free_space *free_space, struct free_extent *ext)
+{
+    rb_erase(&ext->node, &free_space->by_length);
+    rb_erase(&ext->start_node, &free_space->by_start);
+    free_space->free_blocks -= ext->length;
+    free_space->extent_count--;
+}
+
+
+static int portfs_extent_tree_add(struct portfs_free_space *free_space, u64 start_block, u32 length,
+                                  u64 freed_seq)
 {
-    const u32 total_blocks = psb->total_blocks;
-    u32 length = 0;
+    struct free_extent *free_ext = kmalloc(sizeof(*free_ext), GFP_KERNEL);
+    if (!free_ext)
+        return -ENOMEM;
 
-    for (int i = psb->data_start; i < total_blocks; ++i)
+    free_ext->start_block = start_block;
+    free_ext->length = length;
+    free_ext->freed_seq = freed_seq;
+    portfs_extent_tree_link(free_space, free_ext);
+    return 0;
+}
+
+
+// Returns the free extent with the greatest start block <= block
+static struct free_extent *portfs_extent_tree_lookup_le(struct portfs_free_space *free_space, u64 block)
+{
+    struct rb_node *node = free_space->by_start.rb_node;
+    struct free_extent *found = NULL;
+
+    while (node)
     {
-        if (!is_block_allocated(psb->block_bitmap, i) && length < MAX_EXTENT_LENGTH)
+        struct free_extent *this = rb_entry(node, struct free_extent, start_node);
+        if (this->start_block <= block)
         {
-            length++;
+            found = this;
+            node = node->rb_right;
         }
         else
         {
-            if (length > 0) {
-                struct free_extent *free_ext = kmalloc(sizeof(*free_ext), GFP_KERNEL);
-                if (!free_ext)
-                    return -ENOMEM;
-
-                free_ext->length = length;
-                free_ext->start_block = i - length;
-                portfs_extent_tree_insert(free_extent_tree, free_ext);
-                length = 0;
-            }
+            node = node->rb_left;
         }
     }
-    if (length > 0)
+
+    return found;
+}
+
+
+int portfs_build_extent_tree(struct portfs_superblock *psb,
+                             struct portfs_free_space *free_space)
+{
+    const u64 end_block = free_space->end_block;
+    u64 block = free_space->first_block;
+
+    while (block < end_block)
     {
-        struct free_extent *free_ext = kmalloc(sizeof(*free_ext), GFP_KERNEL);
-        if (!free_ext)
-            return -ENOMEM;
+        u64 start, end;
+        int err = find_free_block(psb, block, end_block, &start);
+        if (err)
+            return err;
+        if (start >= end_block)
+            break;
 
-        free_ext->length = length;
-        free_ext->start_block = total_blocks - length;
-        portfs_extent_tree_insert(free_extent_tree, free_ext);
+        err = find_allocated_block(psb, start, end_block, &end);
+        if (err)
+            return err;
+
+        err = portfs_extent_tree_add(free_space, start, end - start, 0);
+        if (err)
+            return err;
+        block = end;
     }
 
     return 0;
 }
 
 
-void portfs_destroy_extent_tree(struct rb_root *free_extent_tree)
+void portfs_destroy_extent_tree(struct portfs_free_space *free_space)
 {
     struct rb_node *node, *next;
-    for (node = rb_first(free_extent_tree); node; node = next)
+    for (node = rb_first(&free_space->by_length); node; node = next)
     {
         next = rb_next(node);
-        rb_erase(node, free_extent_tree);
         struct free_extent *data = rb_entry(node, struct free_extent, node);
+        portfs_extent_tree_unlink(free_space, data);
         kfree(data);
     }
 }
 
 
-void portfs_extent_tree_insert(struct rb_root *free_extent_tree, struct free_extent *new)
+/*
+ * Adds a freed range to the tree, merging it with the free extents
+ * directly before and after it. A merged extent keeps the newest
+ * 'freed_seq' of its parts.
+ */
+int portfs_extent_tree_insert(struct portfs_free_space *free_space, u64 start_block, u32 length,
+                              u64 freed_seq)
 {
-    struct rb_node **link = &(free_extent_tree->rb_node);
-    struct rb_node *parent = NULL;
+    if (length == 0)
+        return 0;
 
-    while (*link)
+    struct free_extent *prev = portfs_extent_tree_lookup_le(free_space, start_block);
+    struct rb_node *next_node = prev ? rb_next(&prev->start_node)
+                                     : rb_first(&free_space->by_start);
+    struct free_extent *next = next_node ? rb_entry(next_node, struct free_extent, start_node)
+                                         : NULL;
+
+    if (prev && prev->start_block + prev->length > start_block)
     {
-        struct free_extent *this = rb_entry(*link, struct free_extent, node);
-        parent = *link;
+        pr_err("portfs_extent_tree_insert: Blocks [%llu ... %llu) are already free",
+               start_block, start_block + length);
+        return -EINVAL;
+    }
+    if (next && start_block + length > next->start_block)
+    {
+        pr_err("portfs_extent_tree_insert: Blocks [%llu ... %llu) are already free",
+               start_block, start_block + length);
+        return -EINVAL;
+    }
 
-        if (new->length > this->length)
-            link = &(*link)->rb_left;
-        else if (new->length < this->length)
-            link = &(*link)->rb_right;
-        else if (new->start_block < this->start_block)
-            link = &(*link)->rb_left;
-        else
-            link = &(*link)->rb_right;
+    const bool merge_prev = prev && prev->start_block + prev->length == start_block;
+    const bool merge_next = next && start_block + length == next->start_block;
+    if (!merge_prev && !merge_next)
+        return portfs_extent_tree_add(free_space, start_block, length, freed_seq);
+
+    // A merge reuses the node of a neighbour, so it never fails halfway through
+    struct free_extent *merged = merge_prev ? prev : next;
+    portfs_extent_tree_unlink(free_space, merged);
+    if (merge_prev)
+    {
+        start_block = prev->start_block;
+        length += prev->length;
+        freed_seq = max(freed_seq, prev->freed_seq);
+    }
+    if (merge_next)
+    {
+        length += next->length;
+        freed_seq = max(freed_seq, next->freed_seq);
+        if (merged != next)
+            portfs_extent_tree_remove(free_space, next);
     }
 
-    rb_link_node(&new->node, parent, link);
-    rb_insert_color(&new->node, free_extent_tree);
+    merged->start_block = start_block;
+    merged->length = length;
+    merged->freed_seq = freed_seq;
+    portfs_extent_tree_link(free_space, merged);
+    return 0;
 }
 
 
-void portfs_extent_tree_remove(struct rb_root *free_extent_tree, struct free_extent *ext_to_remove)
+void portfs_extent_tree_remove(struct portfs_free_space *free_space, struct free_extent *ext_to_remove)
 {
-    rb_erase(&ext_to_remove->node, free_extent_tree);
+    portfs_extent_tree_unlink(free_space, ext_to_remove);
     kfree(ext_to_remove);
 }
 
 
-bool portfs_extent_tree_empty(struct rb_root *free_extent_tree)
+/*
+ * Removes [start_block, start_block + length) from the free extent 'ext'
+ * that contains it, keeping whatever is left on either side.
+ */
+int portfs_extent_tree_carve(struct portfs_free_space *free_space, struct free_extent *ext,
+                             u64 start_block, u32 length)
+{
+    u64 ext_start = ext->start_block;
+    u64 ext_end = ext->start_block + ext->length;
+    u64 end = start_block + length;
+
+    if (start_block < ext_start || end > ext_end)
+        return -EINVAL;
+
+    portfs_extent_tree_unlink(free_space, ext);
+
+    if (start_block > ext_start && end < ext_end)
+    {
+        int err = portfs_extent_tree_add(free_space, end, ext_end - end, ext->freed_seq);
+        if (err)
+        {
+            portfs_extent_tree_link(free_space, ext);
+            return err;
+        }
+    }
+
+    if (start_block > ext_start)
+    {
+        ext->length = start_block - ext_start;
+        portfs_extent_tree_link(free_space, ext);
+    }
+    else if (end < ext_end)
+    {
+        ext->start_block = end;
+        ext->length = ext_end - end;
+        portfs_extent_tree_link(free_space, ext);
+    }
+    else
+    {
+        kfree(ext);
+    }
+
+    return 0;
+}
+
+
+// Returns the shortest free extent of at least 'length' blocks or NULL if none is long enough
+struct free_extent *portfs_extent_tree_best_fit(struct portfs_free_space *free_space, u32 length)
+{
+    struct rb_node *node = free_space->by_length.rb_node;
+    struct free_extent *found = NULL;
+
+    while (node)
+    {
+        struct free_extent *this = rb_entry(node, struct free_extent, node);
+        if (this->length >= length)
+        {
+            found = this;
+            node = node->rb_right;
+        }
+        else
+        {
+            node = node->rb_left;
+        }
+    }
+
+    return found;
+}
+
+
+// Returns the free extent containing 'block' or NULL if the block is in use
+struct free_extent *portfs_extent_tree_find(struct portfs_free_space *free_space, u64 block)
+{
+    struct free_extent *ext = portfs_extent_tree_lookup_le(free_space, block);
+    if (ext && block < ext->start_block + ext->length)
+        return ext;
+    return NULL;
+}
+
+
+// Returns the free extent containing 'block' or the first one after it
+struct free_extent *portfs_extent_tree_next(struct portfs_free_space *free_space, u64 block)
+{
+    struct free_extent *ext = portfs_extent_tree_lookup_le(free_space, block);
+    if (ext && block < ext->start_block + ext->length)
+        return ext;
+
+    struct rb_node *next = ext ? rb_next(&ext->start_node) : rb_first(&free_space->by_start);
+    return next ? rb_entry(next, struct free_extent, start_node) : NULL;
+}
+
+
+bool portfs_extent_tree_empty(struct portfs_free_space *free_space)
 {
-    return RB_EMPTY_ROOT(free_extent_tree);
+    return RB_EMPTY_ROOT(&free_space->by_length);
 }
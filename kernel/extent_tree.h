@@ -1,18 +1,49 @@
-#include <linux/rbtree.h>
+#ifndef EXTENT_TREE_H
+#define EXTENT_TREE_H
 
-#define MAX_EXTENT_LENGTH 1024
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
 
 struct free_extent {
-    u32 start_block;
+    u64 start_block;
     u32 length;
+    u64 freed_seq;              // Newest release merged into the extent, see portfs_trim_free_space()
+
+    struct rb_node node;        // Ordered by length, longest first
+    struct rb_node start_node;  // Ordered by start block
+};
 
-    struct rb_node node;
+/*
+ * Free space of one allocation group, blocks [first_block, end_block).
+ * Built once at mount and kept up to date on every allocation and free.
+ */
+struct portfs_free_space {
+    u64 first_block;
+    u64 end_block;
+
+    struct rb_root by_length;
+    struct rb_root by_start;
+    u64 free_blocks;
+    u32 extent_count;
+
+    u64 alloc_extents;
+    u64 goal_hits;
+
+    struct mutex lock;
 };
 
 struct portfs_superblock;
 
-int portfs_build_extent_tree(struct portfs_superblock *psb, struct rb_root *free_extent_tree);
-void portfs_destroy_extent_tree(struct rb_root *free_extent_tree);
-void portfs_extent_tree_insert(struct rb_root *free_extent_tree, struct free_extent *new);
-void portfs_extent_tree_remove(struct rb_root *free_extent_tree, struct free_extent *ext_to_remove);
-bool portfs_extent_tree_empty(struct rb_root *free_extent_tree);
+int portfs_build_extent_tree(struct portfs_superblock *psb, struct portfs_free_space *free_space);
+void portfs_destroy_extent_tree(struct portfs_free_space *free_space);
+int portfs_extent_tree_insert(struct portfs_free_space *free_space, u64 start_block, u32 length,
+                              u64 freed_seq);
+void portfs_extent_tree_remove(struct portfs_free_space *free_space, struct free_extent *ext_to_remove);
+int portfs_extent_tree_carve(struct portfs_free_space *free_space, struct free_extent *ext,
+                             u64 start_block, u32 length);
+struct free_extent *portfs_extent_tree_best_fit(struct portfs_free_space *free_space, u32 length);
+struct free_extent *portfs_extent_tree_find(struct portfs_free_space *free_space, u64 block);
+struct free_extent *portfs_extent_tree_next(struct portfs_free_space *free_space, u64 block);
+bool portfs_extent_tree_empty(struct portfs_free_space *free_space);
+
+#endif // EXTENT_TREE_H
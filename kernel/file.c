@@ -3,8 +3,10 @@
 #include "linux/err.h"
 #include "linux/fs.h"
 #include "linux/fs_types.h"
+#include "linux/pagemap.h"
 #include "linux/stat.h"
 #include "linux/types.h"
+#include "linux/uio.h"
 
 #include "portfs.h"
 #include "extent_tree.h"
@@ -12,17 +14,8 @@
 #include "shared_structs.h"
 #include "directory.h"
 #include "inode.h"
-
-static inline uint8_t mode_to_dtype(uint16_t mode)
-{
-    if (S_ISDIR(mode))
-        return DT_DIR;
-    else if (S_ISREG(mode))
-        return DT_REG;
-    else
-        return DT_UNKNOWN;
-}
-
+#include "ioctl.h"
+#include "qos.h"
 
 static int portfs_iterate_shared(struct file *filp, struct dir_context *ctx)
 {
@@ -30,9 +23,6 @@ static int portfs_iterate_shared(struct file *filp, struct dir_context *ctx)
     struct inode *inode = filp->f_inode;
     struct portfs_superblock *psb = inode->i_sb->s_fs_info;
 
-    if (ctx->pos >= psb->max_file_count)
-        return 0;
-
     if (ctx->pos == 0)
     {
         if (!dir_emit_dots(filp, ctx))
@@ -46,31 +36,29 @@ static int portfs_iterate_shared(struct file *filp, struct dir_context *ctx)
         return -ENOENT;
     }
 
-    if (!dir->dir_entries)
-        portfs_load_dir_data(psb, dir);
+    // A directory without blocks has only the dots
+    if (get_dir_block(dir) == 0)
+        return 0;
+
+    int err = portfs_load_dir_data(psb, dir);
+    if (err)
+        return err;
 
-    uint16_t num_entries = get_max_dir_entries(psb);
+    // ctx->pos - 2 is the slot to continue from
+    const loff_t num_entries = dir->dir_map->slots;
 
     pr_info("portfs_iterate_shared: Starting from index %lld", ctx->pos - 2);
     for (; ctx->pos - 2 < num_entries; ctx->pos++)
     {
-        struct dir_entry *d_entry = &dir->dir_entries[ctx->pos - 2];
+        struct dir_entry *d_entry = &dir->dir_map->entries[ctx->pos - 2];
         if (d_entry->inode_number == 0)
             continue;
 
-        pr_info("portfs_iterate_shared: Found file: %s at index %lld", d_entry->name, ctx->pos - 2);
-        struct inode *child_inode = portfs_get_inode_by_number(inode->i_sb, d_entry->inode_number);
-        if (!child_inode || IS_ERR(child_inode))
-            continue;
-
+        // The type comes from the entry, older images report DT_UNKNOWN
         pr_info("portfs_iterate_shared: Emitting file: %s at index %lld", d_entry->name, ctx->pos - 2);
-        if (!dir_emit(ctx, d_entry->name, strlen(d_entry->name),
-                      d_entry->inode_number, mode_to_dtype(child_inode->i_mode)))
-        {
-            iput(child_inode);
-            return -ENOMEM;
-        }
-        iput(child_inode);
+        if (!dir_emit(ctx, d_entry->name, d_entry->name_len,
+                      d_entry->inode_number, fs_ftype_to_dtype(d_entry->file_type)))
+            return 0;   // The buffer is full, the next call resumes at ctx->pos
     }
 
     pr_info("portfs_iterate_shared: Finished iteration, setting ctx->pos to %lld", ctx->pos);
@@ -99,66 +87,59 @@ static int portfs_release_file(struct inode *inode, struct file *filp)
     pr_info("portfs_release_file: Closing file.");
     pr_info("portfs_release_file: inode %lu, i_count=%d\n", inode->i_ino, atomic_read(&inode->i_count));
     struct filetable_entry *file_entry = inode->i_private;
-    if (file_entry && file_entry->indirect_extents)
+    inode_lock(inode);
+
+    // i_writecount still includes this file while it is being released
+    if (file_entry && (filp->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) <= 1)
     {
-        kfree(file_entry->indirect_extents);
-        file_entry->indirect_extents = NULL;
+        if (portfs_reclaim_prealloc(inode->i_sb->s_fs_info, file_entry))
+            pr_warn("portfs_release_file: Failed to reclaim preallocated blocks");
     }
 
+    // The extent map stays loaded for the next open, writeback stores the tree
+    if (file_entry && (filp->f_mode & FMODE_WRITE))
+        mark_inode_dirty(inode);
+    inode_unlock(inode);
+
     return 0;
 }
 
 
 static loff_t portfs_calc_global_offset(const struct portfs_superblock *psb,
-                                        const struct filetable_entry *entry,
+                                        struct filetable_entry *entry,
                                         loff_t local_offset)
 {
     pr_info("portfs_calc_global_offset: Local offset = %lld", local_offset);
 
-    loff_t offset_remaining = local_offset;
-
-    for (size_t i = 0; i < entry->file.extent_count; ++i)
-    {
-        const struct extent *ext = get_extent(entry, i);
-        loff_t ext_size = ext->length * psb->block_size;
-
-        if (offset_remaining < ext_size)
-        {
-            pr_info("portfs_calc_global_offset: Using block %u", ext->start_block);
-            loff_t ret = ext->start_block * psb->block_size + offset_remaining;
-            pr_info("portfs_calc_global_offset: Calculated global offset = %lld", ret);
-            return ret;
-        }
-
-        offset_remaining -= ext_size;
-    }
+    u32 ext_logical;
+    ssize_t i = portfs_find_extent(entry, local_offset / psb->block_size, &ext_logical);
+    if (i < 0)
+        return -EFAULT;
 
-    return -EFAULT;
+    const struct extent *ext = get_extent(entry, i);
+    pr_info("portfs_calc_global_offset: Using block %llu", ext->start_block);
+    loff_t ret = (loff_t)ext->start_block * psb->block_size
+               + local_offset - (loff_t)ext_logical * psb->block_size;
+    pr_info("portfs_calc_global_offset: Calculated global offset = %lld", ret);
+    return ret;
 }
 
 
 static ssize_t portfs_calc_available_bytes(const struct portfs_superblock *psb,
-                                           const struct filetable_entry *entry,
+                                           struct filetable_entry *entry,
                                            loff_t local_offset)
 {
-    size_t global_offset = 0;
-
-    for (size_t i = 0; i < entry->file.extent_count; ++i)
-    {
-        const struct extent *ext = get_extent(entry, i);
-        global_offset += ext->length * psb->block_size;
-        if (global_offset > local_offset)
-        {
-            size_t remaining = global_offset - local_offset;
-            return remaining;
-        }
-    }
+    u32 ext_logical;
+    ssize_t i = portfs_find_extent(entry, local_offset / psb->block_size, &ext_logical);
+    if (i < 0)
+        return -EFAULT;
 
-    return -EFAULT;
+    const struct extent *ext = get_extent(entry, i);
+    return (loff_t)(ext_logical + ext->length) * psb->block_size - local_offset;
 }
 
 
-static ssize_t portfs_file_read(struct file *filp, char __user *buf, size_t count, loff_t *pos)
+static ssize_t portfs_do_file_read(struct file *filp, char __user *buf, size_t count, loff_t *pos)
 {
     pr_info("portfs_file_read: Read from file.");
     struct inode *inode = filp->f_inode;
@@ -175,10 +156,11 @@ static ssize_t portfs_file_read(struct file *filp, char __user *buf, size_t coun
 
 
     struct portfs_superblock *psb = inode->i_sb->s_fs_info;
-    if (file_entry->file.extent_count >= DIRECT_EXTENTS
-        && !file_entry->indirect_extents)
+    if (file_entry->file.extent_count > DIRECT_EXTENTS)
     {
-        portfs_alloc_indirect_extents(psb, file_entry);
+        int err = portfs_load_extents(psb, file_entry);
+        if (err)
+            return err;
     }
 
     char* kbuf = NULL;
@@ -228,33 +210,49 @@ static ssize_t portfs_file_read(struct file *filp, char __user *buf, size_t coun
 }
 
 
-static ssize_t portfs_file_write(struct file *filp, const char __user *buf, size_t count, loff_t *pos)
+static ssize_t portfs_do_file_write(struct kiocb *iocb, struct iov_iter *from)
 {
-    pr_info("portfs_file_write: Write to file. Pos = %lld", *pos);
-    pr_info("portfs_file_write: filp->f_flags = 0x%x\n", filp->f_flags);
-
-    struct inode *inode = filp->f_inode;
-    if (!inode || !buf)
+    struct file *filp = iocb->ki_filp;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    pr_info("portfs_file_write_iter: Write to file. Pos = %lld", pos);
+    pr_info("portfs_file_write_iter: filp->f_flags = 0x%x\n", filp->f_flags);
+
+    struct inode *inode = file_inode(filp);
+    if (!inode)
     {
         return -EFAULT;
     }
+    if (count == 0)
+        return 0;
 
     struct portfs_superblock *psb = inode->i_sb->s_fs_info;
     struct filetable_entry *file_entry = inode->i_private;
 
-    if (filp->f_flags & O_APPEND)
+    if (iocb->ki_flags & IOCB_APPEND)
     {
-        *pos = file_entry->size_in_bytes;
+        pos = file_entry->size_in_bytes;
+    }
+
+    int err = 0;
+    if (file_entry->file.extent_count > DIRECT_EXTENTS)
+    {
+        err = portfs_load_extents(psb, file_entry);
+        if (err)
+            return err;
     }
 
     const size_t available_size = portfs_get_allocated_size(file_entry, psb->block_size)
                                     - file_entry->size_in_bytes;
     if (available_size < count)
     {
-        int err = portfs_allocate_memory(psb, file_entry, count - available_size);
+        err = portfs_allocate_memory(psb, file_entry, count - available_size,
+                                     portfs_dentry_goal(filp->f_path.dentry));
+        // Even a partial allocation changed the extents
+        mark_inode_dirty(inode);
         if (err)
         {
-            pr_err("portfs_file_write: Could not allocate memory");
+            pr_err("portfs_file_write_iter: Could not allocate memory");
             return err;
         }
     }
@@ -262,11 +260,11 @@ static ssize_t portfs_file_write(struct file *filp, const char __user *buf, size
     char* kbuf = kmalloc(count, GFP_KERNEL);
     if (!kbuf)
     {
-        pr_err("portfs_file_read: Could not allocate memory");
+        pr_err("portfs_file_write_iter: Could not allocate memory");
         return -ENOMEM;
     }
 
-    if (copy_from_user(kbuf, buf, count))
+    if (copy_from_iter(kbuf, count, from) != count)
     {
         kfree(kbuf);
         return -EFAULT;
@@ -275,21 +273,21 @@ static ssize_t portfs_file_write(struct file *filp, const char __user *buf, size
     size_t bytes_written_total = 0;
     while (count > 0)
     {
-        loff_t global_offset = portfs_calc_global_offset(psb, file_entry, *pos);
+        loff_t global_offset = portfs_calc_global_offset(psb, file_entry, pos);
         if (global_offset < psb->data_start * psb->block_size)
         {
-            pr_err("portfs_file_write: Invalid offset, offset = %llu", global_offset);
+            pr_err("portfs_file_write_iter: Invalid offset, offset = %llu", global_offset);
             break;
         }
-        size_t available_bytes = portfs_calc_available_bytes(psb, file_entry, *pos);
+        size_t available_bytes = portfs_calc_available_bytes(psb, file_entry, pos);
         if (available_bytes <= 0)
         {
-            pr_warn("portfs_file_write: No available bytes");
+            pr_warn("portfs_file_write_iter: No available bytes");
             break;
         }
         size_t bytes_to_write = min(available_bytes, count);
 
-        pr_info("portfs_file_write: Write to file. global_offset = %lld, bytes = %ld",
+        pr_info("portfs_file_write_iter: Write to file. global_offset = %lld, bytes = %ld",
                 global_offset, bytes_to_write);
 
         ssize_t bytes_written = kernel_write(storage_filp,
@@ -302,35 +300,185 @@ static ssize_t portfs_file_write(struct file *filp, const char __user *buf, size
         }
 
         count -= bytes_written;
-        *pos += bytes_written;
+        pos += bytes_written;
         bytes_written_total += bytes_written;
     }
 
     if (count == 0)
     {
-        if (*pos > file_entry->size_in_bytes)
+        if (pos > file_entry->size_in_bytes)
         {
-            file_entry->size_in_bytes = *pos;
-            inode->i_size = *pos;
+            file_entry->size_in_bytes = pos;
+            file_entry->layout_dirty = true;
+            inode->i_size = pos;
             mark_inode_dirty(inode);
         }
     }
     else
     {
-        pr_err("portfs_file_write: Failed to write all bytes");
+        pr_err("portfs_file_write_iter: Failed to write all bytes");
         kfree(kbuf);
         return -EIO;
     }
 
-    pr_info("portfs_file_write: Write to file finished. New Pos = %lld", *pos);
+    pr_info("portfs_file_write_iter: Write to file finished. New Pos = %lld", pos);
     kfree(kbuf);
 
+    iocb->ki_pos = pos;
     return bytes_written_total;
 }
 
 
+/*
+ * Reads and writes hold the inode lock so the extent list cannot be
+ * swapped or truncated underneath them, e.g. by online defragmentation.
+ * Reads take it exclusively too since they load the extent map lazily.
+ * Both are throttled before taking the lock, so a throttled caller does
+ * not hold up other users of the file.
+ */
+static ssize_t portfs_file_read(struct file *filp, char __user *buf, size_t count, loff_t *pos)
+{
+    struct inode *inode = file_inode(filp);
+    struct portfs_superblock *psb = inode->i_sb->s_fs_info;
+
+    // Only the bytes before the end of the file are charged
+    loff_t size = i_size_read(inode);
+    size_t charge = *pos < size ? min_t(u64, count, size - *pos) : 0;
+    if (charge > 0)
+    {
+        // Like writes, only O_DIRECT and O_SYNC readers ask for the small I/O lane
+        int err = portfs_qos_throttle(psb, charge, filp->f_flags & (O_DIRECT | O_DSYNC));
+        if (err)
+            return err;
+    }
+
+    inode_lock(inode);
+    ssize_t ret = portfs_do_file_read(filp, buf, count, pos);
+    inode_unlock(inode);
+    return ret;
+}
+
+
+static ssize_t portfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct portfs_superblock *psb = inode->i_sb->s_fs_info;
+
+    size_t count = iov_iter_count(from);
+    if (count > 0)
+    {
+        int err = portfs_qos_throttle(psb, count, iocb_is_dsync(iocb));
+        if (err)
+            return err;
+    }
+
+    inode_lock(inode);
+    ssize_t ret = portfs_do_file_write(iocb, from);
+    inode_unlock(inode);
+
+    // Handles O_DSYNC, O_SYNC and RWF_DSYNC by calling portfs_fsync on the written range
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+
+/*
+ * Starts writeback of the data extents overlapping [start, end] or, with
+ * 'wait', waits for it. No flush is issued here.
+ */
+static int portfs_fsync_data(struct portfs_superblock *psb, struct filetable_entry *file_entry,
+                             loff_t start, loff_t end, bool wait)
+{
+    // Start at the extent holding 'start' instead of walking the whole list
+    const loff_t block_size = psb->block_size;
+    u32 first_logical = 0;
+    ssize_t first = portfs_find_extent(file_entry, min_t(loff_t, start / block_size, U32_MAX),
+                                       &first_logical);
+    if (first < 0)
+        first = file_entry->file.extent_count;
+
+    struct address_space *mapping = storage_filp->f_mapping;
+    loff_t ext_local_start = (loff_t)first_logical * block_size;
+    for (size_t i = first; i < file_entry->file.extent_count && ext_local_start <= end; ++i)
+    {
+        const struct extent *ext = get_extent(file_entry, i);
+        loff_t ext_size = ext->length * block_size;
+        loff_t ext_local_end = ext_local_start + ext_size - 1;
+
+        if (ext_local_end >= start)
+        {
+            loff_t from = max(start, ext_local_start) - ext_local_start;
+            loff_t to = min(end, ext_local_end) - ext_local_start;
+            loff_t ext_global_start = (loff_t)ext->start_block * block_size;
+
+            int err = wait ? filemap_fdatawait_range(mapping, ext_global_start + from,
+                                                     ext_global_start + to)
+                           : filemap_fdatawrite_range(mapping, ext_global_start + from,
+                                                      ext_global_start + to);
+            if (err)
+            {
+                pr_err("portfs_fsync: Failed to sync file data");
+                return err;
+            }
+        }
+
+        ext_local_start += ext_size;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Flushes only what belongs to this file: the data extents overlapping
+ * [start, end], then the file's filetable entry, extent tree blocks
+ * and block bitmap bytes. All of it is written back first and made
+ * durable by a single flush of the storage file at the end.
+ */
+static int portfs_do_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file_inode(filp);
+    struct portfs_superblock *psb = inode->i_sb->s_fs_info;
+    struct filetable_entry *file_entry = inode->i_private;
+    pr_info("portfs_fsync: inode %lu, range [%lld, %lld], datasync = %d",
+            inode->i_ino, start, end, datasync);
+
+    if (!file_entry)
+        return -EINVAL;
+
+    if (file_entry->file.extent_count > DIRECT_EXTENTS)
+    {
+        int err = portfs_load_extents(psb, file_entry);
+        if (err)
+            return err;
+    }
+
+    int err = portfs_fsync_data(psb, file_entry, start, end, false);
+    if (!err)
+        err = portfs_fsync_data(psb, file_entry, start, end, true);
+    if (err)
+        return err;
+
+    return portfs_sync_file_entry(psb, file_entry, datasync);
+}
+
+
+static int portfs_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file_inode(filp);
+
+    inode_lock(inode);
+    int err = portfs_do_fsync(filp, start, end, datasync);
+    inode_unlock(inode);
+    return err;
+}
+
+
 const struct file_operations portfs_dir_file_operations = {
     .iterate_shared = portfs_iterate_shared,
+    .unlocked_ioctl = portfs_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
 };
 
 
@@ -338,5 +486,8 @@ const struct file_operations portfs_file_operations = {
     .open    = portfs_file_open,
     .release = portfs_release_file,
     .read    = portfs_file_read,
-    .write   = portfs_file_write,
+    .write_iter = portfs_file_write_iter,
+    .fsync   = portfs_fsync,
+    .unlocked_ioctl = portfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
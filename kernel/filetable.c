@@ -0,0 +1,462 @@
+/*
+ *
+ * Filetable access.
+ * Mounting reads nothing from the filetable: an entry is decoded from its
+ * buffer cache block when its inode is looked up or created and stays in
+ * memory as long as the inode does.
+ * On images with PORTFS_FEATURE_INO_SLOT the inode number of an entry is
+ * its slot + 1, so an inode is read straight from its slot. Older images
+ * keep the inode numbers they were created with and fall back to scanning
+ * the filetable through the buffer cache. Free slots come from the inode
+ * bitmap where the image has one.
+ */
+#include "filetable.h"
+
+#include "linux/err.h"
+#include "linux/fs.h"
+#include "linux/math64.h"
+#include "linux/mm.h"
+#include "linux/mutex.h"
+#include "linux/sched.h"
+#include "linux/slab.h"
+
+#include "portfs.h"
+#include "buffer_cache.h"
+#include "directory.h"
+#include "extent_map.h"
+#include "ino_bitmap.h"
+#include "shared_structs.h"
+
+struct portfs_filetable
+{
+    struct mutex lock;          // Serializes claiming free slots
+};
+
+
+static int portfs_fe_io(struct portfs_superblock *psb, u32 slot,
+                        struct disk_filetable_entry *disk_entry, bool write);
+
+// Sets the bit of every slot in use, after a crash the bitmap may be off
+static int portfs_rebuild_ino_bitmap(struct portfs_superblock *psb)
+{
+    const u32 slots = portfs_filetable_slots(psb);
+
+    pr_info("portfs_rebuild_ino_bitmap: Rebuilding inode bitmap of %u slots", slots);
+    int err = portfs_ino_bitmap_reset(psb);
+    for (u32 i = 0; i < slots && !err; ++i)
+    {
+        struct disk_filetable_entry disk_entry;
+        err = portfs_fe_io(psb, i, &disk_entry, false);
+        if (!err && disk_entry.mode != 0)
+            err = portfs_ino_bitmap_mark(psb, i, true);
+        cond_resched();
+    }
+
+    return err;
+}
+
+
+int portfs_filetable_init(struct portfs_superblock *psb)
+{
+    struct portfs_filetable *filetable = kzalloc(sizeof(*filetable), GFP_KERNEL);
+    if (!filetable)
+        return -ENOMEM;
+
+    mutex_init(&filetable->lock);
+    psb->filetable = filetable;
+
+    if (!portfs_has_ino_bitmap(psb))
+        return 0;
+
+    int err = portfs_ino_bitmap_check(psb, portfs_filetable_slots(psb));
+    if (!err && !(psb->flags & PORTFS_SB_INO_BITMAP))
+        err = portfs_rebuild_ino_bitmap(psb);
+    return err;
+}
+
+
+// Entries are part of their inodes, which are all evicted by now
+void portfs_filetable_destroy(struct portfs_superblock *psb)
+{
+    struct portfs_filetable *filetable = psb->filetable;
+    if (!filetable)
+        return;
+
+    kfree(filetable);
+    psb->filetable = NULL;
+}
+
+
+// Slots that lie completely inside the filetable blocks
+u32 portfs_filetable_slots(struct portfs_superblock *psb)
+{
+    u64 slots = div_u64((u64)psb->filetable_size * psb->block_size,
+                        sizeof(struct disk_filetable_entry));
+    return min_t(u64, slots, psb->max_file_count);
+}
+
+
+/*
+ * Copies the on-disk entry of 'slot' out of or into the buffer cache, an
+ * entry may span two blocks. Writing an unchanged entry dirties nothing.
+ */
+static int portfs_fe_io(struct portfs_superblock *psb, u32 slot,
+                        struct disk_filetable_entry *disk_entry, bool write)
+{
+    const u64 pos = (u64)slot * sizeof(*disk_entry);
+    size_t done = 0;
+
+    while (done < sizeof(*disk_entry))
+    {
+        u32 offset;
+        u32 block = psb->filetable_start + div_u64_rem(pos + done, psb->block_size, &offset);
+        size_t chunk = min_t(size_t, sizeof(*disk_entry) - done, psb->block_size - offset);
+
+        struct portfs_buf *buf = portfs_bread(psb, block);
+        if (IS_ERR(buf))
+        {
+            pr_err("portfs_fe_io: Failed to read filetable block %u", block);
+            return PTR_ERR(buf);
+        }
+
+        if (write && memcmp(buf->data + offset, (u8 *)disk_entry + done, chunk))
+        {
+            memcpy(buf->data + offset, (u8 *)disk_entry + done, chunk);
+            portfs_bmark_dirty(buf);
+        }
+        else if (!write)
+        {
+            memcpy((u8 *)disk_entry + done, buf->data + offset, chunk);
+        }
+        portfs_brelse(buf);
+
+        done += chunk;
+    }
+
+    return 0;
+}
+
+
+// Directories of PORTFS_FEATURE_DIR_EXTENTS images keep their blocks like files
+static inline bool portfs_fe_has_extents(struct portfs_superblock *psb, u16 mode)
+{
+    return S_ISREG(mode) || (S_ISDIR(mode) && portfs_has_dir_extents(psb));
+}
+
+
+static void portfs_fe_encode(struct portfs_superblock *psb, const struct filetable_entry *fe,
+                             struct disk_filetable_entry *disk_entry)
+{
+    memset(disk_entry, 0, sizeof(*disk_entry));
+    if (fe->mode == 0)
+        return;     // A free slot is all zeroes
+
+    disk_entry->ino = cpu_to_be32(fe->ino);
+    disk_entry->mode = cpu_to_be16(fe->mode);
+    disk_entry->size_in_bytes = cpu_to_be64(fe->size_in_bytes);
+
+    if (portfs_fe_has_extents(psb, fe->mode))
+    {
+        disk_entry->file.extent_count = cpu_to_be16(fe->file.extent_count);
+        disk_entry->file.extents_block = cpu_to_be32(fe->file.extents_block);
+        for (int i = 0; i < min_t(int, fe->file.extent_count, DIRECT_EXTENTS); ++i)
+            portfs_extent_to_disk(psb, &disk_entry->file.direct_extents[i],
+                                  &fe->file.direct_extents[i]);
+    }
+    else if (S_ISDIR(fe->mode))
+    {
+        disk_entry->dir.dir_block = cpu_to_be32(fe->dir.dir_block);
+        disk_entry->dir.parent_dir_ino = cpu_to_be32(fe->dir.parent_dir_ino);
+    }
+}
+
+
+static void portfs_fe_decode(struct portfs_superblock *psb, struct filetable_entry *fe,
+                             const struct disk_filetable_entry *disk_entry)
+{
+    fe->ino = be32_to_cpu(disk_entry->ino);
+    fe->mode = be16_to_cpu(disk_entry->mode);
+    fe->size_in_bytes = be64_to_cpu(disk_entry->size_in_bytes);
+
+    if (portfs_fe_has_extents(psb, fe->mode))
+    {
+        fe->file.extent_count = be16_to_cpu(disk_entry->file.extent_count);
+        fe->file.extents_block = be32_to_cpu(disk_entry->file.extents_block);
+        for (int i = 0; i < DIRECT_EXTENTS; ++i)
+            portfs_extent_from_disk(psb, &fe->file.direct_extents[i],
+                                    &disk_entry->file.direct_extents[i]);
+    }
+    else if (S_ISDIR(fe->mode))
+    {
+        fe->dir.dir_block = be32_to_cpu(disk_entry->dir.dir_block);
+        fe->dir.parent_dir_ino = be32_to_cpu(disk_entry->dir.parent_dir_ino);
+    }
+}
+
+
+// Reads the on-disk entry of 'slot', -ENOENT unless it is in use by inode 'ino'
+static int portfs_fe_read_ino(struct portfs_superblock *psb, u32 slot, u32 ino,
+                              struct disk_filetable_entry *disk_entry)
+{
+    int err = portfs_fe_io(psb, slot, disk_entry, false);
+    if (err)
+        return err;
+
+    return disk_entry->mode != 0 && be32_to_cpu(disk_entry->ino) == ino ? 0 : -ENOENT;
+}
+
+
+// Finds the slot of inode 'ino', older images may have it anywhere in the filetable
+static int portfs_fe_find_ino(struct portfs_superblock *psb, u32 ino, u32 *slot,
+                              struct disk_filetable_entry *disk_entry)
+{
+    const u32 slots = portfs_filetable_slots(psb);
+    if (ino == 0)
+        return -ENOENT;
+
+    int err = ino <= slots ? portfs_fe_read_ino(psb, ino - 1, ino, disk_entry) : -ENOENT;
+    if (err != -ENOENT || portfs_has_ino_slot(psb))
+    {
+        *slot = ino - 1;
+        return err;
+    }
+
+    for (u32 i = 0; i < slots; ++i)
+    {
+        err = portfs_fe_read_ino(psb, i, ino, disk_entry);
+        if (err != -ENOENT)
+        {
+            *slot = i;
+            return err;
+        }
+        cond_resched();
+    }
+
+    return -ENOENT;
+}
+
+
+/*
+ * Reads the entry of inode 'ino' into 'fe', which is part of the inode.
+ * Callers make sure only one copy of an inode is loaded, the inode hash
+ * does that for lookups.
+ */
+int portfs_fe_lookup(struct portfs_superblock *psb, u32 ino, struct filetable_entry *fe)
+{
+    struct disk_filetable_entry disk_entry;
+    u32 slot;
+
+    int err = portfs_fe_find_ino(psb, ino, &slot, &disk_entry);
+    if (err)
+        return err;
+
+    memset(fe, 0, sizeof(*fe));
+    portfs_fe_decode(psb, fe, &disk_entry);
+    fe->slot = slot;
+    return 0;
+}
+
+
+/*
+ * Older images hand out inode numbers independently of slots, so a free
+ * slot is usable only if no other entry already has its inode number.
+ * Marks the inode numbers in use that can clash with a slot.
+ */
+static unsigned long *portfs_fe_used_inos(struct portfs_superblock *psb, u32 slots)
+{
+    unsigned long *used = kvcalloc(BITS_TO_LONGS(slots), sizeof(unsigned long), GFP_KERNEL);
+    if (!used)
+        return ERR_PTR(-ENOMEM);
+
+    for (u32 i = 0; i < slots; ++i)
+    {
+        struct disk_filetable_entry disk_entry;
+        int err = portfs_fe_io(psb, i, &disk_entry, false);
+        if (err)
+        {
+            kvfree(used);
+            return ERR_PTR(err);
+        }
+
+        u32 ino = be32_to_cpu(disk_entry.ino);
+        if (disk_entry.mode != 0 && ino >= 1 && ino <= slots)
+            set_bit(ino - 1, used);
+        cond_resched();
+    }
+
+    return used;
+}
+
+
+// Claims a slot from the inode bitmap, skipping slots the bitmap has wrongly as free
+static int portfs_fe_claim_free(struct portfs_superblock *psb, u32 slots, u32 *slot)
+{
+    for (;;)
+    {
+        int err = portfs_ino_bitmap_alloc(psb, slots, slot);
+        if (err)
+            return err;
+
+        struct disk_filetable_entry disk_entry;
+        err = portfs_fe_io(psb, *slot, &disk_entry, false);
+        if (err)
+        {
+            portfs_ino_bitmap_mark(psb, *slot, false);
+            return err;
+        }
+        if (disk_entry.mode == 0)
+            return 0;
+
+        pr_warn("portfs_fe_claim_free: Slot %u is in use but free in the inode bitmap", *slot);
+    }
+}
+
+
+// Finds a free slot whose inode number is not taken, called with the filetable locked
+static int portfs_fe_find_free(struct portfs_superblock *psb, u32 *slot)
+{
+    const u32 slots = portfs_filetable_slots(psb);
+    unsigned long *used = NULL;
+
+    if (portfs_has_ino_bitmap(psb))
+        return portfs_fe_claim_free(psb, slots, slot);
+
+    if (!portfs_has_ino_slot(psb))
+    {
+        used = portfs_fe_used_inos(psb, slots);
+        if (IS_ERR(used))
+            return PTR_ERR(used);
+    }
+
+    int err = -ENOSPC;
+    for (u32 i = 0; i < slots && err == -ENOSPC; ++i)
+    {
+        if (used && test_bit(i, used))
+            continue;
+
+        struct disk_filetable_entry disk_entry;
+        err = portfs_fe_io(psb, i, &disk_entry, false);
+        if (!err && disk_entry.mode != 0)
+            err = -ENOSPC;
+        else if (!err)
+            *slot = i;
+        cond_resched();
+    }
+
+    kvfree(used);
+    return err;
+}
+
+
+/*
+ * Claims the first free slot for a new entry in 'fe', whose inode number
+ * becomes slot + 1. The entry is written to the buffer cache right away,
+ * so the slot is no longer seen as free.
+ */
+int portfs_fe_alloc(struct portfs_superblock *psb, struct filetable_entry *fe, u16 mode)
+{
+    struct portfs_filetable *filetable = psb->filetable;
+
+    memset(fe, 0, sizeof(*fe));
+    fe->mode = mode;
+    fe->layout_dirty = true;
+
+    mutex_lock(&filetable->lock);
+    int err = portfs_fe_find_free(psb, &fe->slot);
+    const bool claimed = !err;
+    if (claimed)
+    {
+        fe->ino = fe->slot + 1;
+        err = portfs_fe_write(psb, fe);
+    }
+    if (err && claimed)
+    {
+        fe->mode = 0;
+        portfs_fe_write(psb, fe);
+        if (portfs_has_ino_bitmap(psb))
+            portfs_ino_bitmap_mark(psb, fe->slot, false);
+    }
+    mutex_unlock(&filetable->lock);
+
+    if (err)
+        pr_err("portfs_fe_alloc: No filetable slot for a new entry, error: %d", err);
+    return err;
+}
+
+
+// Writes the entry into its filetable block in the buffer cache
+int portfs_fe_write(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    struct disk_filetable_entry disk_entry;
+    portfs_fe_encode(psb, fe, &disk_entry);
+    return portfs_fe_io(psb, fe->slot, &disk_entry, true);
+}
+
+
+// Writes the entry and waits until its filetable blocks are on disk
+int portfs_fe_sync(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    int err = portfs_fe_write(psb, fe);
+    if (err)
+        return err;
+
+    const u64 pos = (u64)fe->slot * sizeof(struct disk_filetable_entry);
+    u32 first = psb->filetable_start + div_u64(pos, psb->block_size);
+    u32 last = psb->filetable_start
+               + div_u64(pos + sizeof(struct disk_filetable_entry) - 1, psb->block_size);
+
+    for (u32 block = first; block <= last; ++block)
+    {
+        struct portfs_buf *buf = portfs_bread(psb, block);
+        if (IS_ERR(buf))
+            return PTR_ERR(buf);
+        err = portfs_bsync(buf);
+        portfs_brelse(buf);
+        if (err)
+            return err;
+    }
+
+    return portfs_fe_flush(psb, fe);
+}
+
+
+// Syncs the entry's range of the storage file, the flush also covers writeback that has completed
+int portfs_fe_flush(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    loff_t entry_pos = (loff_t)psb->filetable_start * psb->block_size
+                       + (u64)fe->slot * sizeof(struct disk_filetable_entry);
+    return vfs_fsync_range(storage_filp, entry_pos,
+                           entry_pos + sizeof(struct disk_filetable_entry) - 1, 1);
+}
+
+
+/*
+ * Frees what the entry holds once its inode goes away or the file is
+ * deleted, callers write it back first. The entry itself goes with the inode.
+ */
+void portfs_fe_release(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    portfs_drop_extents(fe);
+    portfs_drop_dir_data(fe);
+}
+
+
+// Frees the slot on disk and the in-memory entry
+void portfs_fe_delete(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    struct portfs_filetable *filetable = psb->filetable;
+
+    fe->mode = 0;
+    if (portfs_fe_write(psb, fe))
+        pr_err("portfs_fe_delete: Failed to free filetable slot %u", fe->slot);
+
+    // A slot that fails to be cleared on disk stays marked as used
+    else if (portfs_has_ino_bitmap(psb))
+    {
+        mutex_lock(&filetable->lock);
+        portfs_ino_bitmap_mark(psb, fe->slot, false);
+        mutex_unlock(&filetable->lock);
+    }
+    portfs_fe_release(psb, fe);
+}
+
@@ -0,0 +1,21 @@
+#ifndef FILETABLE_H
+#define FILETABLE_H
+
+#include <linux/types.h>
+
+struct portfs_superblock;
+struct filetable_entry;
+
+int portfs_filetable_init(struct portfs_superblock *psb);
+void portfs_filetable_destroy(struct portfs_superblock *psb);
+u32 portfs_filetable_slots(struct portfs_superblock *psb);
+
+int portfs_fe_lookup(struct portfs_superblock *psb, u32 ino, struct filetable_entry *fe);
+int portfs_fe_alloc(struct portfs_superblock *psb, struct filetable_entry *fe, u16 mode);
+int portfs_fe_write(struct portfs_superblock *psb, struct filetable_entry *fe);
+int portfs_fe_sync(struct portfs_superblock *psb, struct filetable_entry *fe);
+int portfs_fe_flush(struct portfs_superblock *psb, struct filetable_entry *fe);
+void portfs_fe_release(struct portfs_superblock *psb, struct filetable_entry *fe);
+void portfs_fe_delete(struct portfs_superblock *psb, struct filetable_entry *fe);
+
+#endif // FILETABLE_H
@@ -0,0 +1,202 @@
+/*
+ *
+ * Free space index.
+ * On a clean unmount the free extents are written as a sorted array of
+ * struct disk_extent (struct disk_free_extent64 on 64-bit images) into
+ * a free run of blocks, and the superblock points
+ * at it. The next mount rebuilds the free extent trees from that array in
+ * O(free extents) instead of scanning the whole block bitmap. The index
+ * lives in blocks that it describes as free, so nothing has to be
+ * allocated for it; the mount clears PORTFS_SB_FREE_INDEX on disk before
+ * the first allocation can overwrite it.
+ */
+#include "free_index.h"
+
+#include "linux/crc32.h"
+#include "linux/fs.h"
+#include "linux/mm.h"
+#include "linux/slab.h"
+
+#include "portfs.h"
+#include "extent_alloc.h"
+#include "shared_structs.h"
+
+static size_t portfs_free_index_entry_size(struct portfs_superblock *psb)
+{
+    return portfs_has_64bit(psb) ? sizeof(struct disk_free_extent64) : sizeof(struct disk_extent);
+}
+
+
+static size_t portfs_free_index_blocks(struct portfs_superblock *psb, u32 extent_count)
+{
+    return DIV_ROUND_UP((size_t)extent_count * portfs_free_index_entry_size(psb), psb->block_size);
+}
+
+
+static struct extent portfs_free_index_get(struct portfs_superblock *psb, const void *entries, u32 i)
+{
+    struct extent ext;
+    if (portfs_has_64bit(psb))
+    {
+        const struct disk_free_extent64 *entry = (const struct disk_free_extent64 *)entries + i;
+        ext.start_block = be64_to_cpu(entry->start_block);
+        ext.length = be32_to_cpu(entry->length);
+    }
+    else
+    {
+        const struct disk_extent *entry = (const struct disk_extent *)entries + i;
+        ext.start_block = be32_to_cpu(entry->start_block);
+        ext.length = be32_to_cpu(entry->length);
+    }
+    return ext;
+}
+
+
+static void portfs_free_index_set(struct portfs_superblock *psb, void *entries, u32 i,
+                                  const struct extent *ext)
+{
+    if (portfs_has_64bit(psb))
+    {
+        struct disk_free_extent64 *entry = (struct disk_free_extent64 *)entries + i;
+        entry->start_block = cpu_to_be64(ext->start_block);
+        entry->length = cpu_to_be32(ext->length);
+    }
+    else
+    {
+        struct disk_extent *entry = (struct disk_extent *)entries + i;
+        entry->start_block = cpu_to_be32(ext->start_block);
+        entry->length = cpu_to_be32(ext->length);
+    }
+}
+
+
+static int portfs_free_index_parse(struct portfs_superblock *psb, const void *entries, u32 count)
+{
+    u64 prev_end = psb->data_start;
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        struct extent ext = portfs_free_index_get(psb, entries, i);
+        u64 start = ext.start_block;
+        u32 length = ext.length;
+
+        // Sorted, not overlapping and inside the data area
+        if (length == 0 || start < prev_end || start > psb->total_blocks
+            || length > psb->total_blocks - start)
+        {
+            pr_err("portfs_free_index_parse: Invalid extent [%llu ... +%u) at %u", start, length, i);
+            return -EUCLEAN;
+        }
+
+        int err = portfs_free_space_add(psb, start, length);
+        if (err)
+            return err;
+        prev_end = start + length;
+    }
+
+    return 0;
+}
+
+
+int portfs_free_index_load(struct portfs_superblock *psb)
+{
+    u32 count = psb->free_index_extents;
+    size_t blocks = portfs_free_index_blocks(psb, count);
+    if (count == 0)
+        return 0;   // The filesystem was full
+
+    if (psb->free_index_start < psb->data_start ||
+        blocks > psb->total_blocks - psb->free_index_start)
+    {
+        pr_err("portfs_free_index_load: Index at block %u is out of range", psb->free_index_start);
+        return -EUCLEAN;
+    }
+
+    size_t bytes = (size_t)count * portfs_free_index_entry_size(psb);
+    void *entries = kvmalloc(bytes, GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
+
+    loff_t pos = (loff_t)psb->free_index_start * psb->block_size;
+    ssize_t bytes_read = kernel_read(storage_filp, entries, bytes, &pos);
+    int err = 0;
+    if (bytes_read != bytes)
+        err = bytes_read < 0 ? bytes_read : -EIO;
+    else if (crc32(0, entries, bytes) != psb->free_index_crc)
+        err = -EBADMSG;
+    else
+        err = portfs_free_index_parse(psb, entries, count);
+
+    kvfree(entries);
+    if (!err)
+        pr_info("portfs_free_index_load: Loaded %u free extents", count);
+    return err;
+}
+
+
+// Writes the extents into the first free run that can hold them
+static int portfs_free_index_write(struct portfs_superblock *psb,
+                                   const struct extent *extents, u32 count)
+{
+    size_t blocks = portfs_free_index_blocks(psb, count);
+    u32 i = 0;
+    while (i < count && extents[i].start_block < PORTFS_META_BLOCK_LIMIT
+           && extents[i].length < blocks)
+        ++i;
+    if (i == count || extents[i].start_block >= PORTFS_META_BLOCK_LIMIT)
+        return -ENOSPC;
+
+    size_t bytes = blocks * psb->block_size;
+    void *entries = kvzalloc(bytes, GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
+
+    for (u32 j = 0; j < count; ++j)
+        portfs_free_index_set(psb, entries, j, &extents[j]);
+
+    u32 start = extents[i].start_block;
+    loff_t pos = (loff_t)start * psb->block_size;
+    ssize_t bytes_written = kernel_write(storage_filp, entries, bytes, &pos);
+    int err = 0;
+    if (bytes_written != bytes)
+        err = bytes_written < 0 ? bytes_written : -EIO;
+    else
+        err = vfs_fsync_range(storage_filp, pos - bytes, pos - 1, 1);
+
+    if (!err)
+    {
+        psb->free_index_start = start;
+        psb->free_index_crc = crc32(0, entries, (size_t)count * portfs_free_index_entry_size(psb));
+    }
+
+    kvfree(entries);
+    return err;
+}
+
+
+/*
+ * Saves the free extents and records their location in psb. The caller
+ * sets PORTFS_SB_FREE_INDEX and writes the superblock once this succeeds.
+ */
+int portfs_free_index_save(struct portfs_superblock *psb)
+{
+    u32 count = 0;
+    struct extent *extents = portfs_free_space_snapshot(psb, &count);
+    if (!extents)
+        return -ENOMEM;
+
+    psb->free_index_start = 0;
+    psb->free_index_crc = 0;
+    int err = count > 0 ? portfs_free_index_write(psb, extents, count) : 0;
+    kvfree(extents);
+
+    if (err)
+    {
+        pr_warn("portfs_free_index_save: Could not save free space index, error: %d", err);
+        return err;
+    }
+
+    psb->free_index_extents = count;
+    pr_info("portfs_free_index_save: Saved %u free extents at block %u", count, psb->free_index_start);
+    return 0;
+}
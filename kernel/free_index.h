@@ -0,0 +1,9 @@
+#ifndef FREE_INDEX_H
+#define FREE_INDEX_H
+
+struct portfs_superblock;
+
+int portfs_free_index_load(struct portfs_superblock *psb);
+int portfs_free_index_save(struct portfs_superblock *psb);
+
+#endif // FREE_INDEX_H
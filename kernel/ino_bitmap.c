@@ -0,0 +1,145 @@
+/*
+ *
+ * Inode bitmap access.
+ * Bit N is set while filetable slot N, inode number N + 1, is in use. Like
+ * the block bitmap it goes through the buffer cache block by block. The
+ * search for a free inode starts at next_free_ino_hint and scans a word at
+ * a time. The hint never passes a free slot, so creating a file reads one
+ * bitmap block however full the filetable is. The bitmap is only trusted
+ * after a clean unmount, see PORTFS_SB_INO_BITMAP.
+ */
+#include "ino_bitmap.h"
+
+#include "linux/err.h"
+#include "linux/fs.h"
+
+#include "portfs.h"
+#include "bitmap.h"
+#include "buffer_cache.h"
+#include "shared_structs.h"
+
+static inline uint32_t portfs_ino_bits_per_block(struct portfs_superblock *psb)
+{
+    return psb->block_size * BITS_PER_BYTE;
+}
+
+
+// Validates the bitmap location against the filetable of 'slots' entries
+int portfs_ino_bitmap_check(struct portfs_superblock *psb, uint32_t slots)
+{
+    if (!portfs_has_ino_slot(psb))
+    {
+        pr_err("portfs_ino_bitmap_check: Inode bitmap without slot inode numbers");
+        return -EINVAL;
+    }
+
+    u64 bitmap_end = (u64)psb->ino_bitmap_start + psb->ino_bitmap_size;
+    if (psb->ino_bitmap_start == 0 || bitmap_end > psb->data_start
+        || (u64)psb->ino_bitmap_size * portfs_ino_bits_per_block(psb) < slots)
+    {
+        pr_err("portfs_ino_bitmap_check: Inode bitmap [%u, %llu) does not cover %u slots",
+               psb->ino_bitmap_start, bitmap_end, slots);
+        return -EINVAL;
+    }
+
+    if (psb->next_free_ino_hint == 0 || psb->next_free_ino_hint > slots)
+        psb->next_free_ino_hint = 1;
+    return 0;
+}
+
+
+// Clears the whole bitmap before it is rebuilt from the filetable
+int portfs_ino_bitmap_reset(struct portfs_superblock *psb)
+{
+    for (uint32_t i = 0; i < psb->ino_bitmap_size; ++i)
+    {
+        struct portfs_buf *buf = portfs_bnew(psb, psb->ino_bitmap_start + i);
+        if (IS_ERR(buf))
+            return PTR_ERR(buf);
+        portfs_brelse(buf);
+    }
+
+    psb->next_free_ino_hint = 1;
+    return 0;
+}
+
+
+// Stores the first clear bit in [from, end) in 'slot', -ENOSPC if there is none
+static int portfs_ino_find_free(struct portfs_superblock *psb, uint32_t from, uint32_t end,
+                                uint32_t *slot)
+{
+    const uint32_t bits = portfs_ino_bits_per_block(psb);
+    uint32_t bit = from;
+
+    while (bit < end)
+    {
+        uint32_t offset = bit % bits;
+        uint32_t base = bit - offset;
+        uint32_t limit = min(bits, end - base);
+
+        struct portfs_buf *buf = portfs_bread(psb, psb->ino_bitmap_start + bit / bits);
+        if (IS_ERR(buf))
+        {
+            pr_err("portfs_ino_find_free: Failed to read inode bitmap of slot %u", bit);
+            return PTR_ERR(buf);
+        }
+
+        uint32_t found = portfs_bitmap_next_zero(buf->data, limit, offset);
+        portfs_brelse(buf);
+
+        if (found < limit)
+        {
+            *slot = base + found;
+            return 0;
+        }
+        bit = base + limit;
+    }
+
+    return -ENOSPC;
+}
+
+
+int portfs_ino_bitmap_mark(struct portfs_superblock *psb, uint32_t slot, bool used)
+{
+    const uint32_t bits = portfs_ino_bits_per_block(psb);
+
+    struct portfs_buf *buf = portfs_bread(psb, psb->ino_bitmap_start + slot / bits);
+    if (IS_ERR(buf))
+    {
+        pr_err("portfs_ino_bitmap_mark: Failed to read inode bitmap of slot %u", slot);
+        return PTR_ERR(buf);
+    }
+
+    if (used)
+        portfs_bitmap_set_bit(buf->data, slot % bits);
+    else
+        portfs_bitmap_clear_bit(buf->data, slot % bits);
+    portfs_bmark_dirty(buf);
+    portfs_brelse(buf);
+
+    // Every slot below the hint stays in use
+    if (!used && slot + 1 < psb->next_free_ino_hint)
+        psb->next_free_ino_hint = slot + 1;
+    return 0;
+}
+
+
+/*
+ * Claims the lowest free slot at or after the hint, wrapping around once.
+ * Callers serialize allocations, see portfs_fe_alloc().
+ */
+int portfs_ino_bitmap_alloc(struct portfs_superblock *psb, uint32_t slots, uint32_t *slot)
+{
+    const uint32_t start = psb->next_free_ino_hint - 1;
+
+    int err = portfs_ino_find_free(psb, start, slots, slot);
+    if (err == -ENOSPC && start > 0)
+        err = portfs_ino_find_free(psb, 0, start, slot);
+    if (!err)
+        err = portfs_ino_bitmap_mark(psb, *slot, true);
+    if (err)
+        return err;
+
+    psb->next_free_ino_hint = *slot + 1 < slots ? *slot + 2 : 1;
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef INO_BITMAP_H
+#define INO_BITMAP_H
+
+#include <linux/types.h>
+
+struct portfs_superblock;
+
+int portfs_ino_bitmap_check(struct portfs_superblock *psb, uint32_t slots);
+int portfs_ino_bitmap_reset(struct portfs_superblock *psb);
+int portfs_ino_bitmap_alloc(struct portfs_superblock *psb, uint32_t slots, uint32_t *slot);
+int portfs_ino_bitmap_mark(struct portfs_superblock *psb, uint32_t slot, bool used);
+
+#endif // INO_BITMAP_H
@@ -2,47 +2,59 @@
 
 #include "linux/err.h"
 #include "linux/fs.h"
+#include "linux/slab.h"
 #include "linux/stat.h"
 
 #include "file.h"
 #include "portfs.h"
 #include "shared_structs.h"
-#include "block_bitmap.h"
 #include "extent_alloc.h"
 #include "directory.h"
+#include "buffer_cache.h"
+#include "filetable.h"
 
-/*
-static uint32_t portfs_alloc_ino(struct portfs_superblock *psb)
+static struct kmem_cache *portfs_inode_cachep;
+
+
+static void portfs_inode_init_once(void *obj)
+{
+    struct portfs_inode_info *info = obj;
+    inode_init_once(&info->vfs_inode);
+}
+
+
+int portfs_inode_cache_init(void)
 {
-    uint8_t *inode_bitmap = psb->ino_bitmap;
+    portfs_inode_cachep = kmem_cache_create("portfs_inode_cache", sizeof(struct portfs_inode_info),
+                                            0, SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+                                            portfs_inode_init_once);
+    return portfs_inode_cachep ? 0 : -ENOMEM;
 }
-*/
 
 
-static void portfs_free_extent(struct portfs_superblock *psb, struct extent *extent)
+void portfs_inode_cache_exit(void)
 {
-    uint8_t *block_bitmap = psb->block_bitmap;
-    clear_blocks_allocated(block_bitmap, extent->start_block, extent->length);
-    extent->start_block = 0;
-    extent->length = 0;
+    // Inodes are given back to the cache after an RCU grace period
+    rcu_barrier();
+    kmem_cache_destroy(portfs_inode_cachep);
 }
 
 
-struct filetable_entry *portfs_find_free_file_entry(struct portfs_superblock *psb)
+struct inode *portfs_alloc_inode(struct super_block *sb)
 {
-    if (!psb)
+    struct portfs_inode_info *info = alloc_inode_sb(sb, portfs_inode_cachep, GFP_KERNEL);
+    if (!info)
         return NULL;
 
-    struct filetable_entry *entry = psb->filetable;
+    memset(&info->fe, 0, sizeof(info->fe));
+    return &info->vfs_inode;
+}
 
-    for ( int i = 0; i < psb->max_file_count; ++i, ++entry)
-    {
-        if (entry->mode == 0)
-        {
-            return entry;
-        }
-    }
-    return NULL;
+
+// The entry was released in portfs_evict_inode(), only the memory is left
+void portfs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(portfs_inode_cachep, PORTFS_I(inode));
 }
 
 
@@ -50,65 +62,81 @@ struct inode *portfs_get_inode_by_number(struct super_block *sb, uint32_t ino)
 {
     struct portfs_superblock *psb = sb->s_fs_info;
 
-    struct filetable_entry *file_entry = (struct filetable_entry *)psb->filetable;
-    for (size_t i = 0; i < psb->max_file_count; ++i, ++file_entry)
+    struct inode *inode = iget_locked(sb, ino);
+    if (!inode)
     {
-        if (file_entry->ino == ino)
-        {
-            struct inode *inode = iget_locked(sb, file_entry->ino);
-            if (!inode)
-            {
-                pr_err("portfs_get_inode_by_name: Failed to get new inode\n");
-                return ERR_PTR(-ENOENT);
-            }
-            if (inode->i_state & I_NEW)
-            {
-                inode->i_mode = file_entry->mode;
-                inode->i_uid = current_fsuid();
-                inode->i_gid = current_fsgid();
-                inode->i_size = file_entry->size_in_bytes;
-                inode->i_sb = sb;
-
-                time64_t now = ktime_get_real_seconds();
-                inode->i_atime_sec = now;
-                inode->i_mtime_sec = now;
-                inode->i_ctime_sec = now;
-
-                if (S_ISREG(file_entry->mode))
-                {
-                    inode->i_op = &portfs_file_inode_operations;
-                    inode->i_fop = &portfs_file_operations;
-                }
-                else if (S_ISDIR(file_entry->mode))
-                {
-                    inode->i_op = &portfs_dir_inode_operations;
-                    inode->i_fop = &portfs_dir_file_operations;
-                }
-                inode->i_private = file_entry;
-
-                insert_inode_hash(inode);
-                unlock_new_inode(inode);
-            }
-            return inode;
-        }
+        pr_err("portfs_get_inode_by_number: Failed to get new inode\n");
+        return ERR_PTR(-ENOMEM);
     }
-    return NULL;
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    // Not in memory yet, read its entry from the filetable
+    struct filetable_entry *file_entry = &PORTFS_I(inode)->fe;
+    int err = portfs_fe_lookup(psb, ino, file_entry);
+    if (err)
+    {
+        iget_failed(inode);
+        return err == -ENOENT ? NULL : ERR_PTR(err);
+    }
+
+    inode->i_mode = file_entry->mode;
+    inode->i_uid = current_fsuid();
+    inode->i_gid = current_fsgid();
+    inode->i_size = file_entry->size_in_bytes;
+    inode->i_sb = sb;
+
+    time64_t now = ktime_get_real_seconds();
+    inode->i_atime_sec = now;
+    inode->i_mtime_sec = now;
+    inode->i_ctime_sec = now;
+
+    if (S_ISREG(file_entry->mode))
+    {
+        inode->i_op = &portfs_file_inode_operations;
+        inode->i_fop = &portfs_file_operations;
+    }
+    else if (S_ISDIR(file_entry->mode))
+    {
+        inode->i_op = &portfs_dir_inode_operations;
+        inode->i_fop = &portfs_dir_file_operations;
+    }
+    inode->i_private = file_entry;
+
+    unlock_new_inode(inode);
+    return inode;
 }
 
 
+/*
+ * Creates a locked inode for a new file along with its filetable entry,
+ * the inode number comes from the filetable slot.
+ */
 struct inode *portfs_make_inode(struct super_block *sb, umode_t mode)
 {
-    struct inode *inode = iget_locked(sb, iunique(sb, 2)); // root inode is 1 so start from 2
-    if (IS_ERR(inode))
-        return inode;
+    struct portfs_superblock *psb = sb->s_fs_info;
+    struct inode *inode = new_inode(sb);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
 
-    if (!(inode->i_state & I_NEW))
+    struct filetable_entry *file_entry = &PORTFS_I(inode)->fe;
+    int err = portfs_fe_alloc(psb, file_entry, mode);
+    if (err)
     {
-        pr_err("portfs_make_inode: Inode %lu not I_NEW after iget_locked!\n", inode->i_ino);
-        clear_nlink(inode);
         iput(inode);
-        return ERR_PTR(-EEXIST);
+        return ERR_PTR(err);
+    }
+
+    inode->i_ino = file_entry->ino;
+    err = insert_inode_locked(inode);
+    if (err)
+    {
+        pr_err("portfs_make_inode: Inode %lu is still in use\n", inode->i_ino);
+        portfs_fe_delete(psb, file_entry);
+        iput(inode);
+        return ERR_PTR(err);
     }
+    inode->i_private = file_entry;
     pr_info("portfs_make_inode: Inode %p created. i_state: %x, I_NEW set: %d (after new_inode)\n",
                     inode, inode->i_state, (inode->i_state & I_NEW) ? 1 : 0);
 
@@ -139,8 +167,8 @@ static int portfs_create(struct mnt_idmap *idmap, struct inode *dir,
     if (dentry->d_inode)
         return -EEXIST;
 
-    struct filetable_entry *file_entry;
     struct super_block *sb = dir->i_sb;
+    struct portfs_superblock *psb = sb->s_fs_info;
 
     struct inode *inode = portfs_make_inode(sb, mode);
     if (IS_ERR(inode))
@@ -149,37 +177,26 @@ static int portfs_create(struct mnt_idmap *idmap, struct inode *dir,
         return PTR_ERR(inode);
     }
 
-    struct portfs_superblock *psb = sb->s_fs_info;
-    file_entry = portfs_find_free_file_entry(psb);
-    if (file_entry == NULL)
-    {
-        clear_nlink(inode);
-        iput(inode);
-        return -ENOSPC;
-    }
-
+    struct filetable_entry *file_entry = inode->i_private;
     inode_init_owner(idmap, inode, dir, mode);
-    inode->i_private = file_entry;
+    file_entry->mode = inode->i_mode;
     inode->i_op = &portfs_file_inode_operations;
     inode->i_fop = &portfs_file_operations;
 
-    file_entry->mode = inode->i_mode;
-    file_entry->ino = inode->i_ino;
-    file_entry->size_in_bytes = 0;
-
     struct filetable_entry *parent_dir = dir->i_private;
-    struct dir_entry d_entry;
-    strncpy(d_entry.name, dentry->d_name.name, sizeof(d_entry.name));
-    d_entry.inode_number = file_entry->ino;
-
-    int err = portfs_de_add(psb, parent_dir, &d_entry);
+    int err = portfs_de_add(psb, parent_dir, dentry->d_name.name, file_entry->ino,
+                            fs_umode_to_ftype(inode->i_mode));
     if (err)
     {
+        inode->i_private = NULL;
+        portfs_fe_delete(psb, file_entry);
         clear_nlink(inode);
-        iput(inode);
+        discard_new_inode(inode);
         return err;
     }
 
+    // The directory may have grown by a block
+    i_size_write(dir, parent_dir->size_in_bytes);
     d_instantiate_new(dentry, inode);
     mark_inode_dirty(inode);
     mark_inode_dirty(dir);
@@ -200,48 +217,37 @@ struct dentry *portfs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
         return ERR_PTR(-EEXIST);
     }
 
-    struct filetable_entry *file_entry;
     struct super_block *sb = dir->i_sb;
+    struct portfs_superblock *psb = sb->s_fs_info;
 
-    struct inode *inode = portfs_make_inode(sb, mode);
+    struct inode *inode = portfs_make_inode(sb, S_IFDIR | mode);
     if (IS_ERR(inode))
         return ERR_CAST(inode);
 
     pr_info("portfs_mkdir: Received inode from make_inode: %p, ino: %lu\n", inode, inode->i_ino);
 
-    struct portfs_superblock *psb = sb->s_fs_info;
-    file_entry = portfs_find_free_file_entry(psb);
-    if (file_entry == NULL)
-    {
-        clear_nlink(inode);
-        iput(inode);
-        return ERR_PTR(-ENOSPC);
-    }
-
-    set_nlink(inode, 2);
+    struct filetable_entry *file_entry = inode->i_private;
     inode_init_owner(idmap, inode, dir, S_IFDIR | mode);
-    inode->i_private = file_entry;
+    file_entry->mode = inode->i_mode;
+    set_nlink(inode, 2);
     inode->i_op = &portfs_dir_inode_operations;
     inode->i_fop = &portfs_dir_file_operations;
 
-    file_entry->mode = inode->i_mode;
-    file_entry->ino = inode->i_ino;
-    file_entry->size_in_bytes = 0;
     file_entry->dir.parent_dir_ino = dir->i_ino;
 
     struct filetable_entry *parent_dir = dir->i_private;
-    struct dir_entry d_entry;
-    strncpy(d_entry.name, dentry->d_name.name, sizeof(d_entry.name));
-    d_entry.inode_number = file_entry->ino;
-
-    int err = portfs_de_add(psb, parent_dir, &d_entry);
+    int err = portfs_de_add(psb, parent_dir, dentry->d_name.name, file_entry->ino,
+                            fs_umode_to_ftype(inode->i_mode));
     if (err)
     {
+        inode->i_private = NULL;
+        portfs_fe_delete(psb, file_entry);
         clear_nlink(inode);
-        iput(inode);
+        discard_new_inode(inode);
         return ERR_PTR(err);
     }
 
+    i_size_write(dir, parent_dir->size_in_bytes);
     d_instantiate_new(dentry, inode);
 
     mark_inode_dirty(inode);
@@ -270,13 +276,10 @@ static int portfs_rmdir(struct inode *parent_dir, struct dentry *dentry)
         return -ENOTEMPTY;
     }
 
-    if (dir->dir.dir_block != 0)
-        clear_block_allocated(psb->block_bitmap, dir->dir.dir_block);
-
-    if (dir->dir_entries)
-        kfree(dir->dir_entries);
-
-    memset(dir, 0, sizeof(*dir));
+    portfs_free_dir_blocks(psb, dir);
+    portfs_fe_delete(psb, dir);
+    // The inode number is free for reuse with the slot
+    remove_inode_hash(inode);
 
     portfs_de_remove(psb, parent_dir->i_private, dentry->d_name.name);
 
@@ -308,14 +311,12 @@ static int portfs_unlink(struct inode *dir, struct dentry *dentry)
     if (!file_entry)
         return -EINVAL;
 
-    for (size_t i = 0; i < file_entry->file.extent_count; ++i)
-    {
-        const struct extent *ext = get_extent(file_entry, i);
-        clear_blocks_allocated(psb->block_bitmap,
-                               ext->start_block,
-                               ext->length);
-    }
-    memset(file_entry, 0, sizeof(*file_entry));
+    int err = portfs_free_tail_blocks(psb, file_entry, 0);
+    if (err)
+        return err;
+    portfs_fe_delete(psb, file_entry);
+    // The inode number is free for reuse with the slot
+    remove_inode_hash(inode);
 
     portfs_de_remove(psb, dir->i_private, dentry->d_name.name);
 
@@ -344,12 +345,12 @@ static struct dentry *portfs_lookup(struct inode *dir, struct dentry *dentry,
 
     struct super_block *sb = dir->i_sb;
 
-    if (dentry->d_name.len == 0 || dentry->d_name.len > MAX_NAME_LENGTH)
+    struct portfs_superblock *psb = sb->s_fs_info;
+    if (dentry->d_name.len == 0 || dentry->d_name.len > portfs_max_name_len(psb))
     {
         return ERR_PTR(-ENAMETOOLONG);
     }
 
-    struct portfs_superblock *psb = sb->s_fs_info;
     struct filetable_entry *parent_dir = dir->i_private;
     struct dir_entry *d_entry = portfs_de_find(psb, parent_dir, dentry->d_name.name);
     if (IS_ERR(d_entry))
@@ -391,56 +392,38 @@ static int portfs_truncate(struct inode *inode, loff_t new_size)
     pr_info("portfs_truncate: Beginning");
     struct filetable_entry *file_entry = inode->i_private;
     struct portfs_superblock *psb = inode->i_sb->s_fs_info;
-    if (new_size == 0) {
-        for (int i = 0; i < file_entry->file.extent_count; ++i)
-            portfs_free_extent(psb, &file_entry->file.direct_extents[i]);
 
-        file_entry->file.extent_count = 0;
-        file_entry->size_in_bytes = 0;
-        inode->i_size = 0;
-
-        pr_info("portfs_truncate: Truncated to 0");
-
-        return 0;
-    }
-
-    loff_t old_blocks = (file_entry->size_in_bytes + psb->block_size - 1) / psb->block_size;
     loff_t new_blocks = (new_size + psb->block_size - 1) / psb->block_size;
-    loff_t blocks_to_remove = old_blocks - new_blocks;
-    if (blocks_to_remove == 0)
-        return 0;
-
-    for (int i = file_entry->file.extent_count - 1; i >= 0; ++i)
+    int err = portfs_free_tail_blocks(psb, file_entry, new_blocks);
+    if (err)
     {
-        if (blocks_to_remove >= file_entry->file.direct_extents[i].length)
-        {
-            blocks_to_remove -= file_entry->file.direct_extents[i].length;
-            portfs_free_extent(psb, &file_entry->file.direct_extents[i]);
-            file_entry->file.extent_count--;
-        }
-        else
-        {
-            break;
-        }
+        pr_warn("portfs_truncate: Failed to free blocks past %lld", new_blocks);
+        return err;
     }
 
     file_entry->size_in_bytes = new_size;
+    file_entry->layout_dirty = true;
     inode->i_size = new_size;
-    if (blocks_to_remove != 0)
-    {
-        pr_warn("portfs_truncate: Failed to free %lld blocks", blocks_to_remove);
-        return -EIO;
-    }
 
+    pr_info("portfs_truncate: Truncated to %lld", new_size);
     return 0;
 }
 
-static int portfs_extend(struct inode *inode, loff_t new_size)
+static int portfs_extend(struct dentry *dentry, loff_t new_size)
 {
     pr_info("portfs_extend: Beginning");
+    struct inode *inode = d_inode(dentry);
     struct filetable_entry *file_entry = inode->i_private;
     struct portfs_superblock *psb = inode->i_sb->s_fs_info;
     size_t needed_size = new_size - file_entry->size_in_bytes;
+
+    if (file_entry->file.extent_count > DIRECT_EXTENTS)
+    {
+        int err = portfs_load_extents(psb, file_entry);
+        if (err)
+            return err;
+    }
+
     const size_t available_size = portfs_get_allocated_size(file_entry, psb->block_size)
                                     - file_entry->size_in_bytes;
 
@@ -448,10 +431,13 @@ static int portfs_extend(struct inode *inode, loff_t new_size)
     {
         inode->i_size = new_size;
         file_entry->size_in_bytes = new_size;
+        file_entry->layout_dirty = true;
         return 0;
     }
 
-    int err = portfs_allocate_memory(psb, file_entry, needed_size);
+    int err = portfs_allocate_memory(psb, file_entry, needed_size,
+                                     portfs_dentry_goal(dentry));
+    mark_inode_dirty(inode);
     if (err)
     {
         pr_err("portfs_extend: Failed to allocate %ld bytes", needed_size);
@@ -460,6 +446,7 @@ static int portfs_extend(struct inode *inode, loff_t new_size)
 
     inode->i_size = new_size;
     file_entry->size_in_bytes = new_size;
+    file_entry->layout_dirty = true;
     return 0;
 }
 
@@ -487,7 +474,7 @@ static int portfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
         }
         else if (new_size > inode->i_size)
         {
-            err = portfs_extend(inode, new_size);
+            err = portfs_extend(dentry, new_size);
             if (err)
                 return err;
         }
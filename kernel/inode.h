@@ -5,11 +5,30 @@
 
 #include "shared_structs.h"
 
+/*
+ * Every inode comes with room for its filetable entry, so loading an inode
+ * is a single allocation. i_private points at 'fe' while the file exists.
+ */
+struct portfs_inode_info
+{
+    struct filetable_entry fe;
+    struct inode vfs_inode;
+};
+
+static inline struct portfs_inode_info *PORTFS_I(struct inode *inode)
+{
+    return container_of(inode, struct portfs_inode_info, vfs_inode);
+}
+
 extern const struct inode_operations portfs_dir_inode_operations;
 extern const struct inode_operations portfs_file_inode_operations;
 
+int portfs_inode_cache_init(void);
+void portfs_inode_cache_exit(void);
+struct inode *portfs_alloc_inode(struct super_block *sb);
+void portfs_free_inode(struct inode *inode);
+
 struct inode *portfs_make_inode(struct super_block *sb, umode_t mode);
-struct filetable_entry *portfs_find_free_file_entry(struct portfs_superblock *psb);
 struct inode *portfs_get_inode_by_number(struct super_block *sb, uint32_t ino);
 
 #endif // INODE_H
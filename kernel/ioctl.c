@@ -0,0 +1,286 @@
+/*
+ *
+ * ioctl commands, see common/portfs_ioctl.h.
+ */
+#include "ioctl.h"
+
+#include "linux/capability.h"
+#include "linux/err.h"
+#include "linux/fs.h"
+#include "linux/math64.h"
+#include "linux/mm.h"
+#include "linux/mount.h"
+#include "linux/slab.h"
+#include "linux/uaccess.h"
+
+#include "portfs.h"
+#include "extent_alloc.h"
+#include "extent_map.h"
+#include "portfs_ioctl.h"
+#include "resize.h"
+#include "shared_structs.h"
+
+#define PORTFS_DEFRAG_COPY_SIZE (1024 * 1024)
+
+// Copies 'length' blocks inside the storage file
+static int portfs_copy_blocks(struct portfs_superblock *psb, u64 from, u64 to, u32 length,
+                              void *buf)
+{
+    loff_t src = (loff_t)from * psb->block_size;
+    loff_t dst = (loff_t)to * psb->block_size;
+    loff_t remaining = (loff_t)length * psb->block_size;
+
+    while (remaining > 0)
+    {
+        size_t chunk = min_t(loff_t, remaining, PORTFS_DEFRAG_COPY_SIZE);
+
+        ssize_t bytes_read = kernel_read(storage_filp, buf, chunk, &src);
+        if (bytes_read != chunk)
+            return bytes_read < 0 ? bytes_read : -EIO;
+
+        ssize_t bytes_written = kernel_write(storage_filp, buf, chunk, &dst);
+        if (bytes_written != chunk)
+            return bytes_written < 0 ? bytes_written : -EIO;
+
+        remaining -= chunk;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Moves the file into a single new run of blocks: the data is copied and synced
+ * first, then the filetable entry is switched over and persisted, and the
+ * old blocks are released last, so a crash at any point leaves either
+ * the old or the new copy referenced.
+ */
+static int portfs_defrag_move(struct portfs_superblock *psb, struct filetable_entry *fe,
+                              const struct extent *old_extents, size_t count,
+                              u32 total_blocks, size_t new_count, void *buf)
+{
+    struct extent new_ext;
+    int err = portfs_alloc_contiguous(psb, old_extents[0].start_block, total_blocks, &new_ext);
+    if (err)
+    {
+        pr_warn("portfs_defrag_move: No free run of %u blocks for ino %u", total_blocks, fe->ino);
+        return err;
+    }
+
+    u64 dst = new_ext.start_block;
+    for (size_t i = 0; i < count && !err; ++i)
+    {
+        err = portfs_copy_blocks(psb, old_extents[i].start_block, dst, old_extents[i].length, buf);
+        dst += old_extents[i].length;
+    }
+    if (!err)
+    {
+        loff_t start = (loff_t)new_ext.start_block * psb->block_size;
+        err = vfs_fsync_range(storage_filp, start, start + (loff_t)total_blocks * psb->block_size - 1, 1);
+    }
+    if (err)
+    {
+        pr_err("portfs_defrag_move: Failed to copy data of ino %u", fe->ino);
+        portfs_release_blocks(psb, new_ext.start_block, new_ext.length);
+        return err;
+    }
+
+    // The run is split into extents no longer than the image format allows
+    const u32 max_length = portfs_max_extent_length(psb);
+    for (size_t i = 0; i < count; ++i)
+    {
+        struct extent *ext = get_extent_mut(fe, i);
+        u64 offset = (u64)i * max_length;
+        ext->start_block = i < new_count ? new_ext.start_block + offset : 0;
+        ext->length = i < new_count ? min_t(u64, max_length, total_blocks - offset) : 0;
+    }
+    fe->file.extent_count = new_count;
+    fe->layout_dirty = true;
+
+    err = portfs_sync_file_entry(psb, fe, false);
+    if (err)
+    {
+        // The entry on disk may still point at the old blocks, so they are kept
+        pr_err("portfs_defrag_move: Failed to sync ino %u, keeping its old extents", fe->ino);
+        for (size_t i = 0; i < count; ++i)
+            *get_extent_mut(fe, i) = old_extents[i];
+        fe->file.extent_count = count;
+        if (portfs_sync_file_entry(psb, fe, false))
+            pr_err("portfs_defrag_move: Failed to restore ino %u", fe->ino);
+        portfs_release_blocks(psb, new_ext.start_block, new_ext.length);
+        return err;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        portfs_release_blocks(psb, old_extents[i].start_block, old_extents[i].length);
+
+    pr_info("portfs_defrag_move: ino %u moved from %zu extents to [%llu ... %llu)",
+            fe->ino, count, new_ext.start_block, new_ext.start_block + new_ext.length);
+    return err;
+}
+
+
+static int portfs_defrag_file(struct inode *inode, struct portfs_defrag_args *args)
+{
+    struct portfs_superblock *psb = inode->i_sb->s_fs_info;
+    struct filetable_entry *fe = inode->i_private;
+
+    if (fe->file.extent_count > DIRECT_EXTENTS)
+    {
+        int err = portfs_load_extents(psb, fe);
+        if (err)
+            return err;
+    }
+
+    size_t count = fe->file.extent_count;
+    args->extents_before = count;
+    args->extents_after = count;
+    args->moved_blocks = 0;
+    if (count <= 1 || count < args->min_extents)
+        return 0;
+
+    size_t total_blocks = portfs_get_allocated_size(fe, 1);
+    if (total_blocks > U32_MAX)
+        return -EFBIG;
+
+    size_t new_count = DIV_ROUND_UP(total_blocks, portfs_max_extent_length(psb));
+    if (new_count >= count)
+        return 0;
+
+    // The extent list is rewritten while the old blocks are still needed
+    struct extent *old_extents = kvmalloc_array(count, sizeof(*old_extents), GFP_KERNEL);
+    void *buf = kvmalloc(PORTFS_DEFRAG_COPY_SIZE, GFP_KERNEL);
+    int err = -ENOMEM;
+    if (old_extents && buf)
+    {
+        for (size_t i = 0; i < count; ++i)
+            old_extents[i] = *get_extent(fe, i);
+
+        err = portfs_defrag_move(psb, fe, old_extents, count, total_blocks, new_count, buf);
+        if (fe->file.extent_count == new_count)
+        {
+            args->extents_after = new_count;
+            args->moved_blocks = total_blocks;
+        }
+    }
+
+    kvfree(buf);
+    kvfree(old_extents);
+    return err;
+}
+
+
+static long portfs_ioc_defrag(struct file *filp, void __user *argp)
+{
+    struct inode *inode = file_inode(filp);
+    struct portfs_defrag_args args;
+
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&args, argp, sizeof(args)))
+        return -EFAULT;
+
+    int err = mnt_want_write_file(filp);
+    if (err)
+        return err;
+
+    inode_lock(inode);
+    err = portfs_defrag_file(inode, &args);
+    inode_unlock(inode);
+    mnt_drop_write_file(filp);
+
+    if (err)
+        return err;
+    if (copy_to_user(argp, &args, sizeof(args)))
+        return -EFAULT;
+    return 0;
+}
+
+
+// Punches holes into the storage file for free runs inside the given byte range
+static long portfs_ioc_fitrim(struct file *filp, void __user *argp)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct portfs_superblock *psb = sb->s_fs_info;
+    struct fstrim_range range;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (copy_from_user(&range, argp, sizeof(range)))
+        return -EFAULT;
+
+    u64 start_block = div_u64(range.start, psb->block_size);
+    u64 min_blocks = max_t(u64, DIV_ROUND_UP_ULL(range.minlen, psb->block_size), 1);
+    if (start_block >= psb->total_blocks || min_blocks > psb->total_blocks)
+        return -EINVAL;
+
+    u64 end_block = psb->total_blocks;
+    if (range.len < U64_MAX - range.start)
+        end_block = min(end_block, div_u64(range.start + range.len, psb->block_size));
+
+    // Blocks are only trimmed once their release is on disk, so commit everything freed so far
+    down_read(&sb->s_umount);
+    int err = sync_filesystem(sb);
+    up_read(&sb->s_umount);
+    if (err)
+        return err;
+
+    u64 trimmed_blocks = 0;
+    u64 deferred_blocks = 0;
+    err = portfs_trim_free_space(psb, start_block, end_block, min_blocks,
+                                 &trimmed_blocks, &deferred_blocks);
+    if (err)
+        return err;
+
+    range.len = trimmed_blocks * psb->block_size;
+    if (copy_to_user(argp, &range, sizeof(range)))
+        return -EFAULT;
+    return 0;
+}
+
+
+static long portfs_ioc_grow(struct file *filp, void __user *argp)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct portfs_superblock *psb = sb->s_fs_info;
+    struct portfs_grow_args args;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (copy_from_user(&args, argp, sizeof(args)))
+        return -EFAULT;
+
+    int err = mnt_want_write_file(filp);
+    if (err)
+        return err;
+
+    err = portfs_grow_fs(sb, div_u64(args.new_size, psb->block_size));
+    mnt_drop_write_file(filp);
+
+    if (err)
+        return err;
+    args.total_blocks = psb->total_blocks;
+    if (copy_to_user(argp, &args, sizeof(args)))
+        return -EFAULT;
+    return 0;
+}
+
+
+long portfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    void __user *argp = (void __user *)arg;
+
+    switch (cmd)
+    {
+        case PORTFS_IOC_DEFRAG:
+            return portfs_ioc_defrag(filp, argp);
+        case FITRIM:
+            return portfs_ioc_fitrim(filp, argp);
+        case PORTFS_IOC_GROW:
+            return portfs_ioc_grow(filp, argp);
+        default:
+            return -ENOTTY;
+    }
+}
@@ -0,0 +1,8 @@
+#ifndef IOCTL_H
+#define IOCTL_H
+
+#include <linux/fs.h>
+
+long portfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+#endif // IOCTL_H
@@ -6,17 +6,121 @@
 #include "linux/fs.h"
 
 #include "shared_structs.h"
+#include "extent_map.h"
+
+static inline bool portfs_has_64bit(const struct portfs_superblock *psb)
+{
+    return psb->features & PORTFS_FEATURE_64BIT;
+}
+
+
+static inline bool portfs_has_ino_slot(const struct portfs_superblock *psb)
+{
+    return psb->features & PORTFS_FEATURE_INO_SLOT;
+}
+
+
+static inline bool portfs_has_ino_bitmap(const struct portfs_superblock *psb)
+{
+    return psb->features & PORTFS_FEATURE_INO_BITMAP;
+}
+
+
+static inline bool portfs_has_dir_extents(const struct portfs_superblock *psb)
+{
+    return psb->features & PORTFS_FEATURE_DIR_EXTENTS;
+}
+
+
+static inline bool portfs_has_dir_filetype(const struct portfs_superblock *psb)
+{
+    return psb->features & PORTFS_FEATURE_DIR_FILETYPE;
+}
+
+
+static inline bool portfs_has_dir_varlen(const struct portfs_superblock *psb)
+{
+    return psb->features & PORTFS_FEATURE_DIR_VARLEN;
+}
+
+
+// Metadata block fields are 32 bits wide, see PORTFS_FEATURE_64BIT
+#define PORTFS_META_BLOCK_LIMIT (1ULL << 32)
+
+// Longest data extent the on-disk format can describe
+static inline u32 portfs_max_extent_length(const struct portfs_superblock *psb)
+{
+    return portfs_has_64bit(psb) ? U16_MAX : U32_MAX;
+}
+
+
+static inline void portfs_extent_from_disk(const struct portfs_superblock *psb,
+                                           struct extent *ext, const struct disk_extent *de)
+{
+    if (portfs_has_64bit(psb))
+    {
+        const struct disk_extent64 *de64 = (const struct disk_extent64 *)de;
+        ext->start_block = be32_to_cpu(de64->start_lo) | (u64)be16_to_cpu(de64->start_hi) << 32;
+        ext->length = be16_to_cpu(de64->length);
+    }
+    else
+    {
+        ext->start_block = be32_to_cpu(de->start_block);
+        ext->length = be32_to_cpu(de->length);
+    }
+}
+
+
+static inline void portfs_extent_to_disk(const struct portfs_superblock *psb,
+                                         struct disk_extent *de, const struct extent *ext)
+{
+    if (portfs_has_64bit(psb))
+    {
+        struct disk_extent64 *de64 = (struct disk_extent64 *)de;
+        de64->start_lo = cpu_to_be32(lower_32_bits(ext->start_block));
+        de64->start_hi = cpu_to_be16(upper_32_bits(ext->start_block));
+        de64->length = cpu_to_be16(ext->length);
+    }
+    else
+    {
+        de->start_block = cpu_to_be32(ext->start_block);
+        de->length = cpu_to_be32(ext->length);
+    }
+}
+
 
 static inline const struct extent *get_extent(const struct filetable_entry *fe, size_t i)
 {
     return (i < DIRECT_EXTENTS)
         ? &fe->file.direct_extents[i]
-        : &fe->indirect_extents[i - DIRECT_EXTENTS];
+        : &fe->extent_map->extents[i - DIRECT_EXTENTS];
+}
+
+/*
+ * Logical starts of the extents after 'i' have to be recomputed once it
+ * changes, and the extent tree has to be rewritten.
+ */
+static inline struct extent *get_extent_mut(struct filetable_entry *fe, size_t i)
+{
+    if (fe->extent_map)
+    {
+        fe->extent_map->logical_valid = min(fe->extent_map->logical_valid, i + 1);
+        fe->extent_map->dirty_from = min(fe->extent_map->dirty_from, i);
+    }
+
+    return (i < DIRECT_EXTENTS)
+        ? &fe->file.direct_extents[i]
+        : &fe->extent_map->extents[i - DIRECT_EXTENTS];
 }
 
 static struct dentry *portfs_mount(struct file_system_type *fs_type,
                                    int flags, const char *dev_name, void *data);
 struct file* portfs_storage_init(char *path);
+int portfs_storage_punch(struct portfs_superblock *psb, u64 start_block, u32 length);
+int portfs_storage_extend(struct portfs_superblock *psb, u64 total_blocks);
+int portfs_sync_file_entry(struct portfs_superblock *psb, struct filetable_entry *fe,
+                           bool datasync);
+int portfs_commit_superblock(struct super_block *sb);
 
 static struct file_system_type portfs_type = {
     .owner = THIS_MODULE,
@@ -0,0 +1,321 @@
+/*
+ *
+ * Per-mount I/O throttling.
+ * Every read and write is charged against token buckets for bytes and
+ * requests, both for the whole mount and for the calling uid. Buckets may
+ * go into debt; the caller then sleeps until the debt is paid off.
+ * Small synchronous requests only wait once the debt exceeds
+ * PORTFS_QOS_PRIORITY_DEBT_MS, so they are served ahead of bulk I/O,
+ * which absorbs most of the throttling, while the limits still hold.
+ */
+#include "qos.h"
+
+#include "linux/cred.h"
+#include "linux/err.h"
+#include "linux/hashtable.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/sched.h"
+#include "linux/sched/signal.h"
+#include "linux/slab.h"
+#include "linux/spinlock.h"
+
+#include "shared_structs.h"
+
+#define PORTFS_QOS_UID_HASH_BITS 6
+#define PORTFS_QOS_DEFAULT_SMALL_IO (16 * 1024)
+#define PORTFS_QOS_MAX_RATE (S64_MAX / 4)
+#define PORTFS_QOS_PRIORITY_DEBT_MS 100   // Debt the small I/O lane may run ahead by
+
+struct portfs_token_bucket
+{
+    u64 rate;           // Tokens per second, 0 means unlimited
+    s64 tokens;         // Negative while the bucket is in debt
+    u64 last_refill;    // ktime in ns
+};
+
+struct portfs_qos_uid
+{
+    uid_t uid;
+    struct portfs_token_bucket bytes;
+    struct portfs_token_bucket ios;
+    struct hlist_node node;
+};
+
+struct portfs_qos
+{
+    spinlock_t lock;
+
+    struct portfs_token_bucket bytes;
+    struct portfs_token_bucket ios;
+
+    u64 uid_bps_limit;
+    u64 uid_iops_limit;
+    DECLARE_HASHTABLE(uids, PORTFS_QOS_UID_HASH_BITS);
+
+    u64 small_io_bytes;
+
+    u64 throttled_ios;
+    u64 throttled_ns;
+    u64 priority_ios;
+};
+
+
+static void portfs_bucket_set_rate(struct portfs_token_bucket *tb, u64 rate, u64 now)
+{
+    tb->rate = rate;
+    tb->tokens = rate;      // Burst is one second worth of tokens
+    tb->last_refill = now;
+}
+
+
+static void portfs_bucket_refill(struct portfs_token_bucket *tb, u64 now)
+{
+    if (tb->rate == 0)
+        return;
+
+    u64 elapsed = now - tb->last_refill;
+    tb->last_refill = now;
+
+    u64 new_tokens = mul_u64_u64_div_u64(tb->rate, elapsed, NSEC_PER_SEC);
+    new_tokens = min(new_tokens, tb->rate);
+    tb->tokens = min_t(s64, tb->tokens + (s64)new_tokens, (s64)tb->rate);
+}
+
+
+// Returns how long the caller has to wait until the debt is down to 'allowed_ns'
+static u64 portfs_bucket_charge(struct portfs_token_bucket *tb, u64 amount, u64 allowed_ns)
+{
+    if (tb->rate == 0)
+        return 0;
+
+    tb->tokens -= min_t(u64, amount, PORTFS_QOS_MAX_RATE);
+    if (tb->tokens >= 0)
+        return 0;
+
+    u64 debt_ns = mul_u64_u64_div_u64((u64)(-tb->tokens), NSEC_PER_SEC, tb->rate);
+    return debt_ns > allowed_ns ? debt_ns - allowed_ns : 0;
+}
+
+
+static bool portfs_qos_enabled(struct portfs_qos *qos)
+{
+    return READ_ONCE(qos->bytes.rate) || READ_ONCE(qos->ios.rate)
+        || READ_ONCE(qos->uid_bps_limit) || READ_ONCE(qos->uid_iops_limit);
+}
+
+
+// Called with qos->lock held
+static struct portfs_qos_uid *portfs_qos_find_uid(struct portfs_qos *qos, uid_t uid)
+{
+    struct portfs_qos_uid *uid_qos;
+    hash_for_each_possible(qos->uids, uid_qos, node, uid)
+    {
+        if (uid_qos->uid == uid)
+            return uid_qos;
+    }
+    return NULL;
+}
+
+
+static struct portfs_qos_uid *portfs_qos_get_uid(struct portfs_qos *qos, uid_t uid)
+{
+    spin_lock(&qos->lock);
+    struct portfs_qos_uid *uid_qos = portfs_qos_find_uid(qos, uid);
+    spin_unlock(&qos->lock);
+    if (uid_qos)
+        return uid_qos;
+
+    struct portfs_qos_uid *new_uid_qos = kzalloc(sizeof(*new_uid_qos), GFP_KERNEL);
+    if (!new_uid_qos)
+        return ERR_PTR(-ENOMEM);
+
+    u64 now = ktime_get_ns();
+    new_uid_qos->uid = uid;
+
+    spin_lock(&qos->lock);
+    uid_qos = portfs_qos_find_uid(qos, uid);
+    if (!uid_qos)
+    {
+        portfs_bucket_set_rate(&new_uid_qos->bytes, qos->uid_bps_limit, now);
+        portfs_bucket_set_rate(&new_uid_qos->ios, qos->uid_iops_limit, now);
+        hash_add(qos->uids, &new_uid_qos->node, uid);
+        uid_qos = new_uid_qos;
+        new_uid_qos = NULL;
+    }
+    spin_unlock(&qos->lock);
+
+    kfree(new_uid_qos);
+    return uid_qos;
+}
+
+
+int portfs_qos_throttle(struct portfs_superblock *psb, size_t bytes, bool sync)
+{
+    struct portfs_qos *qos = psb->qos;
+    if (!qos || !portfs_qos_enabled(qos))
+        return 0;
+
+    bool priority = sync && bytes <= READ_ONCE(qos->small_io_bytes);
+    u64 allowed_ns = priority ? PORTFS_QOS_PRIORITY_DEBT_MS * NSEC_PER_MSEC : 0;
+
+    struct portfs_qos_uid *uid_qos = NULL;
+    if (READ_ONCE(qos->uid_bps_limit) || READ_ONCE(qos->uid_iops_limit))
+    {
+        uid_qos = portfs_qos_get_uid(qos, from_kuid(&init_user_ns, current_fsuid()));
+        if (IS_ERR(uid_qos))
+            uid_qos = NULL;
+    }
+
+    spin_lock(&qos->lock);
+    u64 now = ktime_get_ns();
+
+    portfs_bucket_refill(&qos->bytes, now);
+    portfs_bucket_refill(&qos->ios, now);
+    u64 wait_ns = portfs_bucket_charge(&qos->bytes, bytes, allowed_ns);
+    wait_ns = max(wait_ns, portfs_bucket_charge(&qos->ios, 1, allowed_ns));
+
+    if (uid_qos)
+    {
+        portfs_bucket_refill(&uid_qos->bytes, now);
+        portfs_bucket_refill(&uid_qos->ios, now);
+        wait_ns = max(wait_ns, portfs_bucket_charge(&uid_qos->bytes, bytes, allowed_ns));
+        wait_ns = max(wait_ns, portfs_bucket_charge(&uid_qos->ios, 1, allowed_ns));
+    }
+
+    if (priority)
+        qos->priority_ios++;
+    if (wait_ns)
+    {
+        qos->throttled_ios++;
+        qos->throttled_ns += wait_ns;
+    }
+    spin_unlock(&qos->lock);
+
+    if (wait_ns == 0)
+        return 0;
+
+    schedule_timeout_killable(nsecs_to_jiffies(wait_ns));
+    if (fatal_signal_pending(current))
+        return -EINTR;
+
+    return 0;
+}
+
+
+u64 portfs_qos_get_param(struct portfs_qos *qos, enum portfs_qos_param param)
+{
+    u64 value = 0;
+
+    spin_lock(&qos->lock);
+    switch (param)
+    {
+        case PORTFS_QOS_BPS_LIMIT:
+            value = qos->bytes.rate;
+            break;
+        case PORTFS_QOS_IOPS_LIMIT:
+            value = qos->ios.rate;
+            break;
+        case PORTFS_QOS_UID_BPS_LIMIT:
+            value = qos->uid_bps_limit;
+            break;
+        case PORTFS_QOS_UID_IOPS_LIMIT:
+            value = qos->uid_iops_limit;
+            break;
+        case PORTFS_QOS_SMALL_IO_BYTES:
+            value = qos->small_io_bytes;
+            break;
+        case PORTFS_QOS_THROTTLED_IOS:
+            value = qos->throttled_ios;
+            break;
+        case PORTFS_QOS_THROTTLED_MS:
+            value = div_u64(qos->throttled_ns, NSEC_PER_MSEC);
+            break;
+        case PORTFS_QOS_PRIORITY_IOS:
+            value = qos->priority_ios;
+            break;
+    }
+    spin_unlock(&qos->lock);
+
+    return value;
+}
+
+
+int portfs_qos_set_param(struct portfs_qos *qos, enum portfs_qos_param param, u64 value)
+{
+    if (value > PORTFS_QOS_MAX_RATE)
+        return -EINVAL;
+
+    u64 now = ktime_get_ns();
+    struct portfs_qos_uid *uid_qos;
+    int bkt;
+    int err = 0;
+
+    spin_lock(&qos->lock);
+    switch (param)
+    {
+        case PORTFS_QOS_BPS_LIMIT:
+            portfs_bucket_set_rate(&qos->bytes, value, now);
+            break;
+        case PORTFS_QOS_IOPS_LIMIT:
+            portfs_bucket_set_rate(&qos->ios, value, now);
+            break;
+        case PORTFS_QOS_UID_BPS_LIMIT:
+            qos->uid_bps_limit = value;
+            hash_for_each(qos->uids, bkt, uid_qos, node)
+                portfs_bucket_set_rate(&uid_qos->bytes, value, now);
+            break;
+        case PORTFS_QOS_UID_IOPS_LIMIT:
+            qos->uid_iops_limit = value;
+            hash_for_each(qos->uids, bkt, uid_qos, node)
+                portfs_bucket_set_rate(&uid_qos->ios, value, now);
+            break;
+        case PORTFS_QOS_SMALL_IO_BYTES:
+            qos->small_io_bytes = value;
+            break;
+        default:
+            err = -EPERM;
+            break;
+    }
+    spin_unlock(&qos->lock);
+
+    return err;
+}
+
+
+int portfs_qos_init(struct portfs_superblock *psb)
+{
+    struct portfs_qos *qos = kzalloc(sizeof(*qos), GFP_KERNEL);
+    if (!qos)
+    {
+        pr_err("portfs_qos_init: Could not allocate memory");
+        return -ENOMEM;
+    }
+
+    spin_lock_init(&qos->lock);
+    hash_init(qos->uids);
+    qos->small_io_bytes = PORTFS_QOS_DEFAULT_SMALL_IO;
+
+    psb->qos = qos;
+    return 0;
+}
+
+
+void portfs_qos_destroy(struct portfs_superblock *psb)
+{
+    struct portfs_qos *qos = psb->qos;
+    if (!qos)
+        return;
+
+    struct portfs_qos_uid *uid_qos;
+    struct hlist_node *tmp;
+    int bkt;
+    hash_for_each_safe(qos->uids, bkt, tmp, uid_qos, node)
+    {
+        hash_del(&uid_qos->node);
+        kfree(uid_qos);
+    }
+
+    kfree(qos);
+    psb->qos = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef QOS_H
+#define QOS_H
+
+#include <linux/types.h>
+
+struct portfs_superblock;
+struct portfs_qos;
+
+enum portfs_qos_param
+{
+    PORTFS_QOS_BPS_LIMIT,       // Bytes per second for the whole mount, 0 = unlimited
+    PORTFS_QOS_IOPS_LIMIT,      // Requests per second for the whole mount, 0 = unlimited
+    PORTFS_QOS_UID_BPS_LIMIT,   // Bytes per second for each uid, 0 = unlimited
+    PORTFS_QOS_UID_IOPS_LIMIT,  // Requests per second for each uid, 0 = unlimited
+    PORTFS_QOS_SMALL_IO_BYTES,  // Synchronous I/O up to this size is served ahead of bulk I/O
+    PORTFS_QOS_THROTTLED_IOS,
+    PORTFS_QOS_THROTTLED_MS,
+    PORTFS_QOS_PRIORITY_IOS,
+};
+
+int portfs_qos_init(struct portfs_superblock *psb);
+void portfs_qos_destroy(struct portfs_superblock *psb);
+
+int portfs_qos_throttle(struct portfs_superblock *psb, size_t bytes, bool sync);
+
+u64 portfs_qos_get_param(struct portfs_qos *qos, enum portfs_qos_param param);
+int portfs_qos_set_param(struct portfs_qos *qos, enum portfs_qos_param param, u64 value);
+
+#endif // QOS_H
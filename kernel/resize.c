@@ -0,0 +1,188 @@
+/*
+ *
+ * Online grow of a mounted image.
+ * The storage file is extended first, then the allocation groups are made
+ * to cover the new blocks. When the block bitmap is too short for the new
+ * size it is copied into a larger run, preferably at the start of the new
+ * space, and the superblock is switched over to it. The new blocks become
+ * allocatable only after the superblock is on disk, so a crash leaves
+ * either the old or the new size behind. Allocations wait while this
+ * runs, see portfs_free_space_freeze().
+ */
+#include "resize.h"
+
+#include "linux/fs.h"
+#include "linux/math64.h"
+
+#include "portfs.h"
+#include "block_bitmap.h"
+#include "buffer_cache.h"
+#include "extent_alloc.h"
+#include "shared_structs.h"
+
+static u64 portfs_max_total_blocks(struct portfs_superblock *psb)
+{
+    // 48-bit extent starts on 64-bit images, the 32-bit superblock field otherwise
+    return portfs_has_64bit(psb) ? (1ULL << 48) - 1 : U32_MAX;
+}
+
+
+/*
+ * Copies the bitmap into a run of 'size' blocks: right after the old end
+ * of the image if the new space can hold it there, otherwise taken out of
+ * the existing free space. Returns the run in 'out'.
+ */
+static int portfs_relocate_bitmap(struct portfs_superblock *psb, u64 old_total, u64 new_total,
+                                  u32 size, struct extent *out)
+{
+    bool in_new_space = size <= new_total - old_total
+                        && old_total + size <= PORTFS_META_BLOCK_LIMIT;
+    if (in_new_space)
+    {
+        out->start_block = old_total;
+        out->length = size;
+    }
+    else
+    {
+        int err = portfs_free_space_take_low(psb, size, out);
+        if (err)
+        {
+            pr_err("portfs_relocate_bitmap: No room for a bitmap of %u blocks", size);
+            return err;
+        }
+    }
+
+    // The old bitmap must be complete on disk before it is copied and abandoned
+    int err = portfs_bcache_flush(psb);
+    if (!err)
+        err = portfs_copy_block_bitmap(psb, out->start_block, size);
+    if (err && !in_new_space)
+        portfs_free_space_add(psb, out->start_block, out->length);
+    return err;
+}
+
+
+// Adds [start_block, end_block) to the free space, the range may be longer than one extent
+static int portfs_add_new_space(struct portfs_superblock *psb, u64 start_block, u64 end_block)
+{
+    while (start_block < end_block)
+    {
+        u32 length = min_t(u64, end_block - start_block, U32_MAX);
+        int err = portfs_free_space_add(psb, start_block, length);
+        if (err)
+            return err;
+        start_block += length;
+    }
+
+    return 0;
+}
+
+
+// Writes the relocated bitmap out and waits for it, before a superblock points at it
+static int portfs_sync_new_bitmap(struct portfs_superblock *psb, const struct extent *bitmap)
+{
+    int err = portfs_bcache_flush(psb);
+    if (err)
+        return err;
+
+    loff_t start = (loff_t)bitmap->start_block * psb->block_size;
+    loff_t end = start + (loff_t)bitmap->length * psb->block_size - 1;
+    return vfs_fsync_range(storage_filp, start, end, 1);
+}
+
+
+/*
+ * 'old_bitmap' is only filled in once the superblock with the relocated
+ * bitmap is on disk, until then the old bitmap is the one in use.
+ */
+static int portfs_grow_frozen(struct super_block *sb, u64 new_total, struct extent *old_bitmap)
+{
+    struct portfs_superblock *psb = sb->s_fs_info;
+    const u64 old_total = psb->total_blocks;
+    const u32 bitmap_size = DIV_ROUND_UP_ULL(new_total, (u64)psb->block_size * BITS_PER_BYTE);
+    const struct extent prev_bitmap = {
+        .start_block = psb->block_bitmap_start,
+        .length = psb->block_bitmap_size,
+    };
+
+    int err = portfs_storage_extend(psb, new_total);
+    if (!err)
+        err = portfs_free_space_extend(psb, new_total);
+    if (err)
+    {
+        pr_err("portfs_grow_frozen: Failed to extend the image, error: %d", err);
+        portfs_free_space_extend(psb, old_total);
+        return err;
+    }
+
+    struct extent new_bitmap = { .start_block = 0, .length = 0 };
+    if (bitmap_size > psb->block_bitmap_size)
+    {
+        err = portfs_relocate_bitmap(psb, old_total, new_total, bitmap_size, &new_bitmap);
+        if (err)
+        {
+            portfs_free_space_extend(psb, old_total);
+            return err;
+        }
+    }
+
+    psb->total_blocks = new_total;
+    if (new_bitmap.length > 0)
+    {
+        psb->block_bitmap_start = new_bitmap.start_block;
+        psb->block_bitmap_size = new_bitmap.length;
+        err = set_blocks_allocated(psb, new_bitmap.start_block, new_bitmap.length);
+        if (!err)
+            err = portfs_sync_new_bitmap(psb, &new_bitmap);
+    }
+    if (!err)
+        err = portfs_commit_superblock(sb);
+
+    if (err)
+    {
+        pr_err("portfs_grow_frozen: Failed to commit the new size, error: %d", err);
+        psb->total_blocks = old_total;
+        psb->block_bitmap_start = prev_bitmap.start_block;
+        psb->block_bitmap_size = prev_bitmap.length;
+        if (new_bitmap.length > 0 && new_bitmap.start_block < old_total)
+            portfs_free_space_add(psb, new_bitmap.start_block, new_bitmap.length);
+        portfs_free_space_extend(psb, old_total);
+        return err;
+    }
+
+    // Nothing is cached for the abandoned bitmap, its blocks may be reused
+    if (new_bitmap.length > 0)
+    {
+        for (u32 i = 0; i < prev_bitmap.length; ++i)
+            portfs_bforget(psb, prev_bitmap.start_block + i);
+        *old_bitmap = prev_bitmap;
+    }
+
+    u64 new_space = old_total;
+    if (new_bitmap.length > 0 && new_bitmap.start_block == old_total)
+        new_space += new_bitmap.length;
+    return portfs_add_new_space(psb, new_space, new_total);
+}
+
+
+int portfs_grow_fs(struct super_block *sb, u64 new_total)
+{
+    struct portfs_superblock *psb = sb->s_fs_info;
+
+    if (new_total > portfs_max_total_blocks(psb))
+        return -EFBIG;
+
+    portfs_free_space_freeze(psb);
+    u64 old_total = psb->total_blocks;
+    struct extent old_bitmap = { .start_block = 0, .length = 0 };
+    int err = new_total > old_total ? portfs_grow_frozen(sb, new_total, &old_bitmap) : -EINVAL;
+    portfs_free_space_thaw(psb);
+
+    // A bitmap that was relocated before lives in the data area and can be reused
+    if (old_bitmap.length > 0 && old_bitmap.start_block >= psb->data_start)
+        portfs_release_blocks(psb, old_bitmap.start_block, old_bitmap.length);
+
+    if (!err)
+        pr_info("portfs_grow_fs: Grown from %llu to %llu blocks", old_total, new_total);
+    return err;
+}
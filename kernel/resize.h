@@ -0,0 +1,10 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include <linux/types.h>
+
+struct super_block;
+
+int portfs_grow_fs(struct super_block *sb, u64 new_total);
+
+#endif // RESIZE_H
@@ -1,3 +1,5 @@
+#include "linux/falloc.h"
+
 #include "portfs.h"
 #include "shared_structs.h"
 
@@ -14,3 +16,22 @@ struct file* portfs_storage_init(char *path)
 
     return storage_filp;
 }
+
+
+// Gives the blocks back to the host filesystem, they read back as zeroes
+int portfs_storage_punch(struct portfs_superblock *psb, u64 start_block, u32 length)
+{
+    loff_t offset = (loff_t)start_block * psb->block_size;
+    loff_t len = (loff_t)length * psb->block_size;
+    return vfs_fallocate(storage_filp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+
+// Makes the storage file large enough for 'total_blocks', the new part stays sparse
+int portfs_storage_extend(struct portfs_superblock *psb, u64 total_blocks)
+{
+    loff_t size = (loff_t)total_blocks * psb->block_size;
+    if (i_size_read(file_inode(storage_filp)) >= size)
+        return 0;
+    return vfs_truncate(&storage_filp->f_path, size);
+}
@@ -1,21 +1,31 @@
 #include "linux/fs.h"
+#include "linux/pagemap.h"
 #include "linux/stat.h"
 #include "linux/types.h"
-#include "linux/vmalloc.h"
 
 #include "portfs.h"
 #include "inode.h"
 #include "file.h"
 #include "directory.h"
+#include "buffer_cache.h"
+#include "block_bitmap.h"
+#include "discard.h"
+#include "extent_alloc.h"
+#include "filetable.h"
+#include "free_index.h"
+#include "qos.h"
+#include "sysfs.h"
 #include "shared_structs.h"
 
 #define PORTFS_MAGIC 0x506F5254
 #define MAX_STORAGE_PATH 256
-#define WRITE_BUFFER_SIZE 1*1024*1024
 
 static char storage_path[MAX_STORAGE_PATH];
 struct file* storage_filp;
 
+static int portfs_sync_fs(struct super_block *sb, int wait);
+static int portfs_write_entry(struct portfs_superblock *psb, struct filetable_entry *fe);
+
 static void portfs_put_super(struct super_block *sb)
 {
     pr_info("Killing superblock\n");
@@ -24,20 +34,33 @@ static void portfs_put_super(struct super_block *sb)
     if (!psb)
         return;
 
-    if (psb->filetable)
+    portfs_sysfs_unregister(psb);
+
+    // Evicting the last inodes may have reclaimed blocks after the final sync
+    portfs_free_space_commit_begin(psb);
+    int err = portfs_sync_fs(sb, 1);
+    if (err)
+        pr_err("portfs_put_super: Failed to sync filesystem");
+
+    portfs_filetable_destroy(psb);
+
+    // Pending discards must not punch through the free space index
+    portfs_discard_destroy(psb);
+
+    // Lets the next mount skip the block bitmap scan and trust the inode bitmap
+    if (!err && psb->alloc_groups && !portfs_free_index_save(psb))
+        psb->flags |= PORTFS_SB_FREE_INDEX;
+    if (!err && portfs_has_ino_bitmap(psb))
+        psb->flags |= PORTFS_SB_INO_BITMAP;
+    if (psb->flags & (PORTFS_SB_FREE_INDEX | PORTFS_SB_INO_BITMAP))
     {
-        for (int i = 0; i < psb->max_file_count; ++i)
-        {
-            if (psb->filetable[i].indirect_extents)
-            {
-                kfree(psb->filetable[i].indirect_extents);
-            }
-        }
-        vfree(psb->filetable);
+        if (portfs_commit_superblock(sb))
+            pr_err("portfs_put_super: Failed to write superblock");
     }
+    portfs_free_space_destroy(psb);
 
-    if (psb->block_bitmap)
-        vfree(psb->block_bitmap);
+    portfs_bcache_destroy(psb);
+    portfs_qos_destroy(psb);
 
     kfree(psb);
     sb->s_fs_info = NULL;
@@ -52,6 +75,19 @@ static void portfs_evict_inode(struct inode *inode)
 {
     pr_info("portfs_evict_inode: inode %lu\n", inode->i_ino);
     pr_info("portfs_evict_inode: inode %lu, i_count=%d\n", inode->i_ino, atomic_read(&inode->i_count));
+
+    // Unlinked files have already given back all of their blocks and their slot
+    struct filetable_entry *fe = inode->i_private;
+    if (fe)
+    {
+        struct portfs_superblock *psb = inode->i_sb->s_fs_info;
+        if (S_ISREG(fe->mode) && portfs_reclaim_prealloc(psb, fe))
+            pr_warn("portfs_evict_inode: Failed to reclaim preallocated blocks");
+        if (portfs_write_entry(psb, fe))
+            pr_err("portfs_evict_inode: Failed to write back inode %lu", inode->i_ino);
+        portfs_fe_release(psb, fe);
+    }
+
     inode->i_private = NULL;
     clear_inode(inode);
 }
@@ -66,52 +102,52 @@ static int portfs_sync_superblock(struct super_block *sb)
         return -EINVAL;
     }
 
-    struct portfs_disk_superblock dsb;
     struct portfs_superblock *msb = sb->s_fs_info;
-
-    memset(&dsb, 0, sizeof(dsb));
-    dsb.magic_number = cpu_to_be32(msb->magic_number);
-    dsb.block_size = cpu_to_be32(msb->block_size);
-    dsb.total_blocks = cpu_to_be32(msb->total_blocks);
-    dsb.block_bitmap_start = cpu_to_be32(msb->block_bitmap_start);
-    dsb.block_bitmap_size = cpu_to_be32(msb->block_bitmap_size);
-    dsb.filetable_start = cpu_to_be32(msb->filetable_start);
-    dsb.filetable_size = cpu_to_be32(msb->filetable_size);
-    dsb.data_start = cpu_to_be32(msb->data_start);
-    dsb.checksum = cpu_to_be32(msb->checksum);
-    dsb.max_file_count = cpu_to_be32(msb->max_file_count);
-
-    ssize_t bytes_written = kernel_write(storage_filp, &dsb, sizeof(dsb), 0);
-    if (bytes_written < 0)
-    {
-        pr_err("portfs_sync_superblock: Failed to write superblock");
-        return bytes_written;
-    }
-
+    struct portfs_buf *buf = portfs_bread(msb, 0);
+    if (IS_ERR(buf))
+    {
+        pr_err("portfs_sync_superblock: Failed to read superblock");
+        return PTR_ERR(buf);
+    }
+
+    struct portfs_disk_superblock *dsb = buf->data;
+    memset(dsb, 0, sizeof(*dsb));
+    dsb->magic_number = cpu_to_be32(msb->magic_number);
+    dsb->block_size = cpu_to_be32(msb->block_size);
+    dsb->total_blocks = cpu_to_be32(lower_32_bits(msb->total_blocks));
+    dsb->block_bitmap_start = cpu_to_be32(msb->block_bitmap_start);
+    dsb->block_bitmap_size = cpu_to_be32(msb->block_bitmap_size);
+    dsb->filetable_start = cpu_to_be32(msb->filetable_start);
+    dsb->filetable_size = cpu_to_be32(msb->filetable_size);
+    dsb->data_start = cpu_to_be32(msb->data_start);
+    dsb->checksum = cpu_to_be32(msb->checksum);
+    dsb->max_file_count = cpu_to_be32(msb->max_file_count);
+    dsb->flags = cpu_to_be32(msb->flags);
+    dsb->free_index_start = cpu_to_be32(msb->free_index_start);
+    dsb->free_index_extents = cpu_to_be32(msb->free_index_extents);
+    dsb->free_index_crc = cpu_to_be32(msb->free_index_crc);
+    dsb->features = cpu_to_be32(msb->features);
+    if (portfs_has_64bit(msb))
+        dsb->total_blocks_hi = cpu_to_be32(upper_32_bits(msb->total_blocks));
+    dsb->ino_bitmap_start = cpu_to_be32(msb->ino_bitmap_start);
+    dsb->ino_bitmap_size = cpu_to_be32(msb->ino_bitmap_size);
+    dsb->next_free_ino_hint = cpu_to_be32(msb->next_free_ino_hint);
+
+    portfs_bmark_dirty(buf);
+    portfs_brelse(buf);
     return 0;
 }
 
 
-static void portfs_fill_file_data(struct filetable_entry *src_entry,
-                                  struct disk_filetable_entry *dst_entry)
+// Writes the superblock and waits until it is on disk
+int portfs_commit_superblock(struct super_block *sb)
 {
-    if (!src_entry || !dst_entry)
-        return;
-
-    dst_entry->ino = cpu_to_be32(src_entry->ino);
-    dst_entry->mode = cpu_to_be16(src_entry->mode);
-    dst_entry->size_in_bytes = cpu_to_be64(src_entry->size_in_bytes);
-
-    dst_entry->file.extent_count = cpu_to_be16(src_entry->file.extent_count);
-    dst_entry->file.extents_block = cpu_to_be32(src_entry->file.extents_block);
-
-    for (int k = 0; k < src_entry->file.extent_count; ++k)
-    {
-        dst_entry->file.direct_extents[k].start_block =
-            cpu_to_be32(src_entry->file.direct_extents[k].start_block);
-        dst_entry->file.direct_extents[k].length =
-            cpu_to_be32(src_entry->file.direct_extents[k].length);
-    }
+    int err = portfs_sync_superblock(sb);
+    if (!err)
+        err = portfs_bcache_flush(sb->s_fs_info);
+    if (!err)
+        err = vfs_fsync(storage_filp, 0);
+    return err;
 }
 
 
@@ -121,275 +157,176 @@ static int portfs_write_file_data(struct portfs_superblock *psb,
     if (!psb || !src_entry)
         return -EINVAL;
 
-    if (src_entry->file.extent_count < DIRECT_EXTENTS
-        || src_entry->file.extents_block == 0
-        || !src_entry->indirect_extents)
+    // An extent tree that is not loaded has not changed since it was read
+    if (!src_entry->extent_map)
         return 0;
 
     pr_info("portfs_write_file_data: Writing file data");
-    size_t count = src_entry->file.extent_count - DIRECT_EXTENTS;
-    size_t total_size = count * sizeof(struct disk_extent);
-
-    struct disk_extent *disk_extent_entries_buf = kmalloc(total_size, GFP_KERNEL);
-    if (!disk_extent_entries_buf)
-    {
-        pr_err("portfs_write_file_data: Failed to allocate memory");
-        return -ENOMEM;
-    }
+    return portfs_write_extents(psb, src_entry);
+}
 
-    for (size_t i = 0; i < count; ++i)
-    {
-        struct disk_extent *dst_extent = &disk_extent_entries_buf[i];
-        struct extent *src_extent = &src_entry->indirect_extents[i];
 
-        dst_extent->start_block = cpu_to_be32(src_extent->start_block);
-        dst_extent->length = cpu_to_be32(src_extent->length);
-    }
-
-    loff_t pos = src_entry->file.extents_block * psb->block_size;
-    ssize_t bytes_written = kernel_write(storage_filp, disk_extent_entries_buf,
-                                         total_size, &pos);
-    if (bytes_written < 0)
-    {
-        pr_err("portfs_write_file_data: Failed to write file data");
-        kfree(disk_extent_entries_buf);
-        return bytes_written;
-    }
-    if (bytes_written != total_size)
-    {
-        pr_err("portfs_write_file_data: Failed to write file data");
-        kfree(disk_extent_entries_buf);
-        return -EIO;
-    }
+// Hands the entry and the metadata blocks it owns to the buffer cache
+static int portfs_write_entry(struct portfs_superblock *psb, struct filetable_entry *fe)
+{
+    int err = portfs_write_file_data(psb, fe);
+    if (!err && S_ISDIR(fe->mode))
+        err = portfs_write_dir_data(psb, fe);
+    if (err)
+        return err;
 
-    kfree(disk_extent_entries_buf);
-    return 0;
+    return portfs_fe_write(psb, fe);
 }
 
 
-static int portfs_write_dir_data(struct portfs_superblock *psb,
-                                 struct filetable_entry *src_entry)
+/*
+ * Called by writeback for inodes marked dirty. The entry and the metadata
+ * it owns only reach the buffer cache here, sync_fs writes them out.
+ */
+static int portfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-    if (psb == NULL || src_entry == NULL)
-        return -EINVAL;
+    struct portfs_superblock *psb = inode->i_sb->s_fs_info;
 
-    if (src_entry->dir.dir_block == 0 || !src_entry->dir_entries)
-        return 0;
+    inode_lock(inode);
+    struct filetable_entry *fe = inode->i_private;
+    int err = fe ? portfs_write_entry(psb, fe) : 0;
+    inode_unlock(inode);
 
-    pr_info("portfs_write_dir_data: Writing directory data");
+    if (err)
+        pr_err("portfs_write_inode: Failed to write inode %lu, error: %d", inode->i_ino, err);
+    return err;
+}
 
-    size_t count = get_max_dir_entries(psb);
-    size_t total_size = count * sizeof(struct disk_dir_entry);
 
-    struct disk_dir_entry *disk_dir_entries_buf = kmalloc(total_size, GFP_KERNEL);
-    if (!disk_dir_entries_buf)
-    {
-        pr_err("portfs_write_dir_data: Failed to allocate memory");
-        return -ENOMEM;
-    }
+/*
+ * Dirty inodes have been handed to portfs_write_inode() by now, so only
+ * the dirty buffers are written, in block order. The first, non-waiting
+ * call of a sync runs before the inodes are written back and starts a
+ * free space commit, the waiting one completes it.
+ */
+static int portfs_sync_fs(struct super_block *sb, int wait)
+{
+    pr_info("portfs_sync_fs: Syncing portfs filesystem");
+    struct portfs_superblock *psb = sb->s_fs_info;
+    if (!wait)
+        portfs_free_space_commit_begin(psb);
 
-    for (size_t i = 0; i < count; ++i)
+    int err = 0;
+    err = portfs_sync_superblock(sb);
+    if (err != 0)
     {
-        struct disk_dir_entry *dst_dir_entry = &disk_dir_entries_buf[i];
-        struct dir_entry *src_dir_entry = &src_entry->dir_entries[i];
-
-        dst_dir_entry->inode_number = __be32_to_cpu(src_dir_entry->inode_number);
-        strncpy(dst_dir_entry->name, src_dir_entry->name,
-                sizeof(dst_dir_entry->name));
+        pr_err("portfs_sync_fs: Failed to sync superblock");
+        return err;
     }
 
-    pr_info("portfs_write_dir_data: Writing directory data: ino = %u, dirdata_block = %d",
-                src_entry->ino, src_entry->dir.dir_block);
-    loff_t pos = src_entry->dir.dir_block * psb->block_size;
-    ssize_t bytes_written = kernel_write(storage_filp, disk_dir_entries_buf,
-                                         total_size, &pos);
-    if (bytes_written < 0)
+    err = portfs_bcache_flush(psb);
+    if (err != 0)
     {
-        pr_err("portfs_write_dir_data: Failed to write directory data");
-        kfree(disk_dir_entries_buf);
-        return bytes_written;
+        pr_err("portfs_sync_fs: Failed to flush metadata buffers");
+        return err;
     }
-    if (bytes_written != total_size)
+
+    if (storage_filp)
     {
-        pr_err("portfs_write_dir_data: Failed to write directory data");
-        kfree(disk_dir_entries_buf);
-        return -EIO;
+        err = vfs_fsync(storage_filp, 0);
+        if (err != 0)
+        {
+            pr_err("portfs_sync_fs: Failed to sync storage file");
+            return err;
+        }
     }
 
-    kfree(disk_dir_entries_buf);
+    if (wait)
+        portfs_free_space_commit_end(psb);
     return 0;
 }
 
 
-static void portfs_fill_dir_data(struct filetable_entry *src_entry,
-                                 struct disk_filetable_entry *dst_entry)
+// Writes a cached metadata block to the storage file and starts its writeback
+static int portfs_write_meta_block(struct portfs_superblock *psb, u32 block)
 {
-    if (!src_entry || !dst_entry)
-        return;
-
-    dst_entry->ino = cpu_to_be32(src_entry->ino);
-    dst_entry->mode = cpu_to_be16(src_entry->mode);
-    dst_entry->size_in_bytes = cpu_to_be64(src_entry->size_in_bytes);
+    struct portfs_buf *buf = portfs_bread(psb, block);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    int err = portfs_bsync(buf);
+    portfs_brelse(buf);
+    if (err)
+        return err;
 
-    dst_entry->dir.dir_block = cpu_to_be32(src_entry->dir.dir_block);
-    dst_entry->dir.parent_dir_ino = cpu_to_be32(src_entry->dir.parent_dir_ino);
+    loff_t block_pos = (loff_t)block * psb->block_size;
+    return filemap_fdatawrite_range(storage_filp->f_mapping, block_pos,
+                                    block_pos + psb->block_size - 1);
 }
 
 
-static int portfs_write_filetable(struct portfs_superblock *psb)
+/*
+ * Persists the metadata of a single regular file: its filetable entry,
+ * its extent tree blocks and the bitmap blocks covering its blocks.
+ * Their writeback is started together and waited on, then syncing the
+ * entry's range flushes them all at once. With 'datasync' the metadata
+ * is only written if the size or the extents changed since the last
+ * sync, otherwise this just flushes.
+ */
+int portfs_sync_file_entry(struct portfs_superblock *psb, struct filetable_entry *fe,
+                           bool datasync)
 {
-    pr_info("portfs_write_filetable: Writing filetable");
-    if (!psb)
-    {
-        pr_err("portfs_write_block_bitmap: Invalid parameter");
+    if (!psb || !fe)
         return -EINVAL;
-    }
-
-    struct disk_filetable_entry *disk_entries_buf;
-    struct filetable_entry *filetable = psb->filetable;
+    pr_info("portfs_sync_file_entry: Syncing file entry, ino = %u", fe->ino);
 
-    const size_t buf_entries = WRITE_BUFFER_SIZE / sizeof(*disk_entries_buf);
-    const size_t buf_size = buf_entries * sizeof(*disk_entries_buf);
-    disk_entries_buf = kmalloc(buf_size, GFP_KERNEL);
-    if (!disk_entries_buf)
-    {
-        pr_err("portfs_write_filetable: Failed to allocate memory");
-        return -ENOMEM;
-    }
-
-    loff_t current_offset = psb->filetable_start * psb->block_size;
-    for (int i = 0; i < psb->max_file_count; )
-    {
-        int curr_entries = 0;
-        for (; curr_entries < buf_entries && i < psb->max_file_count; ++curr_entries, ++i)
-        {
-            struct filetable_entry *src_entry = &filetable[i];
-            struct disk_filetable_entry *dst_entry = &disk_entries_buf[curr_entries];
-
-            switch (src_entry->mode & S_IFMT)
-            {
-                case S_IFREG:
-                {
-                    portfs_fill_file_data(src_entry, dst_entry);
-                    portfs_write_file_data(psb, src_entry);
-                    break;
-                }
-                case S_IFDIR:
-                {
-                    portfs_fill_dir_data(src_entry, dst_entry);
-                    portfs_write_dir_data(psb, src_entry);
-                    break;
-                }
-                default:
-                {
-                    break;
-                }
-            }
-        }
+    if (datasync && !fe->layout_dirty)
+        return portfs_fe_flush(psb, fe);
 
-        size_t curr_size = curr_entries * sizeof(*disk_entries_buf);
-        ssize_t bytes_written = kernel_write(storage_filp, (void *)disk_entries_buf, curr_size, &current_offset);
-        if (bytes_written != curr_size)
-        {
-            pr_err("portfs_write_filetable: Failed to write filetable");
-            kfree(disk_entries_buf);
-            return -EIO;
-        }
-
-        memset(disk_entries_buf, 0, curr_size);
-    }
-
-    kfree(disk_entries_buf);
-    return 0;
-}
+    // Writing the tree may add or release node blocks, so it goes first
+    int err = portfs_write_file_data(psb, fe);
+    if (err)
+        return err;
 
-static int portfs_write_block_bitmap(struct portfs_superblock *psb)
-{
-    pr_info("portfs_write_block_bitmap: Writing block bitmap");
-    if (!psb)
+    for (size_t i = 0; i < fe->file.extent_count && !err; ++i)
     {
-        pr_err("portfs_write_block_bitmap: Invalid parameter");
-        return -EINVAL;
+        const struct extent *ext = get_extent(fe, i);
+        err = portfs_write_block_bitmap_range(psb, ext->start_block, ext->length);
     }
 
-    uint8_t *block_bitmap = psb->block_bitmap;
-    loff_t file_offset = psb->block_bitmap_start * psb->block_size;
-    loff_t bitmap_offset = 0;
-    size_t remaining_bytes = psb->block_bitmap_size * psb->block_size;
-    int ret = 0;
-    while (remaining_bytes > 0)
+    struct portfs_extent_map *map = fe->extent_map;
+    for (u32 i = 0; map && i < map->node_count && !err; ++i)
     {
-        size_t bytes_to_write = min(WRITE_BUFFER_SIZE, remaining_bytes);
-        ssize_t bytes_written = kernel_write(storage_filp,
-                                            block_bitmap + bitmap_offset,
-                                            bytes_to_write,
-                                            &file_offset);
-        if (bytes_written < 0)
-        {
-            pr_err("portfs_write_block_bitmap: kernel_write failed");
-            ret = bytes_written;
-            break;
-        }
-        if ((size_t)bytes_written < bytes_to_write)
-        {
-            pr_err("portfs_write_block_bitmap: kernel_write short write");
-            ret = -EIO;
-            break;
-        }
-        bitmap_offset += bytes_to_write;
-        remaining_bytes -= bytes_written;
+        err = portfs_write_meta_block(psb, map->nodes[i]);
+        if (!err)
+            err = portfs_write_block_bitmap_range(psb, map->nodes[i], 1);
     }
-
-    if (ret == 0)
-        pr_info("portfs_write_block_bitmap: Block bitmap written successfully");
-    else
-        pr_err("portfs_write_block_bitmap: Failed to write block bitmap");
-
-    return ret;
-}
-
-static int portfs_sync_fs(struct super_block *sb, int wait)
-{
-    pr_info("portfs_sync_fs: Syncing portfs filesystem");
-    int err = 0;
-    err = portfs_sync_superblock(sb);
-    if (err != 0)
-    {
-        pr_err("portfs_sync_fs: Failed to sync superblock");
+    if (err)
         return err;
-    }
 
-    struct portfs_superblock *psb = sb->s_fs_info;
-    err = portfs_write_filetable(psb);
-    if (err != 0)
+    struct address_space *mapping = storage_filp->f_mapping;
+    err = filemap_fdatawait_range(mapping, (loff_t)psb->block_bitmap_start * psb->block_size,
+                                  (loff_t)(psb->block_bitmap_start + psb->block_bitmap_size)
+                                  * psb->block_size - 1);
+    for (u32 i = 0; map && i < map->node_count && !err; ++i)
     {
-        pr_err("portfs_sync_fs: Failed to write filetable");
-        return err;
+        loff_t block_pos = (loff_t)map->nodes[i] * psb->block_size;
+        err = filemap_fdatawait_range(mapping, block_pos, block_pos + psb->block_size - 1);
     }
-
-    err = portfs_write_block_bitmap(psb);
-    if (err != 0)
-    {
-        pr_err("portfs_sync_fs: Failed to write block bitmap");
+    if (err)
         return err;
-    }
 
-    if (storage_filp)
+    err = portfs_fe_sync(psb, fe);
+    if (err)
     {
-        err = vfs_fsync(storage_filp, 0);
-        if (err != 0)
-        {
-            pr_err("portfs_sync_fs: Failed to sync storage file");
-            return err;
-        }
+        pr_err("portfs_sync_file_entry: Failed to write filetable entry");
+        return err;
     }
 
+    fe->layout_dirty = false;
     return 0;
 }
 
 
 static const struct super_operations portfs_super_ops = {
+    .alloc_inode = portfs_alloc_inode,
+    .free_inode = portfs_free_inode,
     .put_super = portfs_put_super,
+    .write_inode = portfs_write_inode,
     .evict_inode = portfs_evict_inode,
     .sync_fs    = portfs_sync_fs,
 };
@@ -413,8 +350,28 @@ static int portfs_fill_superblock(struct portfs_superblock *msb, const struct po
     msb->data_start = be32_to_cpu(dsb->data_start);
     msb->checksum = be32_to_cpu(dsb->checksum);
     msb->max_file_count = be32_to_cpu(dsb->max_file_count);
+    msb->flags = be32_to_cpu(dsb->flags);
+    msb->free_index_start = be32_to_cpu(dsb->free_index_start);
+    msb->free_index_extents = be32_to_cpu(dsb->free_index_extents);
+    msb->free_index_crc = be32_to_cpu(dsb->free_index_crc);
+    msb->features = be32_to_cpu(dsb->features);
+    if (msb->features & ~PORTFS_SUPPORTED_FEATURES)
+    {
+        pr_err("portfs_fill_superblock: Unsupported features 0x%x",
+               msb->features & ~PORTFS_SUPPORTED_FEATURES);
+        return -EINVAL;
+    }
+    if (portfs_has_64bit(msb))
+        msb->total_blocks |= (u64)be32_to_cpu(dsb->total_blocks_hi) << 32;
+    msb->ino_bitmap_start = be32_to_cpu(dsb->ino_bitmap_start);
+    msb->ino_bitmap_size = be32_to_cpu(dsb->ino_bitmap_size);
+    msb->next_free_ino_hint = be32_to_cpu(dsb->next_free_ino_hint);
     msb->filetable = NULL;
-    msb->block_bitmap = NULL;
+    msb->bcache = NULL;
+    msb->qos = NULL;
+    msb->sysfs = NULL;
+    msb->alloc_groups = NULL;
+    msb->discard = NULL;
     msb->super = NULL;
     return 0;
 }
@@ -451,6 +408,7 @@ static struct portfs_superblock *portfs_init_superblock(void)
     {
         pr_err("portfs_init_superblock: Could not allocate memory for "
                "struct portfs_superblock");
+        kfree(dsb);
         return ERR_PTR(-ENOMEM);
     }
 
@@ -468,132 +426,32 @@ static struct portfs_superblock *portfs_init_superblock(void)
 }
 
 
-static int portfs_init_filetable(struct portfs_superblock *msb)
+// Parses the comma separated mount options, e.g. "path=/srv/portfs.img,discard"
+static void portfs_parse_options(char *options, bool *discard)
 {
-    if (!msb)
+    char *opt;
+    while ((opt = strsep(&options, ",")) != NULL)
     {
-        pr_err("portfs_init_filetable: Argument is NULL\n");
-        return -EINVAL;
-    }
+        if (!*opt)
+            continue;
 
-    size_t total_size = msb->filetable_size * msb->block_size;
-    struct disk_filetable_entry *disk_file_entry_array = vmalloc(total_size);
-    if (!disk_file_entry_array)
-    {
-        pr_err("portfs_init_filetable: Could not allocate memory, size is %zu\n", total_size);
-        return -ENOMEM;
-    }
-
-    msb->filetable = vmalloc(sizeof(*(msb->filetable)) * msb->max_file_count);
-    if (!(msb->filetable))
-    {
-        pr_err("portfs_init_filetable: Could not allocate memory, size is %zu\n", total_size);
-        vfree(disk_file_entry_array);
-        return -ENOMEM;
+        if (!strncmp(opt, "path=", 5))
+            strscpy(storage_path, opt + 5, MAX_STORAGE_PATH);
+        else if (!strcmp(opt, "discard"))
+            *discard = true;
+        else if (!strcmp(opt, "nodiscard"))
+            *discard = false;
+        else
+            pr_warn("portfs_parse_options: Ignoring unknown option %s\n", opt);
     }
-
-    loff_t offset = msb->filetable_start * msb->block_size;
-    ssize_t bytes_read = 0;
-    bytes_read = kernel_read(storage_filp, disk_file_entry_array, total_size, &offset);
-    if (bytes_read < 0)
-    {
-        pr_err("portfs_init_filetable: Failed to read filetable: %zd\n", bytes_read);
-        vfree(msb->filetable);
-        vfree(disk_file_entry_array);
-        msb->filetable = NULL;
-        return bytes_read;
-    }
-    if (bytes_read != total_size)
-    {
-        pr_err("portfs_init_filetable: Incomplete read of filetable: expected %zu, got %zd\n",
-               total_size, bytes_read);
-        vfree(msb->filetable);
-        vfree(disk_file_entry_array);
-        msb->filetable = NULL;
-        return -EIO;
-    }
-
-    for (int i = 0; i < msb->max_file_count; ++i)
-    {
-        struct disk_filetable_entry *disk_file_entry = &disk_file_entry_array[i];
-        struct filetable_entry *entry = &msb->filetable[i];
-
-        entry->ino         = be64_to_cpu(disk_file_entry->ino);
-        entry->mode = be16_to_cpu(disk_file_entry->mode);
-        entry->size_in_bytes = be64_to_cpu(disk_file_entry->size_in_bytes);
-
-
-        if ((entry->mode & S_IFMT) == S_IFREG)
-        {
-            entry->file.extent_count = be16_to_cpu(disk_file_entry->file.extent_count);
-            entry->file.extents_block = be32_to_cpu(disk_file_entry->file.extents_block);
-            for (size_t i = 0; i < DIRECT_EXTENTS; ++i)
-            {
-                entry->file.direct_extents[i].start_block =
-                    be32_to_cpu(disk_file_entry->file.direct_extents[i].start_block);
-                entry->file.direct_extents[i].length =
-                    be32_to_cpu(disk_file_entry->file.direct_extents[i].length);
-            }
-        }
-        else if ((entry->mode & S_IFMT) == S_IFDIR)
-        {
-            entry->dir.dir_block = be32_to_cpu(disk_file_entry->dir.dir_block);
-            entry->dir.parent_dir_ino = be32_to_cpu(disk_file_entry->dir.parent_dir_ino);
-        }
-
-        entry->indirect_extents = NULL;
-        entry->dir_entries = NULL;
-    }
-
-    vfree(disk_file_entry_array);
-    pr_info("portfs_init_filetable: Filetable read successfully\n");
-    return 0;
-}
-
-
-static int portfs_init_block_bitmap(struct portfs_superblock * msb)
-{
-    if (!msb)
-    {
-        pr_err("portfs_init_filetable: Argument is NULL\n");
-        return -EINVAL;
-    }
-
-    loff_t offset = msb->block_bitmap_start * msb->block_size;
-    size_t block_bitmap_size = msb->block_bitmap_size * msb->block_size;
-
-    msb->block_bitmap = vmalloc(block_bitmap_size);
-    if (!(msb->block_bitmap))
-    {
-        pr_err("portfs_init_block_bitmap: Could not allocate memory\n");
-        return -ENOMEM;
-    }
-
-    ssize_t bytes_read = kernel_read(storage_filp,
-                                     msb->block_bitmap,
-                                     block_bitmap_size,
-                                     &offset);
-    if (bytes_read < 0)
-    {
-        vfree(msb->block_bitmap);
-        return bytes_read;
-    }
-    return 0;
 }
 
 
 static int portfs_init_fs_data(struct super_block *sb, void *data)
 {
     pr_info("portfs_init_fs_data: Initializing portfs service data\n");
-    char *options = (char*)data;
-
-    char *path = strstr(options, "path=");
-    if (path)
-    {
-        path += 5;
-        strncpy(storage_path, path, MAX_STORAGE_PATH - 1);
-        storage_path[MAX_STORAGE_PATH - 1] = '\0';
-    }
+    bool discard = false;
+    portfs_parse_options((char*)data, &discard);
 
     pr_info("portfs_init_fs_data: Mounting filesystem with storage file: %s\n", storage_path);
     storage_filp = portfs_storage_init(storage_path);
@@ -613,40 +471,113 @@ static int portfs_init_fs_data(struct super_block *sb, void *data)
     sb->s_fs_info = msb;
     msb->super = sb;
 
-    pr_info("portfs_init_fs_data: Initializing filetable\n");
     int err = 0;
-    err = portfs_init_filetable(msb);
+    err = portfs_bcache_init(msb);
+    if (err)
+    {
+        pr_err("portfs_init_fs_data: Error initializing buffer cache\n");
+        return err;
+    }
+
+    err = portfs_qos_init(msb);
+    if (err)
+    {
+        pr_err("portfs_init_fs_data: Error initializing I/O throttling\n");
+        return err;
+    }
+
+    pr_info("portfs_init_fs_data: Initializing filetable\n");
+    err = portfs_filetable_init(msb);
     if (err)
     {
         pr_err("portfs_init_fs_data: Error initializing filetable\n");
         return err;
     }
-    pr_info("portfs_init_fs_data: Initializing block bitmap\n");
-    err = portfs_init_block_bitmap(msb);
+    pr_info("portfs_init_fs_data: Building free extent tree\n");
+    err = portfs_free_space_init(msb);
     if (err)
     {
-        pr_err("portfs_init_fs_data: Error initializing block bitmap\n");
+        pr_err("portfs_init_fs_data: Error building free extent tree\n");
         return err;
     }
+    if (msb->flags & (PORTFS_SB_FREE_INDEX | PORTFS_SB_INO_BITMAP))
+    {
+        // The index lives in free blocks, it is stale as soon as they are reused.
+        // The inode bitmap is rebuilt at the next mount unless this one ends cleanly.
+        msb->flags &= ~(PORTFS_SB_FREE_INDEX | PORTFS_SB_INO_BITMAP);
+        err = portfs_commit_superblock(sb);
+        if (err)
+        {
+            pr_err("portfs_init_fs_data: Error invalidating free space index\n");
+            return err;
+        }
+    }
+    if (discard)
+    {
+        pr_info("portfs_init_fs_data: Enabling online discard\n");
+        err = portfs_discard_init(msb);
+        if (err)
+        {
+            pr_err("portfs_init_fs_data: Error enabling online discard\n");
+            return err;
+        }
+    }
     pr_info("portfs_init_fs_data: Finished\n");
     return 0;
 }
 
 
-static struct filetable_entry *portfs_get_fe_root(struct portfs_superblock *psb)
+/*
+ * Undoes portfs_init_fs_data() and the sysfs registration when mounting
+ * fails. The superblock has no root then, so portfs_put_super() is never
+ * called.
+ */
+static void portfs_destroy_fs_data(struct super_block *sb)
 {
-    if (!psb)
-        return ERR_PTR(-EINVAL);
+    struct portfs_superblock *psb = sb->s_fs_info;
+    if (psb)
+    {
+        portfs_sysfs_unregister(psb);
+        portfs_discard_destroy(psb);
+        portfs_free_space_destroy(psb);
+        portfs_filetable_destroy(psb);
+        portfs_bcache_destroy(psb);
+        portfs_qos_destroy(psb);
+        kfree(psb);
+        sb->s_fs_info = NULL;
+    }
+
+    if (!IS_ERR_OR_NULL(storage_filp))
+        filp_close(storage_filp, NULL);
+    storage_filp = NULL;
+}
+
+
+// Loads the root directory's entry, creating it on a freshly formatted image
+static int portfs_get_fe_root(struct portfs_superblock *psb, struct filetable_entry *fe,
+                              umode_t mode)
+{
+    int err = portfs_fe_lookup(psb, 1, fe);
+    if (err != -ENOENT)
+        return err;
 
-    size_t num_entries = (psb->filetable_size * psb->block_size) / sizeof(*psb->filetable);
-    for (size_t i = 0; i < num_entries; ++i)
+    // The first slot of an empty filetable, so the root gets inode number 1
+    err = portfs_fe_alloc(psb, fe, mode);
+    if (err)
+        return err;
+    if (fe->ino != 1)
     {
-        struct filetable_entry *fe = &psb->filetable[i];
-        if (fe->ino == 1)
-            return fe;
+        pr_err("portfs_get_fe_root: Root entry is missing from a used filetable");
+        portfs_fe_delete(psb, fe);
+        return -EUCLEAN;
     }
 
-    return NULL;
+    fe->size_in_bytes = 0;
+    fe->dir.parent_dir_ino = 1;
+    err = portfs_fe_write(psb, fe);
+    if (err)
+        portfs_fe_release(psb, fe);
+    return err;
 }
 
 
@@ -658,6 +589,7 @@ static int portfs_fill_super(struct super_block *sb, void *data, int silent)
     if (err)
     {
         pr_err("portfs_fill_super: Error initializing fs meta data\n");
+        portfs_destroy_fs_data(sb);
         return err;
     }
 
@@ -666,11 +598,15 @@ static int portfs_fill_super(struct super_block *sb, void *data, int silent)
     sb->s_magic = PORTFS_MAGIC;
     sb->s_op = &portfs_super_ops;
 
+    err = portfs_sysfs_register(sb->s_fs_info);
+    if (err)
+        pr_warn("portfs_fill_super: Failed to register sysfs entries\n");
+
     root_inode = new_inode(sb);
     if (!root_inode)
     {
         pr_err("portfs_fill_super: Failed to create root_inode\n");
-        filp_close(storage_filp, NULL);
+        portfs_destroy_fs_data(sb);
         return -ENOMEM;
     }
 
@@ -681,32 +617,26 @@ static int portfs_fill_super(struct super_block *sb, void *data, int silent)
     root_inode->i_op = &portfs_dir_inode_operations;
     root_inode->i_fop = &portfs_dir_file_operations;
 
-    struct filetable_entry *file_entry = portfs_get_fe_root(sb->s_fs_info);
-    if (IS_ERR(file_entry))
-        return PTR_ERR(file_entry);
-
-    if (!file_entry)
+    struct filetable_entry *file_entry = &PORTFS_I(root_inode)->fe;
+    err = portfs_get_fe_root(sb->s_fs_info, file_entry, root_inode->i_mode);
+    if (err)
     {
-        file_entry = portfs_find_free_file_entry(sb->s_fs_info);
-        if (file_entry == NULL)
-            return -ENOSPC;
-
-        file_entry->mode = root_inode->i_mode;
-        file_entry->ino = root_inode->i_ino;
-        file_entry->size_in_bytes = 0;
-        file_entry->dir.parent_dir_ino = root_inode->i_ino;
+        iput(root_inode);
+        portfs_destroy_fs_data(sb);
+        return err;
     }
 
     root_inode->i_private = file_entry;
+    root_inode->i_size = file_entry->size_in_bytes;
 
     insert_inode_hash(root_inode);
 
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root)
     {
+        // d_make_root() has already dropped the root inode
         pr_err("portfs_fill_super: Failed to make_root\n");
-        iput(root_inode);
-        filp_close(storage_filp, NULL);
+        portfs_destroy_fs_data(sb);
         return -ENOMEM;
     }
     pr_info("portfs_fill_super: Finished\n");
@@ -723,10 +653,34 @@ static struct dentry *portfs_mount(struct file_system_type *fs_type,
 
 static int __init portfs_init(void)
 {
-    int err = register_filesystem(&portfs_type);
+    int err = portfs_sysfs_init();
+    if (err)
+    {
+        pr_err("Failed to create portfs sysfs directory\n");
+        return err;
+    }
+
+    err = portfs_inode_cache_init();
+    if (!err)
+    {
+        err = portfs_extent_map_cache_init();
+        if (err)
+            portfs_inode_cache_exit();
+    }
+    if (err)
+    {
+        pr_err("Failed to create portfs inode caches\n");
+        portfs_sysfs_exit();
+        return err;
+    }
+
+    err = register_filesystem(&portfs_type);
     if (err)
     {
         pr_err("Failed to register portfs filesystem\n");
+        portfs_extent_map_cache_exit();
+        portfs_inode_cache_exit();
+        portfs_sysfs_exit();
         return err;
     }
 
@@ -738,6 +692,9 @@ static int __init portfs_init(void)
 static void __exit portfs_exit(void)
 {
     unregister_filesystem(&portfs_type);
+    portfs_extent_map_cache_exit();
+    portfs_inode_cache_exit();
+    portfs_sysfs_exit();
     pr_info("portfs unloaded.\n");
 }
 
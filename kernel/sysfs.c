@@ -0,0 +1,206 @@
+/*
+ *
+ * Per-mount sysfs interface: /sys/fs/portfs/<major:minor>/
+ */
+#include "sysfs.h"
+
+#include "linux/fs.h"
+#include "linux/kobject.h"
+#include "linux/kstrtox.h"
+#include "linux/slab.h"
+#include "linux/sysfs.h"
+
+#include "portfs.h"
+#include "extent_alloc.h"
+#include "qos.h"
+#include "shared_structs.h"
+
+struct portfs_sysfs
+{
+    struct kobject kobj;
+    struct portfs_superblock *psb;
+};
+
+struct portfs_qos_attr
+{
+    struct kobj_attribute attr;
+    enum portfs_qos_param param;
+};
+
+static struct kset *portfs_kset;
+
+
+static struct portfs_superblock *kobj_to_psb(struct kobject *kobj)
+{
+    return container_of(kobj, struct portfs_sysfs, kobj)->psb;
+}
+
+
+static ssize_t portfs_qos_attr_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    struct portfs_qos_attr *qos_attr = container_of(attr, struct portfs_qos_attr, attr);
+    struct portfs_superblock *psb = kobj_to_psb(kobj);
+
+    return sysfs_emit(buf, "%llu\n", portfs_qos_get_param(psb->qos, qos_attr->param));
+}
+
+
+static ssize_t portfs_qos_attr_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    struct portfs_qos_attr *qos_attr = container_of(attr, struct portfs_qos_attr, attr);
+    struct portfs_superblock *psb = kobj_to_psb(kobj);
+
+    u64 value;
+    int err = kstrtou64(buf, 0, &value);
+    if (err)
+        return err;
+
+    err = portfs_qos_set_param(psb->qos, qos_attr->param, value);
+    if (err)
+        return err;
+
+    return count;
+}
+
+
+#define PORTFS_QOS_ATTR_RW(_name, _param)                                           \
+    static struct portfs_qos_attr portfs_attr_##_name = {                           \
+        .attr = __ATTR(_name, 0644, portfs_qos_attr_show, portfs_qos_attr_store),   \
+        .param = _param,                                                            \
+    }
+
+#define PORTFS_QOS_ATTR_RO(_name, _param)                                           \
+    static struct portfs_qos_attr portfs_attr_##_name = {                           \
+        .attr = __ATTR(_name, 0444, portfs_qos_attr_show, NULL),                    \
+        .param = _param,                                                            \
+    }
+
+PORTFS_QOS_ATTR_RW(qos_bps_limit, PORTFS_QOS_BPS_LIMIT);
+PORTFS_QOS_ATTR_RW(qos_iops_limit, PORTFS_QOS_IOPS_LIMIT);
+PORTFS_QOS_ATTR_RW(qos_uid_bps_limit, PORTFS_QOS_UID_BPS_LIMIT);
+PORTFS_QOS_ATTR_RW(qos_uid_iops_limit, PORTFS_QOS_UID_IOPS_LIMIT);
+PORTFS_QOS_ATTR_RW(qos_small_io_bytes, PORTFS_QOS_SMALL_IO_BYTES);
+PORTFS_QOS_ATTR_RO(qos_throttled_ios, PORTFS_QOS_THROTTLED_IOS);
+PORTFS_QOS_ATTR_RO(qos_throttled_ms, PORTFS_QOS_THROTTLED_MS);
+PORTFS_QOS_ATTR_RO(qos_priority_ios, PORTFS_QOS_PRIORITY_IOS);
+
+#define PORTFS_FREE_SPACE_ATTR_RO(_name, _field)                                    \
+    static ssize_t _name##_show(struct kobject *kobj,                               \
+                                struct kobj_attribute *attr, char *buf)             \
+    {                                                                               \
+        struct portfs_free_space_stats stats;                                       \
+        portfs_free_space_get_stats(kobj_to_psb(kobj), &stats);                     \
+        return sysfs_emit(buf, "%llu\n", (u64)stats._field);                        \
+    }                                                                               \
+    static struct kobj_attribute portfs_attr_##_name = __ATTR_RO(_name)
+
+PORTFS_FREE_SPACE_ATTR_RO(alloc_groups, groups);
+PORTFS_FREE_SPACE_ATTR_RO(free_blocks, free_blocks);
+PORTFS_FREE_SPACE_ATTR_RO(free_extents, free_extents);
+PORTFS_FREE_SPACE_ATTR_RO(free_extent_max, max_free_extent);
+PORTFS_FREE_SPACE_ATTR_RO(alloc_requests, alloc_requests);
+PORTFS_FREE_SPACE_ATTR_RO(alloc_extents, alloc_extents);
+PORTFS_FREE_SPACE_ATTR_RO(alloc_goal_hits, goal_hits);
+
+
+// Free extent counts by length: "<min_blocks>+: <count>" per power of two
+static ssize_t free_extent_histogram_show(struct kobject *kobj,
+                                          struct kobj_attribute *attr, char *buf)
+{
+    u32 histogram[PORTFS_FREE_HISTOGRAM_BUCKETS];
+    portfs_free_space_get_histogram(kobj_to_psb(kobj), histogram);
+
+    ssize_t len = 0;
+    for (int i = 0; i < PORTFS_FREE_HISTOGRAM_BUCKETS; ++i)
+        len += sysfs_emit_at(buf, len, "%u+: %u\n", 1U << i, histogram[i]);
+    return len;
+}
+static struct kobj_attribute portfs_attr_free_extent_histogram = __ATTR_RO(free_extent_histogram);
+
+
+static struct attribute *portfs_attrs[] = {
+    &portfs_attr_qos_bps_limit.attr.attr,
+    &portfs_attr_qos_iops_limit.attr.attr,
+    &portfs_attr_qos_uid_bps_limit.attr.attr,
+    &portfs_attr_qos_uid_iops_limit.attr.attr,
+    &portfs_attr_qos_small_io_bytes.attr.attr,
+    &portfs_attr_qos_throttled_ios.attr.attr,
+    &portfs_attr_qos_throttled_ms.attr.attr,
+    &portfs_attr_qos_priority_ios.attr.attr,
+    &portfs_attr_alloc_groups.attr,
+    &portfs_attr_free_blocks.attr,
+    &portfs_attr_free_extents.attr,
+    &portfs_attr_free_extent_max.attr,
+    &portfs_attr_free_extent_histogram.attr,
+    &portfs_attr_alloc_requests.attr,
+    &portfs_attr_alloc_extents.attr,
+    &portfs_attr_alloc_goal_hits.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(portfs);
+
+
+static void portfs_sysfs_release(struct kobject *kobj)
+{
+    kfree(container_of(kobj, struct portfs_sysfs, kobj));
+}
+
+
+static const struct kobj_type portfs_sb_ktype = {
+    .sysfs_ops = &kobj_sysfs_ops,
+    .default_groups = portfs_groups,
+    .release = portfs_sysfs_release,
+};
+
+
+int portfs_sysfs_register(struct portfs_superblock *psb)
+{
+    struct portfs_sysfs *sysfs = kzalloc(sizeof(*sysfs), GFP_KERNEL);
+    if (!sysfs)
+        return -ENOMEM;
+
+    sysfs->psb = psb;
+    sysfs->kobj.kset = portfs_kset;
+
+    dev_t dev = psb->super->s_dev;
+    int err = kobject_init_and_add(&sysfs->kobj, &portfs_sb_ktype, NULL,
+                                   "%u:%u", MAJOR(dev), MINOR(dev));
+    if (err)
+    {
+        pr_err("portfs_sysfs_register: Failed to add kobject");
+        kobject_put(&sysfs->kobj);
+        return err;
+    }
+
+    psb->sysfs = sysfs;
+    return 0;
+}
+
+
+void portfs_sysfs_unregister(struct portfs_superblock *psb)
+{
+    if (!psb->sysfs)
+        return;
+
+    kobject_del(&psb->sysfs->kobj);
+    kobject_put(&psb->sysfs->kobj);
+    psb->sysfs = NULL;
+}
+
+
+int portfs_sysfs_init(void)
+{
+    portfs_kset = kset_create_and_add("portfs", NULL, fs_kobj);
+    if (!portfs_kset)
+        return -ENOMEM;
+    return 0;
+}
+
+
+void portfs_sysfs_exit(void)
+{
+    kset_unregister(portfs_kset);
+    portfs_kset = NULL;
+}
@@ -0,0 +1,12 @@
+#ifndef SYSFS_H
+#define SYSFS_H
+
+struct portfs_superblock;
+
+int portfs_sysfs_init(void);
+void portfs_sysfs_exit(void);
+
+int portfs_sysfs_register(struct portfs_superblock *psb);
+void portfs_sysfs_unregister(struct portfs_superblock *psb);
+
+#endif // SYSFS_H
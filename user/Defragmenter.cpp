@@ -0,0 +1,74 @@
+#include "Defragmenter.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <iostream>
+#include <system_error>
+
+#include "portfs_ioctl.h"
+
+Defragmenter::Defragmenter(uint32_t minExtents) : minExtents_(minExtents)
+{
+}
+
+
+int Defragmenter::run(const std::filesystem::path& mountDirPath)
+{
+    std::error_code ec;
+    auto it = std::filesystem::recursive_directory_iterator(
+        mountDirPath, std::filesystem::directory_options::skip_permission_denied, ec);
+    if (ec)
+    {
+        std::cerr << "\nCould not open directory " << mountDirPath << ": " << ec.message();
+        return -1;
+    }
+
+    for (const auto& entry : it)
+    {
+        if (entry.is_symlink() || !entry.is_regular_file())
+            continue;
+
+        if (defragmentFile(entry.path()) != 0)
+            ++filesFailed_;
+    }
+
+    std::cout << "\nChecked " << filesChecked_ << " files, defragmented " << filesDefragmented_
+              << ", moved " << movedBlocks_ << " blocks, failed " << filesFailed_ << ".\n";
+    return filesFailed_ == 0 ? 0 : -1;
+}
+
+
+int Defragmenter::defragmentFile(const std::filesystem::path& filePath)
+{
+    ++filesChecked_;
+
+    int fd = open(filePath.c_str(), O_RDWR);
+    if (fd == -1)
+    {
+        std::cerr << "\nCould not open " << filePath << ": " << std::strerror(errno);
+        return -1;
+    }
+
+    portfs_defrag_args args{};
+    args.min_extents = minExtents_;
+    if (ioctl(fd, PORTFS_IOC_DEFRAG, &args) != 0)
+    {
+        std::cerr << "\nCould not defragment " << filePath << ": " << std::strerror(errno);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (args.moved_blocks > 0)
+    {
+        std::cout << "\n" << filePath.string() << ": " << args.extents_before << " -> "
+                  << args.extents_after << " extents";
+        ++filesDefragmented_;
+        movedBlocks_ += args.moved_blocks;
+    }
+    return 0;
+}
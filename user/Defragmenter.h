@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+class Defragmenter
+{
+public:
+    static constexpr uint32_t defaultMinExtents{8};
+
+    explicit Defragmenter(uint32_t minExtents);
+
+    int run(const std::filesystem::path& mountDirPath);
+
+private:
+    int defragmentFile(const std::filesystem::path& filePath);
+
+    uint32_t minExtents_;
+    uint64_t filesChecked_{0};
+    uint64_t filesDefragmented_{0};
+    uint64_t filesFailed_{0};
+    uint64_t movedBlocks_{0};
+};
@@ -0,0 +1,40 @@
+#include "Resizer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <iostream>
+
+#include "portfs_ioctl.h"
+
+Resizer::Resizer(uint64_t newSizeInBytes) : newSizeInBytes_(newSizeInBytes)
+{
+}
+
+
+int Resizer::run(const std::filesystem::path& mountDirPath)
+{
+    int fd = open(mountDirPath.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        std::cerr << "\nCould not open directory " << mountDirPath << ": " << std::strerror(errno);
+        return -1;
+    }
+
+    portfs_grow_args args{};
+    args.new_size = newSizeInBytes_;
+    if (ioctl(fd, PORTFS_IOC_GROW, &args) != 0)
+    {
+        std::cerr << "\nCould not grow " << mountDirPath << ": " << std::strerror(errno);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    std::cout << "\nImage mounted at " << mountDirPath.string() << " now has "
+              << args.total_blocks << " blocks.\n";
+    return 0;
+}
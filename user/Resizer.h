@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+class Resizer
+{
+public:
+    explicit Resizer(uint64_t newSizeInBytes);
+
+    int run(const std::filesystem::path& mountDirPath);
+
+private:
+    uint64_t newSizeInBytes_;
+};
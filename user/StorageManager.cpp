@@ -7,6 +7,7 @@
 #include <arpa/inet.h>
 #include <sys/mount.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -50,6 +51,10 @@ int  StorageManager::formatStorage()
     {
         return -1;
     }
+    if (writeInodeBitmap(msb) != 0)
+    {
+        return -1;
+    }
     if (writeBlockBitmap(msb) != 0)
     {
         return -1;
@@ -68,15 +73,30 @@ portfs_superblock StorageManager::createSuperblock()
     msb.total_blocks    = storageFileSizeInBytes_ / msb.block_size;
     msb.filetable_start = 1;
 
-    uint32_t maxFilesCount       = storageFileSizeInBytes_ / averageFileSize_;
-    uint32_t filetableSizeBytes  = maxFilesCount * sizeof(disk_filetable_entry);
-    uint32_t filetableSizeBlocks = filetableSizeBytes / msb.block_size;
+    // Images past 2^32 blocks need 64-bit block numbers in data extents
+    if (msb.total_blocks > UINT32_MAX)
+        msb.features |= PORTFS_FEATURE_64BIT;
+
+    // Inode numbers follow filetable slots, the kernel finds an inode without a scan
+    // and a free one through the inode bitmap. Directories grow block by block through extents
+    // and hold variable length entries that carry the file type for readdir
+    msb.features |= PORTFS_FEATURE_INO_SLOT | PORTFS_FEATURE_INO_BITMAP
+                    | PORTFS_FEATURE_DIR_EXTENTS | PORTFS_FEATURE_DIR_FILETYPE
+                    | PORTFS_FEATURE_DIR_VARLEN;
+
+    uint32_t maxFilesCount       = std::min<uint64_t>(storageFileSizeInBytes_ / averageFileSize_, UINT32_MAX);
+    uint64_t filetableSizeBytes  = uint64_t{maxFilesCount} * sizeof(disk_filetable_entry);
+    uint32_t filetableSizeBlocks = (filetableSizeBytes + msb.block_size - 1) / msb.block_size;
 
     msb.filetable_size     = filetableSizeBlocks;
-    msb.block_bitmap_start = msb.filetable_start + msb.filetable_size;
+    msb.ino_bitmap_start   = msb.filetable_start + msb.filetable_size;
+
+    uint64_t bitmapBlockBits = uint64_t{msb.block_size} * 8;
+    msb.ino_bitmap_size      = (uint64_t{maxFilesCount} + bitmapBlockBits - 1) / bitmapBlockBits;
+    msb.next_free_ino_hint   = 1;
+    msb.block_bitmap_start   = msb.ino_bitmap_start + msb.ino_bitmap_size;
 
-    uint32_t blockBitmapSizeBytes  = msb.total_blocks / 8;
-    uint32_t blockBitmapSizeBlocks = blockBitmapSizeBytes / msb.block_size;
+    uint32_t blockBitmapSizeBlocks = (msb.total_blocks + bitmapBlockBits - 1) / bitmapBlockBits;
 
     msb.block_bitmap_size = blockBitmapSizeBlocks;
     msb.data_start        = msb.block_bitmap_start + msb.block_bitmap_size;
@@ -85,7 +105,7 @@ portfs_superblock StorageManager::createSuperblock()
 
     msb.last_mount_time = 0;
     msb.last_write_time = 0;
-    msb.flags           = 0;
+    msb.flags           = PORTFS_SB_INO_BITMAP; // Empty filetable, empty inode bitmap
 
     return msb;
 }
@@ -93,10 +113,10 @@ portfs_superblock StorageManager::createSuperblock()
 
 int StorageManager::writeSuperblock(const portfs_superblock& msb)
 {
-    portfs_superblock dsb{};
+    portfs_disk_superblock dsb{};
     dsb.magic_number       = htobe32(msb.magic_number);
     dsb.block_size         = htobe32(msb.block_size);
-    dsb.total_blocks       = htobe32(msb.total_blocks);
+    dsb.total_blocks       = htobe32(static_cast<uint32_t>(msb.total_blocks));
     dsb.filetable_start    = htobe32(msb.filetable_start);
     dsb.filetable_size     = htobe32(msb.filetable_size);
     dsb.block_bitmap_start = htobe32(msb.block_bitmap_start);
@@ -107,6 +127,12 @@ int StorageManager::writeSuperblock(const portfs_superblock& msb)
     dsb.last_mount_time    = htobe64(msb.last_mount_time);
     dsb.last_write_time    = htobe64(msb.last_write_time);
     dsb.flags              = htobe32(msb.flags);
+    dsb.features           = htobe32(msb.features);
+    if (msb.features & PORTFS_FEATURE_64BIT)
+        dsb.total_blocks_hi = htobe32(static_cast<uint32_t>(msb.total_blocks >> 32));
+    dsb.ino_bitmap_start   = htobe32(msb.ino_bitmap_start);
+    dsb.ino_bitmap_size    = htobe32(msb.ino_bitmap_size);
+    dsb.next_free_ino_hint = htobe32(msb.next_free_ino_hint);
 
     std::ofstream file(storageFilePath_, std::ios::binary | std::ios::out | std::ios::in);
     if (!file.is_open())
@@ -133,7 +159,7 @@ int StorageManager::writeFileTable(const portfs_superblock& msb)
         return -1;
     }
 
-    file.seekp(msb.filetable_start * msb.block_size);
+    file.seekp(uint64_t{msb.filetable_start} * msb.block_size);
     if (!file)
     {
         std::cerr << "Failed to seek to offset.\n";
@@ -178,7 +204,31 @@ int StorageManager::writeFileTable(const portfs_superblock& msb)
 }
 
 
+int StorageManager::writeInodeBitmap(const portfs_superblock& msb)
+{
+    if (zeroBlocks(msb, msb.ino_bitmap_start, msb.ino_bitmap_size) != 0)
+    {
+        return -1;
+    }
+
+    std::cout << "\nInode bitmap written successfully.";
+    return 0;
+}
+
+
 int StorageManager::writeBlockBitmap(const portfs_superblock& msb)
+{
+    if (zeroBlocks(msb, msb.block_bitmap_start, msb.block_bitmap_size) != 0)
+    {
+        return -1;
+    }
+
+    std::cout << "\nBlock bitmap written successfully.";
+    return 0;
+}
+
+
+int StorageManager::zeroBlocks(const portfs_superblock& msb, uint32_t startBlock, uint32_t blockCount)
 {
     std::ofstream file(storageFilePath_, std::ios::binary | std::ios::out | std::ios::in);
     if (!file.is_open())
@@ -187,7 +237,7 @@ int StorageManager::writeBlockBitmap(const portfs_superblock& msb)
         return -1;
     }
 
-    file.seekp(msb.block_bitmap_start * msb.block_size);
+    file.seekp(uint64_t{startBlock} * msb.block_size);
     if (!file)
     {
         std::cerr << "Failed to seek to offset.\n";
@@ -197,7 +247,7 @@ int StorageManager::writeBlockBitmap(const portfs_superblock& msb)
 
     constexpr size_t BUFFER_SIZE{1 * 1024 * 1024};
     std::vector<std::byte> buffer(BUFFER_SIZE, std::byte{0});
-    size_t remainingBytes = msb.block_bitmap_size * msb.block_size;
+    size_t remainingBytes = uint64_t{blockCount} * msb.block_size;
     while (remainingBytes > 0)
     {
         size_t bytesToWrite = std::min(BUFFER_SIZE, remainingBytes);
@@ -205,8 +255,6 @@ int StorageManager::writeBlockBitmap(const portfs_superblock& msb)
         remainingBytes -= bytesToWrite;
     }
 
-    std::cout << "\nBlock bitmap written successfully.";
-
     file.close();
     return 0;
 }
@@ -20,7 +20,9 @@ private:
     portfs_superblock createSuperblock();
     int writeSuperblock(const portfs_superblock& msb);
     int writeFileTable(const portfs_superblock& msb);
+    int writeInodeBitmap(const portfs_superblock& msb);
     int writeBlockBitmap(const portfs_superblock& msb);
+    int zeroBlocks(const portfs_superblock& msb, uint32_t startBlock, uint32_t blockCount);
 
     std::filesystem::path storageFilePath_;
     uint64_t storageFileSizeInBytes_{0};
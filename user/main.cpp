@@ -1,38 +1,65 @@
 #include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <string>
 
+#include "Defragmenter.h"
+#include "Resizer.h"
 #include "UIManager.h"
 
-int main()
+static void printUsage(const char* program)
 {
-    UIManager uiManager;
-    uiManager.start();
-    return 0;
+    std::cerr << "Usage:\n"
+              << "  " << program << "                                  interactive setup\n"
+              << "  " << program << " defrag <mount dir> [min extents]  defragment files with at least"
+              << " 'min extents' extents (default " << Defragmenter::defaultMinExtents << ")\n"
+              << "  " << program << " grow <mount dir> <size in GB>     grow the mounted image to the given size\n";
 }
 
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+int main(int argc, char* argv[])
+{
+    if (argc == 1)
+    {
+        UIManager uiManager;
+        uiManager.start();
+        return 0;
+    }
+
+    const std::string command{argv[1]};
+    if (command == "defrag" && (argc == 3 || argc == 4))
+    {
+        uint32_t minExtents = Defragmenter::defaultMinExtents;
+        if (argc == 4)
+        {
+            char* end = nullptr;
+            unsigned long value = std::strtoul(argv[3], &end, 10);
+            if (*end != '\0' || value == 0 || value > UINT32_MAX)
+            {
+                printUsage(argv[0]);
+                return 1;
+            }
+            minExtents = value;
+        }
+
+        Defragmenter defragmenter{minExtents};
+        return defragmenter.run(argv[2]) == 0 ? 0 : 1;
+    }
+
+    if (command == "grow" && argc == 4)
+    {
+        char* end = nullptr;
+        unsigned long long sizeInGb = std::strtoull(argv[3], &end, 10);
+        if (*end != '\0' || sizeInGb == 0 || sizeInGb > UINT64_MAX / (1024 * 1024 * 1024))
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+
+        Resizer resizer{sizeInGb * 1024 * 1024 * 1024};
+        return resizer.run(argv[2]) == 0 ? 0 : 1;
+    }
+
+    printUsage(argv[0]);
+    return 1;
+}